@@ -50,8 +50,8 @@ namespace flow_detector {
         // we assume that the noise range for X and Y is the same.
         // If the distance between two points is beyond this, it is beyond noise
         m_distanceThreshold = sqrt(2.0 * noiseRange * noiseRange) / MovingAverageNoiseReduction;
-        m_pubsub->subscribe(this, Topic::Sample);
-        m_pubsub->subscribe(this, Topic::SensorWasReset);
+        m_pubsub->subscribe<SampleTopic>(this);
+        m_pubsub->subscribe<SensorWasResetTopic>(this);
     }
 
     void FlowDetector::resetMeasurement() {
@@ -62,14 +62,13 @@ namespace flow_detector {
         m_confirmedGoodFit = CartesianEllipse();
     }
 
-    void FlowDetector::subscriberCallback(const Topic topic, const Payload& payload) {
-        if (topic == Topic::Sample) {
-            addSample(std::get<IntCoordinate>(payload));
-        }
-        else if (topic == Topic::SensorWasReset) {
-            resetMeasurement();
-        }
-    }    
+    void FlowDetector::onMessage(SampleTopic, const IntCoordinate& sample) {
+        addSample(sample);
+    }
+
+    void FlowDetector::onMessage(SensorWasResetTopic, const int&) {
+        resetMeasurement();
+    }
 
     // Private methods
 
@@ -162,7 +161,7 @@ namespace flow_detector {
             // reference point is the bottom of the ellipse
             m_foundPulse = passedBottom(quadrant, quadrantDifference);
             if (m_foundPulse) {
-                m_pubsub->publish(Topic::Pulse, true);
+                m_pubsub->publish<pub_sub::PulseTopic>(true);
                 m_searchingForPulse = false;
             }
         }
@@ -191,7 +190,7 @@ namespace flow_detector {
         // this can be jittery, so use a flag to check whether we counted, and reset the counter at the other side of the ellipse
 
         if (isPulse(quadrant)) {
-            m_pubsub->publish(Topic::Pulse, false);
+            m_pubsub->publish<pub_sub::PulseTopic>(false);
             m_searchingForPulse = false;
         }
     
@@ -264,7 +263,7 @@ namespace flow_detector {
             m_foundPulse = false;
             // if we have too many outliers in a row, we might have drifted (e.g. the sensor was moved), so we reset the measurement
             if (m_consecutiveOutlierCount > 0 && m_consecutiveOutlierCount % MaxConsecutiveOutliers == 0) {
-                m_pubsub->publish(Topic::Drifted, m_consecutiveOutlierCount);
+                m_pubsub->publish<pub_sub::DriftedTopic>(m_consecutiveOutlierCount);
                 resetMeasurement();
             }
             return;
@@ -283,7 +282,7 @@ namespace flow_detector {
     void FlowDetector::reportAnomaly(SensorState state, const uint16_t value) {
         m_foundAnomaly = true;
         m_wasSkipped = true;
-        m_pubsub->publish(Topic::Anomaly, static_cast<int16_t>(std::to_underlying(state)) + (value << 4));
+        m_pubsub->publish<pub_sub::AnomalyTopic>(static_cast<int16_t>(std::to_underlying(state)) + (value << 4));
     }
 
     int16_t  FlowDetector::noFitParameter(const double angleDistance, const bool fitSucceeded) {
@@ -303,7 +302,7 @@ namespace flow_detector {
         }
         else {
             // we need another round
-            m_pubsub->publish(Topic::NoFit, noFitParameter(m_tangentDistanceTravelled, fitSucceeded));
+            m_pubsub->publish<pub_sub::NoFitTopic>(noFitParameter(m_tangentDistanceTravelled, fitSucceeded));
         }
         m_tangentDistanceTravelled = 0;
     }
@@ -318,12 +317,12 @@ namespace flow_detector {
                 m_confirmedGoodFit = fittedEllipse;
             }
             else {
-                m_pubsub->publish(Topic::NoFit, noFitParameter(m_angleDistanceTravelled, false));
+                m_pubsub->publish<pub_sub::NoFitTopic>(noFitParameter(m_angleDistanceTravelled, false));
             }
         }
         else {
             // even though we didn't run a fit, we mark it as succeeded to see the difference with one that failed a fit
-            m_pubsub->publish(Topic::NoFit, noFitParameter(m_angleDistanceTravelled, true));
+            m_pubsub->publish<pub_sub::NoFitTopic>(noFitParameter(m_angleDistanceTravelled, true));
             m_ellipseFit.begin();
         }
         m_angleDistanceTravelled = 0;
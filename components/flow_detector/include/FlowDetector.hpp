@@ -37,8 +37,10 @@ namespace flow_detector {
     using pub_sub::Subscriber;
     using pub_sub::Topic;
     using pub_sub::IntCoordinate;
+    using pub_sub::SampleTopic;
+    using pub_sub::SensorWasResetTopic;
 
-    class FlowDetector : public pub_sub::Subscriber {
+    class FlowDetector : public pub_sub::TypedSubscriber<SampleTopic, SensorWasResetTopic> {
     public:
         FlowDetector(std::shared_ptr<pub_sub::PubSub>& pubsub, EllipseFit& ellipseFit);
         void begin(unsigned int noiseRange = 3);
@@ -47,7 +49,8 @@ namespace flow_detector {
         bool isSearching() const { return m_searchingForPulse; }
         Coordinate getMovingAverage() const { return m_movingAverage; }
         void resetMeasurement();
-        void subscriberCallback(const Topic topic, const Payload& payload) override;
+        void onMessage(SampleTopic topic, const IntCoordinate& sample) override;
+        void onMessage(SensorWasResetTopic topic, const int& payload) override;
         bool wasReset() const { return m_wasReset; }
         bool wasSkipped() const { return m_wasSkipped; }
         SensorSample ellipseCenterTimes10() const { auto center = m_confirmedGoodFit.getCenter(); return SensorSample(IntCoordinate::times10(center.x, center.y)); }
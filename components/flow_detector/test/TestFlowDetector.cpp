@@ -56,7 +56,8 @@ namespace flow_detector_test {
 #else
     void flowTestWithFile(const std::string& fileName, const ExpectedResult& expectedResult, const unsigned int noiseLimit = 3, const char* outFileName = nullptr) {
         {
-            auto pubsub = PubSub::create();
+            // dispatched on this task, sample by sample, so the results don't depend on how the tasks were scheduled
+            auto pubsub = PubSub::create(pub_sub::Transport::RingBuffer, pub_sub::LoopMode::Manual);
             ESP_LOGI("flowTestWithFile", "Reference count after create: %ld", pubsub->getReferenceCount());
             EllipseFit ellipseFit;
             FlowDetector flowDetector(pubsub, ellipseFit);
@@ -79,9 +80,9 @@ namespace flow_detector_test {
                 measurements >> measurement.y;
                 measurementCount++;    
                 pubsub->publish(Topic::Sample, measurement);
-                //if (measurementCount % 100 == 0) pubsub->waitForIdle();
+                pubsub->pump();
             }
-            pubsub->waitForIdle();
+            pubsub->pumpUntilIdle();
             printf("Read %d samples\n", measurementCount);
 
             pulseClient.close();
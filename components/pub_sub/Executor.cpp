@@ -0,0 +1,94 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+
+#include "Executor.hpp"
+#include "PubSub.hpp"
+#include "esp_log.h"
+#include <algorithm>
+
+namespace pub_sub {
+
+    Executor::Executor(const size_t taskCount, const UBaseType_t priority) : m_taskCount(std::clamp<size_t>(taskCount, 1, kMaxTasks)) {
+        // room for every bus plus a stop request per task
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        m_ready = xQueueCreateStatic(kMaxBuses + kMaxTasks, sizeof(PubSub*), m_readyItems.data(), &m_readyBuffer);
+#else
+        m_ready = xQueueCreate(kMaxBuses + kMaxTasks, sizeof(PubSub*));
+#endif
+        if (m_ready == nullptr) {
+            PubSub::throwRuntimeError("Executor", "Failed to create ready queue");
+        }
+        for (size_t index = 0; index < m_taskCount; index++) {
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+            m_tasks[index] = xTaskCreateStatic(
+                workerTask, "Executor", m_stacks[index].size(), this, priority, m_stacks[index].data(), &m_taskBuffers[index]);
+            const bool created = m_tasks[index] != nullptr;
+#else
+            const bool created = xTaskCreate(workerTask, "Executor", CONFIG_PUB_SUB_EXECUTOR_STACK_SIZE, this, priority, &m_tasks[index]) == pdPASS;
+#endif
+            if (!created) {
+                PubSub::throwRuntimeError("Executor", "Failed to create dispatcher task");
+            }
+        }
+    }
+
+    Executor::~Executor() {
+        if (m_busCount.load() != 0) {
+            ESP_LOGE("~Executor", "%u buses still attached", static_cast<unsigned>(m_busCount.load()));
+        }
+        // a null bus tells a task to stop; the tasks delete themselves
+        PubSub* stop = nullptr;
+        for (size_t index = 0; index < m_taskCount; index++) {
+            xQueueSend(m_ready, &stop, portMAX_DELAY);
+        }
+        while (m_finishedCount.load() < m_taskCount) {
+            vTaskDelay(1);
+        }
+        vQueueDelete(m_ready);
+    }
+
+    bool Executor::attach() {
+        auto count = m_busCount.load();
+        do {
+            if (count == kMaxBuses) return false;
+        } while (!m_busCount.compare_exchange_weak(count, count + 1));
+        return true;
+    }
+
+    void Executor::detach() {
+        m_busCount.fetch_sub(1);
+    }
+
+    bool Executor::enqueue(PubSub& bus) {
+        auto* entry = &bus;
+        return xQueueSend(m_ready, &entry, 0) == pdPASS;
+    }
+
+    bool Executor::enqueueFromIsr(PubSub& bus, BaseType_t* higherPriorityTaskWoken) {
+        auto* entry = &bus;
+        return xQueueSendFromISR(m_ready, &entry, higherPriorityTaskWoken) == pdPASS;
+    }
+
+    void Executor::workerTask(void* param) {
+        static_cast<Executor*>(param)->run();
+        vTaskDelete(nullptr);
+    }
+
+    void Executor::run() {
+        PubSub* bus = nullptr;
+        while (xQueueReceive(m_ready, &bus, portMAX_DELAY) == pdPASS && bus != nullptr) {
+            // the bus may be gone once serve returns false. If it can't go to the back of the queue, it gets another turn right away.
+            while (bus->serve(kBatchSize) && !enqueue(*bus)) {}
+        }
+        m_finishedCount.fetch_add(1);
+    }
+}
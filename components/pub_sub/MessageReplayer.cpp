@@ -0,0 +1,79 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+#include "MessageReplayer.hpp"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include <array>
+#include <utility>
+
+namespace pub_sub {
+
+    constexpr const char* kTag = "MessageReplayer";
+
+    MessageReplayer::MessageReplayer(std::shared_ptr<PubSub> pubsub, const ReplayTiming timing) :
+        m_pubsub(std::move(pubsub)), m_timing(timing) {}
+
+    void MessageReplayer::replay(const std::span<const MessageRecord> records) {
+        for (const auto& record : records) {
+            if (!m_started) {
+                m_started = true;
+                m_startMicros = esp_timer_get_time();
+                m_startTick = xTaskGetTickCount();
+                m_firstRecordTick = record.tick;
+            }
+            if (record.kind != PayloadKind::Int && record.kind != PayloadKind::Float && record.kind != PayloadKind::Coordinate) {
+                m_stats.skipped++;
+                continue;
+            }
+            if (m_timing == ReplayTiming::Original) {
+                waitForTick(record.tick);
+            }
+            m_pubsub->publish(record.topic, unpackValue(record.kind, record.value));
+            m_stats.replayed++;
+        }
+    }
+
+    bool MessageReplayer::replay(FILE* file) {
+        std::array<MessageRecord, kChunk> chunk;
+        size_t count;
+        while ((count = fread(chunk.data(), sizeof(MessageRecord), chunk.size(), file)) > 0) {
+            replay(std::span<const MessageRecord>(chunk.data(), count));
+        }
+        return feof(file) != 0 && ferror(file) == 0 && ftell(file) % sizeof(MessageRecord) == 0;
+    }
+
+    ReplayStats MessageReplayer::finish() {
+        if (!m_pubsub->waitForIdle()) {
+            // in a callback of the bus; the time then only covers publishing
+            ESP_LOGW(kTag, "Finished before the bus dispatched everything");
+        }
+        if (m_started) {
+            m_stats.elapsedMicros = esp_timer_get_time() - m_startMicros;
+            m_stats.messagesPerSecond = m_stats.elapsedMicros > 0 ? static_cast<double>(m_stats.replayed) * 1e6 / static_cast<double>(m_stats.elapsedMicros) : 0;
+        }
+        ESP_LOGI(kTag, "Replayed %u messages (%u skipped) in %lld us: %.0f msg/s",
+            static_cast<unsigned>(m_stats.replayed), static_cast<unsigned>(m_stats.skipped), static_cast<long long>(m_stats.elapsedMicros), m_stats.messagesPerSecond);
+        return m_stats;
+    }
+
+    // Private methods
+
+    void MessageReplayer::waitForTick(const uint32_t tick) {
+        // differences, so a tick count that wrapped during the recording still works
+        const auto target = m_startTick + (tick - m_firstRecordTick);
+        int32_t wait;
+        while ((wait = static_cast<int32_t>(target - xTaskGetTickCount())) > 0) {
+            vTaskDelay(wait);
+        }
+    }
+}
@@ -0,0 +1,166 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+#include "MessageTransport.hpp"
+#include "freertos/task.h"
+#include <algorithm>
+
+namespace pub_sub {
+
+    // RoomSignal
+
+    RoomSignal::RoomSignal(const size_t maxCount) :
+        m_semaphore(xSemaphoreCreateCountingStatic(maxCount, 0, &m_buffer)) {}
+
+    RoomSignal::~RoomSignal() {
+        if (m_semaphore != nullptr) {
+            vSemaphoreDelete(m_semaphore);
+        }
+    }
+
+    void RoomSignal::notify() {
+        // orders the receive that freed the slot before reading the waiters, to pair with the waiter counting itself in first
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load() > 0) {
+            // fails when the count is at its maximum already, which is fine: enough senders will wake up
+            xSemaphoreGive(m_semaphore);
+        }
+    }
+
+    // QueueTransport
+
+    QueueTransport::QueueTransport(const size_t depth) : QueueTransport(depth, nullptr) {}
+
+    QueueTransport::QueueTransport(const size_t depth, uint8_t* items, StaticQueue_t& queueBuffer, StaticSemaphore_t& mutexBuffer) :
+        QueueTransport(depth, nullptr, items, queueBuffer, mutexBuffer) {}
+
+    QueueTransport::QueueTransport(const size_t depth, MessagePacker* packer) : m_packer(packer), m_room(depth) {
+        m_mutex = xSemaphoreCreateMutex();
+        m_queue = xQueueCreate(depth, packer == nullptr ? sizeof(Message) : sizeof(WireMessage));
+    }
+
+    QueueTransport::QueueTransport(const size_t depth, MessagePacker* packer, uint8_t* items, StaticQueue_t& queueBuffer, StaticSemaphore_t& mutexBuffer) :
+        m_packer(packer), m_room(depth) {
+        m_mutex = xSemaphoreCreateMutexStatic(&mutexBuffer);
+        m_queue = xQueueCreateStatic(depth, packer == nullptr ? sizeof(Message) : sizeof(WireMessage), items, &queueBuffer);
+    }
+
+    QueueTransport::~QueueTransport() {
+        if (m_queue != nullptr) {
+            vQueueDelete(m_queue);
+        }
+        if (m_mutex != nullptr) {
+            vSemaphoreDelete(m_mutex);
+        }
+    }
+
+    bool QueueTransport::send(const Message& message, const TickType_t timeout) {
+        // without a packer, the queue itself waits for room, and nothing needs the mutex
+        if (m_packer == nullptr) {
+            return xQueueSend(m_queue, &message, timeout) == pdPASS;
+        }
+        return m_room.sendWhenRoom([this, &message] {
+            if (!lockPacker()) return false;
+            const bool sent = put(message);
+            unlockPacker();
+            return sent;
+        }, timeout);
+    }
+
+    bool QueueTransport::sendReplacingOldest(const Message& message, Message& dropped, bool& didDrop) {
+        // serializes the senders replacing the oldest. Plain senders of an unpacked queue don't take the mutex,
+        // so one of those can take the room we make. Then the new message doesn't go either.
+        if (xSemaphoreTake(m_mutex, kMutexTimeout + 2) != pdTRUE) {
+            return false;
+        }
+        didDrop = false;
+        bool sent = put(message);
+        if (!sent) {
+            didDrop = take(dropped);
+            sent = put(message);
+        }
+        xSemaphoreGive(m_mutex);
+        return sent;
+    }
+
+    size_t QueueTransport::sendBatch(const std::span<const Message> messages) {
+        auto rest = messages;
+        while (!rest.empty()) {
+            if (!lockPacker()) {
+                return messages.size() - rest.size();
+            }
+            // a packed queue can also run out of out of line slots, which ends the chunk early
+            size_t sent = 0;
+            while (sent < rest.size() && put(rest[sent])) {
+                sent++;
+            }
+            unlockPacker();
+            if (sent == 0) {
+                // full: wait until the event loop makes room for the first one
+                if (!send(rest.front(), portMAX_DELAY)) return messages.size() - rest.size();
+                sent = 1;
+            }
+            rest = rest.subspan(sent);
+        }
+        return messages.size();
+    }
+
+    bool QueueTransport::receive(Message& message) {
+        if (m_packer == nullptr) {
+            return take(message);
+        }
+        if (!lockPacker()) {
+            return false;
+        }
+        const bool result = take(message);
+        unlockPacker();
+        if (result) {
+            m_room.notify();
+        }
+        return result;
+    }
+
+    size_t QueueTransport::waiting() const {
+        return uxQueueMessagesWaiting(m_queue);
+    }
+
+    bool QueueTransport::lockPacker() const {
+        return m_packer == nullptr || xSemaphoreTake(m_mutex, 2 * kMutexTimeout) == pdTRUE;
+    }
+
+    void QueueTransport::unlockPacker() const {
+        if (m_packer != nullptr) {
+            xSemaphoreGive(m_mutex);
+        }
+    }
+
+    bool QueueTransport::put(const Message& message) {
+        if (m_packer == nullptr) {
+            return xQueueSend(m_queue, &message, 0) == pdPASS;
+        }
+        WireMessage packed;
+        if (!m_packer->pack(message, packed)) return false;
+        if (xQueueSend(m_queue, &packed, 0) == pdPASS) return true;
+        // the packer must only count messages that made it into the queue
+        m_packer->undo(packed);
+        return false;
+    }
+
+    bool QueueTransport::take(Message& message) {
+        if (m_packer == nullptr) {
+            return xQueueReceive(m_queue, &message, 0) == pdPASS;
+        }
+        WireMessage packed;
+        if (xQueueReceive(m_queue, &packed, 0) != pdPASS) return false;
+        m_packer->unpack(packed, message);
+        return true;
+    }
+}
@@ -0,0 +1,169 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+#include "PackedMessage.hpp"
+#include <bit>
+
+namespace pub_sub {
+
+    bool packValue(const Payload& payload, PayloadKind& kind, uint32_t& value) {
+        if (const auto* number = std::get_if<int>(&payload)) {
+            kind = PayloadKind::Int;
+            value = static_cast<uint32_t>(*number);
+            return true;
+        }
+        if (const auto* number = std::get_if<float>(&payload)) {
+            kind = PayloadKind::Float;
+            value = std::bit_cast<uint32_t>(*number);
+            return true;
+        }
+        if (const auto* coordinate = std::get_if<IntCoordinate>(&payload)) {
+            kind = PayloadKind::Coordinate;
+            value = static_cast<uint32_t>(static_cast<uint16_t>(coordinate->x)) | static_cast<uint32_t>(static_cast<uint16_t>(coordinate->y)) << 16;
+            return true;
+        }
+        return false;
+    }
+
+    Payload unpackValue(const PayloadKind kind, const uint32_t value) {
+        switch (kind) {
+            case PayloadKind::Float:
+                return std::bit_cast<float>(value);
+            case PayloadKind::Coordinate:
+                return IntCoordinate(static_cast<int16_t>(value & 0xffff), static_cast<int16_t>(value >> 16));
+            case PayloadKind::String:
+                return reinterpret_cast<const char*>(static_cast<uintptr_t>(value));
+            default:
+                return static_cast<int>(value);
+        }
+    }
+
+    // MessagePacker
+
+    bool MessagePacker::pack(const Message& message, WireMessage& packed) {
+        const auto topicIndex = static_cast<size_t>(message.topic);
+        const bool inRange = topicIndex < kTopicCount;
+        uint32_t sourceId = 0;
+        auto kind = PayloadKind::OutOfLine;
+        uint32_t value = 0;
+        const auto distance = inRange ? static_cast<int32_t>(message.sequence - m_packedSequence[topicIndex]) : 0;
+        const bool fits = inRange &&
+            distance >= INT16_MIN && distance <= INT16_MAX &&
+            findSource(message.source, sourceId) &&
+            packPayload(message, kind, value);
+        if (!fits) {
+            if (m_freeSlots == 0) return false;
+            const auto slot = static_cast<uint32_t>(std::countr_zero(m_freeSlots));
+            m_freeSlots &= ~(uint32_t{1} << slot);
+            m_outOfLine[slot] = message;
+            kind = PayloadKind::OutOfLine;
+            value = slot;
+            sourceId = 0;
+        }
+        packed.header = (inRange ? static_cast<uint32_t>(topicIndex) : 0) |
+            static_cast<uint32_t>(kind) << kKindShift |
+            sourceId << kSourceShift |
+            (message.sequence & 0xffff) << kSequenceShift;
+        packed.value = value;
+        setPublishedAt(packed, message.publishedAt);
+        if (inRange) {
+            m_previousSequence = m_packedSequence[topicIndex];
+            m_packedSequence[topicIndex] = message.sequence;
+        }
+        m_inFlight++;
+        return true;
+    }
+
+    void MessagePacker::unpack(const WireMessage& packed, Message& message) {
+        const auto kind = static_cast<PayloadKind>(packed.header >> kKindShift & kKindBits);
+        if (kind == PayloadKind::OutOfLine) {
+            message = m_outOfLine[packed.value];
+            m_freeSlots |= uint32_t{1} << packed.value;
+        } else {
+            const auto topicIndex = packed.header & kTopicBits;
+            const auto sourceId = packed.header >> kSourceShift & kSourceBits;
+            const auto previous = m_unpackedSequence[topicIndex];
+            const auto distance = static_cast<int16_t>(static_cast<uint16_t>((packed.header >> kSequenceShift) - previous));
+            message.source = sourceId == 0 ? nullptr : m_sources[sourceId - 1];
+            message.message = unpackValue(kind, packed.value);
+            message.topic = static_cast<Topic>(topicIndex);
+            message.sequence = previous + distance;
+            message.conflated = kind == PayloadKind::Conflated;
+            message.publishedAt = getPublishedAt(packed);
+        }
+        const auto topicIndex = static_cast<size_t>(message.topic);
+        if (topicIndex < kTopicCount) {
+            m_unpackedSequence[topicIndex] = message.sequence;
+        }
+        m_inFlight--;
+    }
+
+    void MessagePacker::undo(const WireMessage& packed) {
+        const auto kind = static_cast<PayloadKind>(packed.header >> kKindShift & kKindBits);
+        auto topicIndex = static_cast<size_t>(packed.header & kTopicBits);
+        if (kind == PayloadKind::OutOfLine) {
+            topicIndex = static_cast<size_t>(m_outOfLine[packed.value].topic);
+            m_freeSlots |= uint32_t{1} << packed.value;
+        }
+        if (topicIndex < kTopicCount) {
+            m_packedSequence[topicIndex] = m_previousSequence;
+        }
+        m_inFlight--;
+    }
+
+    size_t MessagePacker::outOfLineInUse() const {
+        return kOutOfLineSlots - static_cast<size_t>(std::popcount(m_freeSlots));
+    }
+
+    // Private methods
+
+    bool MessagePacker::packPayload(const Message& message, PayloadKind& kind, uint32_t& value) {
+        if (message.conflated) {
+            const auto* number = std::get_if<int>(&message.message);
+            if (number == nullptr) return false;
+            kind = PayloadKind::Conflated;
+            value = static_cast<uint32_t>(*number);
+            return true;
+        }
+        if (packValue(message.message, kind, value)) return true;
+        // on the ESP32 a pointer fits in the value, on a 64 bit host it doesn't
+        if constexpr (sizeof(const char*) <= sizeof(uint32_t)) {
+            if (const auto* text = std::get_if<const char*>(&message.message)) {
+                kind = PayloadKind::String;
+                value = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(*text));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool MessagePacker::findSource(const SubscriberHandle source, uint32_t& id) {
+        if (source == nullptr) {
+            id = 0;
+            return true;
+        }
+        for (size_t index = 0; index < m_sourceCount; index++) {
+            if (m_sources[index] == source) {
+                id = static_cast<uint32_t>(index + 1);
+                return true;
+            }
+        }
+        if (m_sourceCount == kSourceSlots) {
+            // ids in use must keep their source, so the table can only start over when no packed message is left
+            if (m_inFlight > 0) return false;
+            m_sources.fill(nullptr);
+            m_sourceCount = 0;
+        }
+        m_sources[m_sourceCount++] = source;
+        id = static_cast<uint32_t>(m_sourceCount);
+        return true;
+    }
+}
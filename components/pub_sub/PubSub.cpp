@@ -14,28 +14,178 @@
 #include "freertos/semphr.h"
 #include <sstream>
 #include <algorithm>
+#include <cstring>
+#include <type_traits>
 #include "PubSub.hpp"
 #include "esp_log.h"
 
 namespace pub_sub {
 
+    namespace {
+        // number of inline dispatches the current task is in, so unsubscribe from an inline callback doesn't wait for itself
+        thread_local uint32_t inlineDepth = 0;
+        // the bus whose messages the current task is dispatching, so a publish from a callback knows it must not wait for room
+        thread_local const PubSub* dispatchingBus = nullptr;
+        const SystemClock systemClock;
+
+        // for the short critical sections of a rate limiter, which both the event loop and inline publishers may enter
+        class SpinGuard {
+        public:
+            explicit SpinGuard(std::atomic_flag& flag) : m_flag(flag) {
+                while (m_flag.test_and_set(std::memory_order_acquire)) {
+                    taskYIELD();
+                }
+            }
+            ~SpinGuard() { m_flag.clear(std::memory_order_release); }
+            SpinGuard(const SpinGuard&) = delete;
+            SpinGuard& operator=(const SpinGuard&) = delete;
+        private:
+            std::atomic_flag& m_flag;
+        };
+
+        void lowerTo(std::atomic<int64_t>& target, const int64_t value) {
+            auto current = target.load();
+            while (value < current && !target.compare_exchange_weak(current, value)) {}
+        }
+
+        void raiseTo(std::atomic<uint32_t>& target, const uint32_t value) {
+            auto current = target.load();
+            while (value > current && !target.compare_exchange_weak(current, value)) {}
+        }
+
+        constexpr int64_t kMicrosPerToken = 1000000;
+
+        // A reader or writer that waits for a sequence lock spins for a while. The task holding it may have a lower priority though,
+        // and then it only gets to finish if we sleep, so every so many tries we do.
+        constexpr uint32_t kSpinsBeforeSleep = 32;
+
+        void backOff(uint32_t& attempts) {
+            if (++attempts % kSpinsBeforeSleep == 0) {
+                vTaskDelay(1);
+            }
+        }
+
+        // Every payload type is plain data of at most 64 bits, so a retained slot can keep it in an atomic word.
+        uint64_t payloadBits(const Payload& payload) {
+            uint64_t bits = 0;
+            std::visit([&bits](const auto& value) {
+                using Type = std::decay_t<decltype(value)>;
+                static_assert(std::is_trivially_copyable_v<Type> && sizeof(Type) <= sizeof(bits), "A payload must fit in a word");
+                std::memcpy(&bits, &value, sizeof(Type));
+            }, payload);
+            return bits;
+        }
+
+        template <size_t Index = 0>
+        Payload payloadFromBits(const size_t index, const uint64_t bits) {
+            if constexpr (Index < std::variant_size_v<Payload>) {
+                if (index != Index) return payloadFromBits<Index + 1>(index, bits);
+                std::variant_alternative_t<Index, Payload> value;
+                // trivially copyable, so copying the bytes in makes a valid value
+                std::memcpy(static_cast<void*>(&value), &bits, sizeof(value));
+                return value;
+            } else {
+                return {};
+            }
+        }
+    }
+
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+    namespace {
+        // room for the bus plus the reference counts of its shared_ptr
+        constexpr size_t kArenaSize = sizeof(PubSub) + 64;
+        alignas(std::max_align_t) std::byte busArena[kArenaSize];
+        std::atomic<bool> busArenaInUse = false;
+#ifdef CONFIG_PUB_SUB_STATIC_EVENT_LOOP_STACK
+        // Only a bus in Task mode needs it, so it isn't part of the bus. There is one bus at most, so one stack will do.
+        std::array<StackType_t, CONFIG_PUB_SUB_EVENT_LOOP_STACK_SIZE> eventLoopStack{};
+        StaticTask_t eventLoopTaskBuffer{};
+#endif
+    }
+
+    template <typename T>
+    T* PubSub::ArenaAllocator<T>::allocate(const size_t count) {
+        static_assert(sizeof(T) <= kArenaSize, "The bus arena is too small for the shared_ptr control block");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "The bus arena is not aligned for the shared_ptr control block");
+        if (count != 1 || busArenaInUse.exchange(true)) {
+            throwRuntimeError("create", "Only one bus can exist with static allocation");
+        }
+        return reinterpret_cast<T*>(busArena);
+    }
+
+    template <typename T>
+    void PubSub::ArenaAllocator<T>::deallocate(T*, size_t) {
+        busArenaInUse.store(false);
+    }
+#endif
+
     // Public constructors and methods
 
-    PubSub::PubSub() : m_processing(false), m_terminateFlag(false)  {
+    PubSub::PubSub(const Transport transport, const LoopMode loopMode) : m_loopMode(loopMode), m_terminateFlag(false), m_clock(&systemClock)  {
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        m_mutex = xSemaphoreCreateMutexStatic(&m_mutexBuffer);
+        m_isrQueue = xQueueCreateStatic(CONFIG_PUB_SUB_ISR_QUEUE_DEPTH, sizeof(Message), m_isrQueueItems.data(), &m_isrQueueBuffer);
+#else
         m_mutex = xSemaphoreCreateMutex();
+        m_isrQueue = xQueueCreate(CONFIG_PUB_SUB_ISR_QUEUE_DEPTH, sizeof(Message));
+#endif
         if (m_mutex == nullptr) {
             throwRuntimeError("PubSub", "Failed to create mutex");
         }
-        xSemaphoreGive(m_mutex);
+        if (m_isrQueue == nullptr) {
+            throwRuntimeError("PubSub", "Failed to create interrupt queue");
+        }
 
-        m_message_queue = xQueueCreate(100, sizeof(Message));
-        if (m_message_queue == nullptr) {
-            throwRuntimeError("PubSub", "Failed to create message queue");
+        for (size_t index = 0; index < kPriorityCount; index++) {
+            auto& lane = m_lanes[index];
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+            if (transport == Transport::RingBuffer) {
+                lane.transport = &lane.storage.emplace<LaneRingTransport>(kLaneDepth[index]);
+            } else if (transport == Transport::PackedQueue) {
+                lane.transport = &lane.storage.emplace<StaticPackedQueueTransport<kMaxLaneDepth>>(kLaneDepth[index]);
+            } else {
+                lane.transport = &lane.storage.emplace<1>(kLaneDepth[index]);
+            }
+#else
+            if (transport == Transport::RingBuffer) {
+                lane.storage = std::make_unique<LaneRingTransport>(kLaneDepth[index]);
+            } else if (transport == Transport::PackedQueue) {
+                lane.storage = std::make_unique<PackedQueueTransport>(kLaneDepth[index]);
+            } else {
+                lane.storage = std::make_unique<QueueTransport>(kLaneDepth[index]);
+            }
+            lane.transport = lane.storage.get();
+#endif
+            if (!lane.transport->isValid()) {
+                throwRuntimeError("PubSub", "Failed to create message transport");
+            }
+        }
+        for (size_t index = 0; index < kTopicCount; index++) {
+            m_topicPriority[index].store(defaultPriority(static_cast<Topic>(index)));
         }
+        setBackpressure(Topic::AllTopics, {});
     }
 
-    std::shared_ptr<PubSub> PubSub::create() {
-        auto instance = std::make_shared<PubSub>();
+    PubSub::PubSub(const Transport transport, Executor& executor) : PubSub(transport, LoopMode::Shared) {
+        m_executor = &executor;
+    }
+
+    std::shared_ptr<PubSub> PubSub::create(const Transport transport, Executor& executor) {
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        auto instance = std::allocate_shared<PubSub>(ArenaAllocator<PubSub>(), transport, executor);
+#else
+        auto instance = std::make_shared<PubSub>(transport, executor);
+#endif
+        instance->begin();
+        return instance;
+    }
+
+    std::shared_ptr<PubSub> PubSub::create(const Transport transport, const LoopMode loopMode) {
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        auto instance = std::allocate_shared<PubSub>(ArenaAllocator<PubSub>(), transport, loopMode);
+#else
+        auto instance = std::make_shared<PubSub>(transport, loopMode);
+#endif
    		ESP_LOGI("create", "Reference count after make_shared: %ld", instance->getReferenceCount());
 
         instance->begin();
@@ -47,10 +197,19 @@ namespace pub_sub {
         ESP_LOGI("~PubSub", "Destroying pubsub");
         unsubscribeAll();
         end();
-        ESP_LOGI("~PubSub", "Deleting queue and mutex");
-        if (m_message_queue != nullptr) {
-            vQueueDelete(m_message_queue);
+        // let go of the strings and blocks the retained topics hold on to
+        setRetained(Topic::AllTopics, false);
+        ESP_LOGI("~PubSub", "Deleting transport and mutex");
+        // inboxes need the mutex when they stop, so they go first
+        for (auto& inbox : m_inboxes) {
+            inbox.reset();
+        }
+        // messages from interrupts that never made it to the event loop still hold their strings and blocks
+        Message msg;
+        while (xQueueReceive(m_isrQueue, &msg, 0) == pdPASS) {
+            release(msg);
         }
+        vQueueDelete(m_isrQueue);
         if (m_mutex != nullptr) {
             vSemaphoreDelete(m_mutex);
         }
@@ -58,13 +217,33 @@ namespace pub_sub {
     }
 
     void PubSub::begin() {
+        if (m_loopMode == LoopMode::Manual) {
+            // the caller dispatches with pump, so there is no task to start
+            return;
+        }
+        if (m_loopMode == LoopMode::Shared) {
+            // the tasks of the executor are running already; it only needs to have room for us
+            if (m_executor == nullptr || !m_executor->attach()) {
+                throwRuntimeError("begin", "No executor, or it serves too many buses");
+            }
+            m_attached = true;
+            return;
+        }
         // Start the event loop task
 
         m_eventLoopFinished.store(false);
         ESP_LOGI("begin", "Reference count after defining self: %ld", getReferenceCount());
-        if (xTaskCreate(eventLoopTask, "EventLoop", 16384, this, 3, & m_eventLoopTaskHandle) != pdPASS) {
-            vQueueDelete(m_message_queue);
-            vSemaphoreDelete(m_mutex);
+#if defined(CONFIG_PUB_SUB_STATIC_EVENT_LOOP_STACK)
+        m_eventLoopTaskHandle = xTaskCreateStatic(
+            eventLoopTask, "EventLoop", eventLoopStack.size(), this, 3, eventLoopStack.data(), &eventLoopTaskBuffer);
+        const bool created = m_eventLoopTaskHandle != nullptr;
+#elif defined(CONFIG_PUB_SUB_STATIC_ALLOCATION)
+        // no stack was reserved, see CONFIG_PUB_SUB_STATIC_EVENT_LOOP_STACK
+        const bool created = false;
+#else
+        const bool created = xTaskCreate(eventLoopTask, "EventLoop", CONFIG_PUB_SUB_EVENT_LOOP_STACK_SIZE, this, 3, & m_eventLoopTaskHandle) == pdPASS;
+#endif
+        if (!created) {
             throwRuntimeError("PubSub", "Failed to create event loop task");
         }
 		ESP_LOGI("begin", "Reference count after creating task: %ld", getReferenceCount());
@@ -75,152 +254,1260 @@ namespace pub_sub {
         // on ESP, it won't actually terminate but will keep running idle until vTaskDelete is called
         ESP_LOGI("end", "Terminating task");
         m_terminateFlag.store(true);
+        // the event loop is blocked waiting for messages, so wake it up to see the flag
+        doInMutex(
+            [this]() {
+                if (m_eventLoopTaskHandle != nullptr) {
+                    xTaskNotifyGive(m_eventLoopTaskHandle);
+                }
+                return true;
+            },
+            "end",
+            "wake event loop"
+        );
 
         while (!m_eventLoopFinished.load()) {
-            vTaskDelay(pdMS_TO_TICKS(10));
+            vTaskDelay(1);
         }
         // the task deletes itself, so no need to do anything here
+
+        // a task of the executor may still be serving us, or we may be waiting in its ready queue
+        while (m_runState.load() != RunState::Idle) {
+            vTaskDelay(1);
+        }
+        if (m_attached) {
+            m_executor->detach();
+            m_attached = false;
+        }
+
+        // nothing gets posted to the inboxes anymore, so we can stop them
+        const auto inboxCount = m_inboxCount.load();
+        for (size_t index = 0; index < inboxCount; index++) {
+            if (m_inboxes[index]->isRunning()) {
+                m_inboxes[index]->stop();
+            }
+        }
     }
 
     long PubSub::getReferenceCount() const {
         return shared_from_this().use_count();
     }
 
-    void PubSub::publish(Topic topic, const Payload &message, const SubscriberHandle source) {
-        constexpr auto kTag = "publish";
+    bool PubSub::publish(Topic topic, const Payload &message, const SubscriberHandle source) {
+        const auto index = static_cast<size_t>(topic);
+        // AllTopics is only for subscribing; its mask would make hasSubscribers true for it
+        if (index >= kTopicCount) return false;
+        const bool retained = isRetained(topic);
+        // nobody listening: don't bother the transport and the event loop
+        if (!retained && !hasSubscribers(topic)) return true;
 
-        doInMutex(
-            [this, topic, message, source]() {
-                Message msg;
-                msg.topic = topic;
-                msg.message = message;
-                msg.source = source;
-                if (xQueueSend(m_message_queue, &msg, portMAX_DELAY) != pdPASS) {
-                    char buffer[100] = {};
-                    MessageVisitor visitor(buffer);
-                    std::visit(visitor, message);
-                    buffer[99] = '\0';
-                    throwRuntimeError(kTag, std::string("Failed to publish topic ") + toCString(topic) + ", message: " + buffer);
+        // no mutex needed here: the transport takes care of concurrent publishers
+        const Message msg{source, message, topic, m_sequence[index].fetch_add(1) + 1, false, m_metrics.now()};
+        if (retained) {
+            storeRetained(msg);
+            if (!hasSubscribers(topic)) return true;
+        }
+        m_metrics.published(topic);
+        retain(msg);
+        if (m_dispatch[index].load() == Dispatch::Inline) {
+            dispatchInline(msg);
+            return true;
+        }
+        auto& lane = laneOf(topic);
+        if (dispatchingBus == this) {
+            return defer(lane, msg);
+        }
+        return sendWithBackpressure(lane, msg);
+    }
+
+    // Sends a message that was counted and retained for publishing into its lane, doing what the policy of its topic says if the
+    // lane is full. Returns false if the message was dropped.
+    bool PubSub::sendWithBackpressure(Lane& lane, const Message& msg) {
+        const auto index = static_cast<size_t>(msg.topic);
+        TickType_t timeout = 0;
+        switch (m_backpressureMode[index].load()) {
+            case Backpressure::Conflate:
+                return publishConflated(lane, msg);
+            case Backpressure::DropOldest: {
+                countPublished(lane, 1);
+                Message dropped;
+                bool didDrop = false;
+                const bool sent = lane.transport->sendReplacingOldest(msg, dropped, didDrop);
+                if (didDrop) {
+                    discard(lane, dropped);
+                }
+                if (!sent) {
+                    discard(lane, msg);
+                    return false;
                 }
-                m_processing = true;
+                wakeEventLoop();
                 return true;
-            }, 
-            kTag,
-            toCString(topic)
+            }
+            case Backpressure::DropNewest:
+                break;
+            default:
+                timeout = m_blockTimeout[index].load();
+                break;
+        }
+        countPublished(lane, 1);
+        if (!sendOrPump(lane, msg, timeout)) {
+            discard(lane, msg);
+            return false;
+        }
+        wakeEventLoop();
+        return true;
+    }
+
+    // Runs in interrupt context, so no mutex, no logging and no waiting: everything here is an atomic or the queue, which
+    // xQueueSendFromISR guards with a critical section. The event loop stores retained values, as a task we interrupted may hold the slot.
+    bool PubSub::publishFromIsr(const Topic topic, const Payload& message, BaseType_t* higherPriorityTaskWoken) {
+        const auto index = static_cast<size_t>(topic);
+        if (index >= kTopicCount) return false;
+        if (!isRetained(topic) && !hasSubscribers(topic)) return true;
+
+        const Message msg{nullptr, message, topic, m_sequence[index].fetch_add(1) + 1, false, m_metrics.now()};
+        m_metrics.published(topic);
+        retain(msg);
+        // counted before it goes in, so flush and isIdle never see it dispatched before it was published
+        m_publishedCount.fetch_add(1);
+        m_isrPending.fetch_add(1);
+        BaseType_t woken = pdFALSE;
+        if (xQueueSendFromISR(m_isrQueue, &msg, &woken) != pdPASS) {
+            m_isrPending.fetch_sub(1);
+            m_publishedCount.fetch_sub(1);
+            m_droppedCount[index].fetch_add(1);
+            release(msg);
+            return false;
+        }
+        if (m_executor != nullptr) {
+            requestRun(&woken);
+        } else if (m_eventLoopTaskHandle != nullptr && !m_terminateFlag.load()) {
+            vTaskNotifyGiveFromISR(m_eventLoopTaskHandle, &woken);
+        }
+        if (higherPriorityTaskWoken != nullptr) {
+            if (woken == pdTRUE) {
+                *higherPriorityTaskWoken = pdTRUE;
+            }
+        } else {
+            portYIELD_FROM_ISR(woken);
+        }
+        return true;
+    }
+
+    size_t PubSub::publishBatch(const std::span<const Message> messages) {
+        // copy the messages we send in chunks, as they need a sequence number. A chunk goes to a single lane.
+        std::array<Message, kBatchChunk> chunk;
+        size_t count = 0;
+        Lane* chunkLane = nullptr;
+        size_t published = 0;
+        bool chunkSent = false;
+        const auto sendChunk = [this, &chunk, &count, &chunkLane, &published, &chunkSent]() {
+            if (count == 0) return;
+            const auto sent = sendBatch(*chunkLane, std::span(chunk.data(), count));
+            published += sent;
+            chunkSent = chunkSent || sent > 0;
+            count = 0;
+        };
+        for (const auto& message : messages) {
+            const auto index = static_cast<size_t>(message.topic);
+            if (index >= kTopicCount) continue;
+            const bool retained = isRetained(message.topic);
+            if (!retained && !hasSubscribers(message.topic)) {
+                published++;
+                continue;
+            }
+            Message msg = message;
+            msg.sequence = m_sequence[index].fetch_add(1) + 1;
+            msg.conflated = false;
+            msg.publishedAt = m_metrics.now();
+            if (retained) {
+                storeRetained(msg);
+                if (!hasSubscribers(message.topic)) {
+                    published++;
+                    continue;
+                }
+            }
+            retain(msg);
+            m_metrics.published(message.topic);
+            auto& lane = laneOf(message.topic);
+            // a chunk waits for room as a whole, so only messages that would wait without a limit anyway can go in one
+            const bool waits = dispatchingBus == this ||
+                (m_backpressureMode[index].load() == Backpressure::Block && m_blockTimeout[index].load() == portMAX_DELAY);
+            if (count > 0 && (!waits || &lane != chunkLane || count == chunk.size())) {
+                sendChunk();
+            }
+            if (!waits) {
+                if (sendWithBackpressure(lane, msg)) {
+                    published++;
+                }
+                continue;
+            }
+            chunkLane = &lane;
+            chunk[count++] = msg;
+        }
+        sendChunk();
+        if (chunkSent) {
+            wakeEventLoop();
+        }
+        return published;
+    }
+
+    void PubSub::setBackpressure(const Topic topic, const BackpressurePolicy policy) {
+        const auto mask = toMask(topic);
+        for (size_t index = 0; index < kTopicCount; index++) {
+            if ((mask & (TopicMask{1} << index)) != 0) {
+                m_blockTimeout[index].store(policy.timeout);
+                m_backpressureMode[index].store(policy.mode);
+            }
+        }
+    }
+
+    BackpressurePolicy PubSub::getBackpressure(const Topic topic) const {
+        const auto index = static_cast<size_t>(topic);
+        if (index >= kTopicCount) return {};
+        return {m_backpressureMode[index].load(), m_blockTimeout[index].load()};
+    }
+
+    uint32_t PubSub::getDroppedCount(const Topic topic) const {
+        const auto index = static_cast<size_t>(topic);
+        return index < kTopicCount ? m_droppedCount[index].load() : 0;
+    }
+
+    bool PubSub::publishString(const Topic topic, const char* text, const SubscriberHandle source) {
+        if (static_cast<size_t>(topic) >= kTopicCount) return false;
+        // like publish: a retained topic keeps the value also when nobody listens
+        if (!isRetained(topic) && !hasSubscribers(topic)) return true;
+        const auto* interned = m_strings.intern(text);
+        if (interned == nullptr) {
+            m_droppedCount[static_cast<size_t>(topic)].fetch_add(1);
+            return false;
+        }
+        // publish takes its own reference for as long as the message is underway
+        const bool published = publish(topic, interned, source);
+        m_strings.release(interned);
+        return published;
+    }
+
+    bool PubSub::publishBlock(const Topic topic, Loan&& loan, const SubscriberHandle source) {
+        if (static_cast<size_t>(topic) >= kTopicCount) return false;
+        if (!loan.isValid()) {
+            m_droppedCount[static_cast<size_t>(topic)].fetch_add(1);
+            return false;
+        }
+        // like publishString: publish takes its own reference, the one of the loan goes when it runs out of scope
+        const Loan published = std::move(loan);
+        return publish(topic, published.ref(), source);
+    }
+
+    void PubSub::setDispatch(const Topic topic, const Dispatch dispatch) {
+        const auto mask = toMask(topic);
+        for (size_t index = 0; index < kTopicCount; index++) {
+            if ((mask & (TopicMask{1} << index)) != 0) {
+                m_dispatch[index].store(dispatch);
+            }
+        }
+    }
+
+    Dispatch PubSub::getDispatch(const Topic topic) const {
+        const auto index = static_cast<size_t>(topic);
+        return index < kTopicCount ? m_dispatch[index].load() : Dispatch::Queued;
+    }
+
+    void PubSub::setRetained(const Topic topic, const bool retained) {
+        const auto mask = toMask(topic);
+        for (size_t index = 0; index < kTopicCount; index++) {
+            if ((mask & (TopicMask{1} << index)) == 0) continue;
+            m_retained[index].store(retained);
+            if (!retained) {
+                storeRetained({nullptr, 0, static_cast<Topic>(index)}, false);
+            }
+        }
+    }
+
+    bool PubSub::isRetained(const Topic topic) const {
+        const auto index = static_cast<size_t>(topic);
+        return index < kTopicCount && m_retained[index].load();
+    }
+
+    std::optional<Payload> PubSub::latest(const Topic topic) const {
+        const auto index = static_cast<size_t>(topic);
+        Message msg;
+        if (index >= kTopicCount || !readRetained(index, msg)) return std::nullopt;
+        const auto value = msg.message;
+        release(msg);
+        return value;
+    }
+
+    TimerId PubSub::addTimer(TimerJob& job, const uint32_t periodMicros, const uint32_t phaseMicros) {
+        if (m_loopMode == LoopMode::Shared) {
+            ESP_LOGE("addTimer", "A bus on a shared executor can't run timers");
+            return kNoTimer;
+        }
+        TimerId id = kNoTimer;
+        doInMutex(
+            [this, &job, &id, periodMicros, phaseMicros]() {
+                id = m_timers.add(job, m_clock->nowMicros(), periodMicros, phaseMicros);
+                m_nextTimerDue.store(m_timers.nextDue());
+                return true;
+            },
+            "addTimer",
+            "timers"
         );
+        // the event loop may be asleep without a timeout, or with one for a later timer
+        wakeEventLoop();
+        return id;
     }
 
-    void PubSub::subscribe(const SubscriberHandle subscriber, const Topic topic) {
-        for (auto& subscriberMap: m_subscribers) {
-            if (addSubscriberToExistingTopic(subscriberMap, topic, subscriber)) return;
+    void PubSub::removeTimer(const TimerId id) {
+        doInMutex(
+            [this, id]() {
+                m_timers.remove(id);
+                m_nextTimerDue.store(m_timers.nextDue());
+                return true;
+            },
+            "removeTimer",
+            "timers"
+        );
+        // the dispatcher may have taken the job out just before; a job removing a timer would wait for itself
+        while (m_runningTimers.load() && dispatchingBus != this) {
+            vTaskDelay(1);
         }
-        // New topic, add to the map
-        SubscriberMap subscriberMap;
-        subscriberMap.topic = topic;
+    }
+
+    bool PubSub::setClock(const Clock& clock) {
+        // an event loop task sleeps until the next timer is due by the tick count, and nothing wakes it when such a clock moves
+        if (!clock.runsByItself() && m_loopMode != LoopMode::Manual) {
+            ESP_LOGW("setClock", "A clock that doesn't run by itself needs LoopMode::Manual");
+            return false;
+        }
+        m_clock = &clock;
+        return true;
+    }
+
+    TimerStats PubSub::getTimerStats(const TimerId id) const {
+        TimerStats stats;
         doInMutex(
-            [this, &subscriberMap, subscriber]() {
-                subscriberMap.subscribers.push_back(subscriber);
-                m_subscribers.push_back(subscriberMap);
+            [this, id, &stats]() {
+                stats = m_timers.getStats(id);
+                return true;
+            },
+            "getTimerStats",
+            "timers"
+        );
+        return stats;
+    }
+
+    MetricsSnapshot PubSub::getMetrics() const {
+        MetricsSnapshot snapshot;
+        m_metrics.fill(snapshot);
+        for (size_t index = 0; index < kPriorityCount; index++) {
+            snapshot.lanes[index].depth = m_lanes[index].pending.load();
+        }
+        for (size_t index = 0; index < kTopicCount; index++) {
+            snapshot.topics[index].dropped = m_droppedCount[index].load();
+        }
+        return snapshot;
+    }
+
+    void PubSub::setPriority(const Topic topic, const Priority priority) {
+        const auto mask = toMask(topic);
+        for (size_t index = 0; index < kTopicCount; index++) {
+            if ((mask & (TopicMask{1} << index)) != 0) {
+                m_topicPriority[index].store(priority);
+            }
+        }
+    }
+
+    Priority PubSub::getPriority(const Topic topic) const {
+        const auto index = static_cast<size_t>(topic);
+        return index < kTopicCount ? m_topicPriority[index].load() : Priority::Normal;
+    }
+
+    void PubSub::subscribe(const SubscriberHandle subscriber, const Topic topic) {
+        const auto ok = doInMutex(
+            [this, subscriber, topic]() {
+                // a subscriber with a running inbox keeps getting everything through it
+                auto* inbox = findInbox(subscriber);
+                auto& registry = beginUpdate();
+                if (!addSubscription(registry, subscriber, topic, inbox != nullptr && inbox->isRunning() ? inbox : nullptr)) return false;
+                commitUpdate(registry);
                 return true;
             }, 
-            "addSubscriberToNewTopic", 
+            "subscribe", 
             toCString(topic)
         );
+        if (!ok) {
+            throwRuntimeError("subscribe", std::string("Too many subscribers for topic ") + toCString(topic));
+        }
+        deliverRetained(subscriber, topic);
     }
 
-    void PubSub::unsubscribe(const SubscriberHandle subscriber, Topic topic) {
-        constexpr auto kTag = "unsubscribe";
+    void PubSub::subscribe(const SubscriberHandle subscriber, const Topic topic, const InboxOptions& options) {
+        Inbox* startedInbox = nullptr;
+        const auto ok = doInMutex(
+            [this, subscriber, topic, &options, &startedInbox]() {
+                const auto* existing = findInbox(subscriber);
+                const bool wasRunning = existing != nullptr && existing->isRunning();
+                auto* inbox = startInbox(subscriber, options);
+                if (inbox == nullptr) return false;
+                if (!wasRunning) {
+                    startedInbox = inbox;
+                }
+                auto& registry = beginUpdate();
+                if (!addSubscription(registry, subscriber, topic, inbox)) return false;
+                commitUpdate(registry);
+                return true;
+            },
+            "subscribe",
+            toCString(topic)
+        );
+        if (!ok) {
+            // no subscription uses the inbox we just started, so its task would run for nothing. Stopping needs the mutex.
+            if (startedInbox != nullptr) {
+                startedInbox->stop();
+            }
+            throwRuntimeError("subscribe", std::string("Could not create inbox or subscription for topic ") + toCString(topic));
+        }
+        deliverRetained(subscriber, topic);
+    }
+
+    void PubSub::subscribe(const SubscriberHandle subscriber, const Topic topic, const RateLimit& limit) {
+        const auto mask = toMask(topic);
+        const auto ok = doInMutex(
+            [this, subscriber, topic, mask, &limit]() {
+                auto* inbox = findInbox(subscriber);
+                auto& registry = beginUpdate();
+                if (!addSubscription(registry, subscriber, topic, inbox != nullptr && inbox->isRunning() ? inbox : nullptr)) return false;
+                if (!limitSubscriptions(registry, subscriber, mask, limit)) return false;
+                commitUpdate(registry);
+                return true;
+            },
+            "subscribe",
+            toCString(topic)
+        );
+        if (!ok) {
+            throwRuntimeError("subscribe", std::string("Too many subscribers or rate limits for topic ") + toCString(topic));
+        }
+        deliverRetained(subscriber, topic);
+    }
 
+    void PubSub::unsubscribe(const SubscriberHandle subscriber, Topic topic) {
+        const auto mask = toMask(topic);
+        Inbox* inboxToStop = nullptr;
+        std::array<uint8_t, kMaxRateLimiters> limitersToFree{};
+        size_t limiterCount = 0;
         doInMutex(
-            [this, topic, subscriber]() {
-                std::vector<SubscriberMap*> mapsToClear;
-                for (auto& subscriberMap : m_subscribers) {
-                    if (topic == Topic::AllTopics || subscriberMap.topic == topic) {
-                        removeSubscriber(subscriber, subscriberMap, mapsToClear);
+            [this, subscriber, mask, &inboxToStop, &limitersToFree, &limiterCount]() {
+                auto& registry = beginUpdate();
+                for (size_t index = 0; index < kTopicCount; index++) {
+                    if ((mask & (TopicMask{1} << index)) == 0) continue;
+                    auto& subscribers = registry.topics[index];
+                    const auto entry = std::ranges::find(subscribers, subscriber, &Subscription::subscriber);
+                    if (entry != subscribers.end() && entry->rateLimiter != kNoRateLimiter) {
+                        limitersToFree[limiterCount++] = entry->rateLimiter;
                     }
+                    const auto last = std::remove_if(subscribers.begin(), subscribers.end(), [subscriber](const Subscription& subscription) {
+                        return subscription.subscriber == subscriber;
+                    });
+                    subscribers.count = last - subscribers.begin();
+                }
+                commitUpdate(registry);
+                if (!isSubscribed(subscriber)) {
+                    inboxToStop = findInbox(subscriber);
+                    freeWatchdog(subscriber);
                 }
-                removeMapsToClear(mapsToClear);
                 return true;
             }, 
-            kTag, 
+            "unsubscribe", 
             toCString(topic)
         );
+        // the caller may destroy the subscriber once we return, so the event loop must be done with the old snapshot
+        waitForReaders();
+        // only now nobody uses the limiters of the old subscriptions anymore
+        doInMutex(
+            [this, &limitersToFree, limiterCount]() {
+                for (size_t index = 0; index < limiterCount; index++) {
+                    freeRateLimiter(limitersToFree[index]);
+                }
+                return true;
+            },
+            "unsubscribe",
+            "rate limiters"
+        );
+        // stopping waits for the inbox task, which needs the mutex to finish
+        if (inboxToStop != nullptr && inboxToStop->isRunning()) {
+            inboxToStop->stop();
+        }
     }
 
     void PubSub::unsubscribeAll() {
         ESP_LOGI("UnsubscribeAll", "Unsubscribing all");
         dumpSubscribers("unsubscribeAll before");
+        std::array<bool, kMaxRateLimiters> limitersToFree{};
         doInMutex(
-            [this]() {
-                for (auto& [topic, subscribers]: m_subscribers) {
-                    subscribers.clear();
+            [this, &limitersToFree]() {
+                auto& registry = beginUpdate();
+                for (const auto& subscribers : registry.topics) {
+                    for (const auto& subscription : subscribers) {
+                        if (subscription.rateLimiter != kNoRateLimiter) {
+                            limitersToFree[subscription.rateLimiter] = true;
+                        }
+                    }
+                }
+                registry = Registry{};
+                commitUpdate(registry);
+                for (auto& watchdog : m_watchdogs) {
+                    watchdog.owner.store(nullptr);
                 }
-                m_subscribers.clear();
+                m_watchdogCount.store(0);
                 return true;
             }, 
-            "hello", 
-            "hello"
+            "unsubscribeAll", 
+            "all topics"
+        );
+        waitForReaders();
+        doInMutex(
+            [this, &limitersToFree]() {
+                for (size_t index = 0; index < kMaxRateLimiters; index++) {
+                    if (limitersToFree[index]) {
+                        freeRateLimiter(static_cast<uint8_t>(index));
+                    }
+                }
+                return true;
+            },
+            "unsubscribeAll",
+            "rate limiters"
         );
+        const auto inboxCount = m_inboxCount.load();
+        for (size_t index = 0; index < inboxCount; index++) {
+            if (m_inboxes[index]->isRunning()) {
+                m_inboxes[index]->stop();
+            }
+        }
 
         dumpSubscribers("unsubscribeAll after");
     }
 
+    bool PubSub::setCallbackBudget(const SubscriberHandle subscriber, const CallbackBudget& budget) {
+        return doInMutex(
+            [this, subscriber, &budget]() {
+                auto* watchdog = findWatchdog(subscriber);
+                if (watchdog == nullptr) {
+                    const auto free = std::ranges::find_if(m_watchdogs, [](const Watchdog& entry) { return entry.owner.load() == nullptr; });
+                    if (free == m_watchdogs.end()) return false;
+                    watchdog = &*free;
+                    watchdog->calls.store(0);
+                    watchdog->overruns.store(0);
+                    watchdog->maxMicros.store(0);
+                    watchdog->degraded.store(false);
+                    m_watchdogCount.fetch_add(1);
+                }
+                watchdog->budget = budget;
+                watchdog->budgetMicros.store(budget.budgetMicros);
+                watchdog->strikeLimit.store(budget.strikeLimit);
+                watchdog->strikes.store(0);
+                // the dispatcher only looks at the limits once it found the owner
+                watchdog->owner.store(subscriber);
+                return true;
+            },
+            "setCallbackBudget",
+            "watchdogs"
+        );
+    }
+
+    void PubSub::clearCallbackBudget(const SubscriberHandle subscriber) {
+        doInMutex(
+            [this, subscriber]() {
+                freeWatchdog(subscriber);
+                return true;
+            },
+            "clearCallbackBudget",
+            "watchdogs"
+        );
+    }
+
+    CallbackStats PubSub::getCallbackStats(const SubscriberHandle subscriber) const {
+        CallbackStats stats;
+        const auto entry = std::ranges::find_if(m_watchdogs, [subscriber](const Watchdog& watchdog) { return watchdog.owner.load() == subscriber; });
+        if (subscriber != nullptr && entry != m_watchdogs.end()) {
+            stats.calls = entry->calls.load();
+            stats.overruns = entry->overruns.load();
+            stats.maxMicros = entry->maxMicros.load();
+            stats.degraded = entry->degraded.load();
+        }
+        return stats;
+    }
+
+    bool PubSub::flush(const TickType_t timeout) {
+        const auto start = xTaskGetTickCount();
+        if (m_loopMode == LoopMode::Manual) {
+            // nobody else dispatches
+            pump();
+        } else if (dispatchingBus == this) {
+            // a callback would wait for itself
+            return false;
+        } else if (!waitForDispatched(m_dispatchedCount, m_publishedCount.load(), timeout, m_eventLoopTaskHandle)) {
+            return false;
+        }
+
+        // everything published before the call has been handed over to the inboxes now, so wait for those too
+        const auto inboxCount = m_inboxCount.load();
+        for (size_t index = 0; index < inboxCount; index++) {
+            const auto elapsed = xTaskGetTickCount() - start;
+            const auto remaining = timeout == portMAX_DELAY ? portMAX_DELAY : (elapsed >= timeout ? 0 : timeout - elapsed);
+            auto& inbox = *m_inboxes[index];
+            if (!waitForDispatched(inbox.m_processedCount, inbox.m_postedCount.load(), remaining, inbox.m_taskHandle)) return false;
+        }
+        return true;
+    }
+
     bool PubSub::isIdle() const {
-        return uxQueueMessagesWaiting(m_message_queue) == 0 && !m_processing;
+        // the event loop posts to the inboxes before counting the message as dispatched, so checking them after this is enough
+        if (m_dispatchedCount.load() != m_publishedCount.load()) return false;
+        const auto inboxCount = m_inboxCount.load();
+        for (size_t index = 0; index < inboxCount; index++) {
+            if (!m_inboxes[index]->isIdle()) return false;
+        }
+        return true;
     }
 
-    void PubSub::waitForIdle() const {
+    bool PubSub::waitForIdle() {
+        // a callback, whether on the event loop or in a pump, would wait for itself
+        if (dispatchingBus == this) {
+            ESP_LOGE("waitForIdle", "Called from a subscriber callback");
+            return false;
+        }
+        // subscribers may publish while we wait, so keep going until nothing new came in
         while (!isIdle()) {
-            vTaskDelay(pdMS_TO_TICKS(10));
+            // fails right away from the task of an inbox, for the same reason
+            if (!flush(portMAX_DELAY)) {
+                ESP_LOGE("waitForIdle", "Called from an inbox");
+                return false;
+            }
         }
+        return true;
+    }
+
+    size_t PubSub::pump(const size_t maxMessages) {
+        // in Task mode only the event loop may take messages out of the lanes, and a nested pump would run callbacks in callbacks
+        if (m_loopMode != LoopMode::Manual || m_pumping) return 0;
+        return dispatchMessages(maxMessages);
+    }
+
+    size_t PubSub::pumpUntilIdle() {
+        if (m_loopMode != LoopMode::Manual || m_pumping) return 0;
+        const auto before = m_dispatchedCount.load();
+        // timers may be due while nothing is waiting
+        pump();
+        waitForIdle();
+        return m_dispatchedCount.load() - before;
     }
 
     // Private methods
 
-    bool PubSub::addSubscriberToExistingTopic(SubscriberMap& subscriberMap, const Topic topic, const SubscriberHandle subscriber) {
-        // note: must be called with the mutex taken
-        constexpr auto kTag = "addSubscriberToExistingTopic";
-        if (subscriberMap.topic != topic) return false;
-        if (doesCallbackExist(subscriberMap, subscriber)) {
-            return true; // do not add it again
+    // returns false if a topic has no room for another subscriber; the registry is then only partly updated and must not be committed
+    bool PubSub::addSubscription(Registry& registry, const SubscriberHandle subscriber, const Topic topic, Inbox* inbox) {
+        const auto mask = toMask(topic);
+        for (size_t index = 0; index < kTopicCount; index++) {
+            auto& subscribers = registry.topics[index];
+            const auto existing = std::ranges::find(subscribers, subscriber, &Subscription::subscriber);
+            if (existing != subscribers.end()) {
+                // an inbox applies to all topics of the subscriber, also the ones it subscribed to before
+                if (inbox != nullptr) {
+                    existing->inbox = inbox;
+                }
+            } else if ((mask & (TopicMask{1} << index)) != 0) {
+                if (subscribers.count == subscribers.entries.size()) return false;
+                subscribers.entries[subscribers.count++] = {subscriber, inbox};
+            }
         }
+        return true;
+    }
 
-        return doInMutex(
-            [&subscriberMap, &subscriber]() {
-                subscriberMap.subscribers.push_back(subscriber);
-                return true;
+    // Called with the mutex taken. Returns a copy of the current snapshot in a slot that the event loop isn't using.
+    PubSub::Registry& PubSub::beginUpdate() {
+        const auto* current = m_registry.load();
+        const auto* active = m_activeRegistry.load();
+        for (size_t index = 0; index < kRegistrySlots; index++) {
+            auto& slot = m_registrySlots[index];
+            if (&slot != current && &slot != active) {
+                // an update that wasn't committed left the version odd already
+                auto& version = m_slotVersions[index];
+                if ((version.load() & 1) == 0) {
+                    version.fetch_add(1);
+                }
+                std::atomic_thread_fence(std::memory_order_release);
+                slot = *current;
+                return slot;
+            }
+        }
+        // can't happen: there are three slots and we excluded at most two
+        throwRuntimeError("beginUpdate", "No free registry slot");
+    }
+
+    // Called with the mutex taken
+    void PubSub::commitUpdate(const Registry& registry) {
+        TopicMask mask = 0;
+        for (size_t index = 0; index < kTopicCount; index++) {
+            if (!registry.topics[index].empty()) {
+                mask |= TopicMask{1} << index;
+            }
+        }
+        m_slotVersions[&registry - m_registrySlots.data()].fetch_add(1, std::memory_order_release);
+        m_registry.store(&registry);
+        m_subscriberMask.store(mask);
+    }
+
+    // Waits until the event loop no longer uses an old snapshot, and until the inline dispatches are done.
+    // A callback may unsubscribe, so we don't wait for ourselves.
+    void PubSub::waitForReaders() const {
+        const bool fromEventLoop = dispatchingBus == this;
+        while (true) {
+            const auto* active = m_activeRegistry.load();
+            const bool eventLoopDone = fromEventLoop || active == nullptr || active == m_registry.load();
+            if (eventLoopDone && m_inlineReaders.load() <= inlineDepth) return;
+            vTaskDelay(1);
+        }
+    }
+
+    // Copies the subscribers of the topic from the current snapshot. Retries if a writer reused the slot while we were copying.
+    PubSub::SubscriberList PubSub::readSubscribers(const size_t topicIndex) const {
+        uint32_t attempts = 0;
+        while (true) {
+            const auto* registry = m_registry.load();
+            const auto& version = m_slotVersions[registry - m_registrySlots.data()];
+            const auto before = version.load(std::memory_order_acquire);
+            if ((before & 1) == 0) {
+                const auto subscribers = registry->topics[topicIndex];
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (version.load(std::memory_order_relaxed) == before) return subscribers;
+            }
+            // the writer may be a lower priority task we preempted
+            backOff(attempts);
+        }
+    }
+
+    void PubSub::dispatchInline(const Message& msg) {
+        // announce ourselves before reading the snapshot, so an unsubscribe that committed after our read waits for us
+        m_inlineReaders.fetch_add(1);
+        inlineDepth++;
+        const auto subscribers = readSubscribers(static_cast<size_t>(msg.topic));
+        if (m_traceMessages.load()) {
+            traceMessage(msg);
+        }
+        if (auto* tap = m_tap.load()) {
+            tap->onMessage(msg);
+        }
+        m_metrics.dispatched(msg);
+        callSubscribers(subscribers, msg);
+        inlineDepth--;
+        m_inlineReaders.fetch_sub(1);
+        release(msg);
+    }
+
+    void PubSub::retain(const Message& msg) const {
+        if (const auto* text = std::get_if<const char*>(&msg.message)) {
+            m_strings.acquire(*text);
+        } else if (const auto* block = std::get_if<BlockRef>(&msg.message)) {
+            block->retain();
+        }
+    }
+
+    bool PubSub::tryRetain(const Message& msg) const {
+        if (const auto* text = std::get_if<const char*>(&msg.message)) {
+            return m_strings.tryAcquire(*text);
+        }
+        if (const auto* block = std::get_if<BlockRef>(&msg.message)) {
+            return block->tryRetain();
+        }
+        return true;
+    }
+
+    void PubSub::release(const Message& msg) const {
+        if (const auto* text = std::get_if<const char*>(&msg.message)) {
+            m_strings.release(*text);
+        } else if (const auto* block = std::get_if<BlockRef>(&msg.message)) {
+            block->release();
+        }
+    }
+
+    // Replaces the value of a retained topic, or clears it if keep is false. Publishers write in turns: whoever makes the version odd
+    // owns the slot until it makes it even again.
+    void PubSub::storeRetained(const Message& msg, const bool keep) {
+        auto& slot = m_retainedSlots[static_cast<size_t>(msg.topic)];
+        if (keep) {
+            retain(msg);
+        }
+        uint32_t attempts = 0;
+        while (true) {
+            auto version = slot.version.load(std::memory_order_relaxed);
+            if ((version & 1) == 0 && slot.version.compare_exchange_weak(version, version + 1, std::memory_order_acquire)) {
+                std::atomic_thread_fence(std::memory_order_release);
+                // only the owner of the slot writes it, so it can read its own words back
+                const auto previousKind = slot.kind.load(std::memory_order_relaxed);
+                const Message previous{nullptr, payloadFromBits(previousKind - 1u, slot.payload.load(std::memory_order_relaxed)), msg.topic};
+                slot.kind.store(keep ? static_cast<uint8_t>(msg.message.index() + 1) : 0, std::memory_order_relaxed);
+                slot.payload.store(keep ? payloadBits(msg.message) : 0, std::memory_order_relaxed);
+                slot.source.store(keep ? msg.source : nullptr, std::memory_order_relaxed);
+                slot.sequence.store(keep ? msg.sequence : 0, std::memory_order_relaxed);
+                slot.publishedAt.store(keep ? msg.publishedAt : 0, std::memory_order_relaxed);
+                slot.version.store(version + 2, std::memory_order_release);
+                // readers that took a reference on the previous value see the version change and let go again
+                if (previousKind != 0) {
+                    release(previous);
+                }
+                return;
+            }
+            backOff(attempts);
+        }
+    }
+
+    // Copies the retained value with a reference of its own, which the caller releases.
+    bool PubSub::readRetained(const size_t topicIndex, Message& msg) const {
+        const auto& slot = m_retainedSlots[topicIndex];
+        uint32_t attempts = 0;
+        while (true) {
+            const auto before = slot.version.load(std::memory_order_acquire);
+            if ((before & 1) == 0) {
+                const auto kind = slot.kind.load(std::memory_order_relaxed);
+                const auto payload = slot.payload.load(std::memory_order_relaxed);
+                const auto source = slot.source.load(std::memory_order_relaxed);
+                const auto sequence = slot.sequence.load(std::memory_order_relaxed);
+                const auto publishedAt = slot.publishedAt.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.version.load(std::memory_order_relaxed) == before) {
+                    if (kind == 0) return false;
+                    // The words belong together, but the writer may have replaced and released the value since.
+                    // The reference fails on a string or block that went back, and the version tells if it is still the same one.
+                    msg = {source, payloadFromBits(kind - 1u, payload), static_cast<Topic>(topicIndex), sequence, false, publishedAt};
+                    if (tryRetain(msg)) {
+                        if (slot.version.load(std::memory_order_acquire) == before) return true;
+                        release(msg);
+                    }
+                }
+            }
+            backOff(attempts);
+        }
+    }
+
+    void PubSub::deliverRetained(const SubscriberHandle subscriber, const Topic topic) {
+        const auto mask = toMask(topic);
+        for (size_t index = 0; index < kTopicCount; index++) {
+            if ((mask & (TopicMask{1} << index)) == 0 || !m_retained[index].load()) continue;
+            Message msg;
+            if (!readRetained(index, msg)) continue;
+            auto* inbox = findInbox(subscriber);
+            if (inbox != nullptr && inbox->isRunning()) {
+                inbox->post(msg);
+            } else {
+                deliver(subscriber, msg);
+            }
+            release(msg);
+        }
+    }
+
+    // Called with the mutex taken. Returns the running inbox of the subscriber, creating or restarting it if needed,
+    // or nullptr if there is no room for another one or its task could not be started.
+    PubSub::Inbox* PubSub::startInbox(const SubscriberHandle subscriber, const InboxOptions& options) {
+        auto* inbox = findInbox(subscriber);
+        if (inbox == nullptr) {
+            const auto count = m_inboxCount.load();
+            if (count == kMaxInboxes) return nullptr;
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+            inbox = &m_inboxes[count].emplace(*this, subscriber, options);
+#else
+            m_inboxes[count] = std::make_unique<Inbox>(*this, subscriber, options);
+            inbox = m_inboxes[count].get();
+#endif
+            m_inboxCount.store(count + 1);
+        }
+        if (!inbox->isRunning() && !inbox->start()) return nullptr;
+        return inbox;
+    }
+
+    PubSub::Inbox* PubSub::findInbox(const SubscriberHandle subscriber) {
+        const auto inboxCount = m_inboxCount.load();
+        for (size_t index = 0; index < inboxCount; index++) {
+            if (m_inboxes[index]->subscriber() == subscriber) {
+                return &*m_inboxes[index];
+            }
+        }
+        return nullptr;
+    }
+
+    bool PubSub::isSubscribed(const SubscriberHandle subscriber) const {
+        return std::ranges::any_of(m_registry.load()->topics, [subscriber](const SubscriberList& subscribers) {
+            return std::ranges::find(subscribers, subscriber, &Subscription::subscriber) != subscribers.end();
+        });
+    }
+
+    void PubSub::callSubscribers(const SubscriberList& subscribers, const Message& msg) {
+        for (const auto& [subscriber, inbox, rateLimiter] : subscribers) {
+            if (msg.source == nullptr || msg.source != subscriber) {
+                if (rateLimiter != kNoRateLimiter && !admit(m_rateLimiters[rateLimiter], msg)) continue;
+                if (inbox != nullptr) {
+                    inbox->post(msg);
+                } else {
+                    deliver(subscriber, msg);
+                }
+            }
+        }
+    }
+
+    // Called with the mutex taken, on a registry update. Gives the subscriptions of the subscriber to the topics in the mask
+    // the limit, with a limiter of their own. Returns false, without changing anything, if there aren't enough free limiters.
+    bool PubSub::limitSubscriptions(Registry& registry, const SubscriberHandle subscriber, const TopicMask mask, const RateLimit& limit) {
+        size_t needed = 0;
+        for (size_t index = 0; index < kTopicCount; index++) {
+            if ((mask & (TopicMask{1} << index)) == 0) continue;
+            const auto& subscribers = registry.topics[index];
+            const auto entry = std::ranges::find(subscribers, subscriber, &Subscription::subscriber);
+            if (entry != subscribers.end() && entry->rateLimiter == kNoRateLimiter) {
+                needed++;
+            }
+        }
+        if (std::ranges::count(m_rateLimiters, nullptr, &RateLimiter::owner) < static_cast<std::ptrdiff_t>(needed)) return false;
+
+        const auto now = m_clock->nowMicros();
+        for (size_t index = 0; index < kTopicCount; index++) {
+            if ((mask & (TopicMask{1} << index)) == 0) continue;
+            auto& subscribers = registry.topics[index];
+            const auto found = std::ranges::find(subscribers, subscriber, &Subscription::subscriber);
+            // topics of the mask the subscriber isn't subscribed to have nothing to limit
+            if (found == subscribers.end()) continue;
+            auto& entry = *found;
+            if (entry.rateLimiter == kNoRateLimiter) {
+                const auto free = std::ranges::find(m_rateLimiters, nullptr, &RateLimiter::owner);
+                entry.rateLimiter = static_cast<uint8_t>(free - m_rateLimiters.begin());
+            }
+            // a limiter that is in use already gets the new limit; a message it held back is dropped
+            auto& limiter = m_rateLimiters[entry.rateLimiter];
+            SpinGuard guard(limiter.busy);
+            if (limiter.hasHeldBack) {
+                release(limiter.heldBack);
+            }
+            limiter.owner = subscriber;
+            limiter.limit = limit;
+            limiter.seen = 0;
+            limiter.tokens = static_cast<int64_t>(std::max<uint32_t>(limit.burst, 1)) * kMicrosPerToken;
+            limiter.refilledAt = now;
+            limiter.delivered = false;
+            limiter.heldBack = {};
+            limiter.hasHeldBack = false;
+        }
+        return true;
+    }
+
+    // Applies the limit of a subscription to a message, and returns whether the subscriber gets it now.
+    // A message that comes too early for the maximum rate is held back, with a reference of its own.
+    bool PubSub::admit(RateLimiter& limiter, const Message& msg) {
+        SpinGuard guard(limiter.busy);
+        const auto& limit = limiter.limit;
+        if (limit.everyNth > 1 && limiter.seen++ % limit.everyNth != 0) return false;
+        if (limit.ratePerSecond == 0 && limit.minIntervalMicros == 0) return true;
+
+        const auto now = m_clock->nowMicros();
+        if (limit.ratePerSecond > 0) {
+            const auto capacity = static_cast<int64_t>(std::max<uint32_t>(limit.burst, 1)) * kMicrosPerToken;
+            limiter.tokens = std::min(capacity, limiter.tokens + (now - limiter.refilledAt) * limit.ratePerSecond);
+            limiter.refilledAt = now;
+            if (limiter.tokens < kMicrosPerToken) return false;
+            limiter.tokens -= kMicrosPerToken;
+        }
+        if (limit.minIntervalMicros > 0) {
+            if (limiter.delivered && now - limiter.deliveredAt < limit.minIntervalMicros) {
+                retain(msg);
+                if (limiter.hasHeldBack) {
+                    release(limiter.heldBack);
+                }
+                limiter.heldBack = msg;
+                limiter.hasHeldBack = true;
+                lowerTo(m_nextHeldBackDue, limiter.deliveredAt + limit.minIntervalMicros);
+                return false;
+            }
+            limiter.delivered = true;
+            limiter.deliveredAt = now;
+            // this one is newer than what was held back
+            if (limiter.hasHeldBack) {
+                release(limiter.heldBack);
+                limiter.heldBack = {};
+                limiter.hasHeldBack = false;
+            }
+        }
+        return true;
+    }
+
+    // Hands out the message the limiter held back if its interval is over; the caller gets the reference.
+    bool PubSub::takeHeldBack(RateLimiter& limiter, const int64_t now, Message& msg) {
+        SpinGuard guard(limiter.busy);
+        if (!limiter.hasHeldBack) return false;
+        const auto due = limiter.deliveredAt + limiter.limit.minIntervalMicros;
+        if (now < due) {
+            lowerTo(m_nextHeldBackDue, due);
+            return false;
+        }
+        msg = limiter.heldBack;
+        limiter.heldBack = {};
+        limiter.hasHeldBack = false;
+        limiter.deliveredAt = now;
+        return true;
+    }
+
+    // Delivers the messages that rate limits held back once their interval is over. Like processMessage, it announces the
+    // snapshot it uses, so an unsubscribe waits until it is done.
+    void PubSub::deliverHeldBack(const int64_t now) {
+        // the limiters that still hold something back that isn't due yet lower it again
+        m_nextHeldBackDue.store(kNever);
+        const Registry* registry;
+        do {
+            registry = m_registry.load();
+            m_activeRegistry.store(registry);
+        } while (registry != m_registry.load());
+        for (const auto& subscribers : registry->topics) {
+            for (const auto& [subscriber, inbox, rateLimiter] : subscribers) {
+                Message msg;
+                if (rateLimiter == kNoRateLimiter || !takeHeldBack(m_rateLimiters[rateLimiter], now, msg)) continue;
+                if (inbox != nullptr) {
+                    inbox->post(msg);
+                } else {
+                    deliver(subscriber, msg);
+                }
+                release(msg);
+            }
+        }
+        m_activeRegistry.store(nullptr);
+    }
+
+    // Called with the mutex taken, once no dispatcher uses a snapshot with the limiter anymore
+    void PubSub::freeRateLimiter(const uint8_t index) {
+        auto& limiter = m_rateLimiters[index];
+        SpinGuard guard(limiter.busy);
+        if (limiter.hasHeldBack) {
+            release(limiter.heldBack);
+        }
+        limiter.heldBack = {};
+        limiter.hasHeldBack = false;
+        limiter.owner = nullptr;
+    }
+
+    void PubSub::deliver(const SubscriberHandle subscriber, const Message& msg) {
+        const auto start = m_metrics.now();
+        auto* watchdog = m_watchdogCount.load() == 0 ? nullptr : findWatchdog(subscriber);
+        const auto startMicros = watchdog != nullptr ? m_clock->nowMicros() : 0;
+        subscriber->m_sequence = msg.sequence;
+        subscriber->subscriberCallback(msg.topic, msg.message);
+        m_metrics.callbackDone(subscriber, start);
+        if (watchdog != nullptr) {
+            checkBudget(*watchdog, subscriber, m_clock->nowMicros() - startMicros);
+        }
+    }
+
+    PubSub::Watchdog* PubSub::findWatchdog(const SubscriberHandle subscriber) {
+        for (auto& watchdog : m_watchdogs) {
+            if (watchdog.owner.load() == subscriber) return &watchdog;
+        }
+        return nullptr;
+    }
+
+    // Counts the call against the budget, and degrades the subscriber when it has too many strikes
+    void PubSub::checkBudget(Watchdog& watchdog, const SubscriberHandle subscriber, const int64_t elapsedMicros) {
+        // the callback may have unsubscribed, and the budget may belong to someone else by now
+        if (watchdog.owner.load() != subscriber) return;
+        const auto elapsed = static_cast<uint32_t>(std::clamp<int64_t>(elapsedMicros, 0, UINT32_MAX));
+        watchdog.calls.fetch_add(1);
+        raiseTo(watchdog.maxMicros, elapsed);
+        if (elapsed <= watchdog.budgetMicros.load()) {
+            auto strikes = watchdog.strikes.load();
+            while (strikes > 0 && !watchdog.strikes.compare_exchange_weak(strikes, strikes - 1)) {}
+            return;
+        }
+        watchdog.overruns.fetch_add(1);
+        const auto strikes = watchdog.strikes.fetch_add(1) + 1;
+        ESP_LOGD("PubSub", "Subscriber %p took %lu us, strike %lu", subscriber, static_cast<unsigned long>(elapsed), static_cast<unsigned long>(strikes));
+        const auto strikeLimit = watchdog.strikeLimit.load();
+        if (strikeLimit == 0 || strikes < strikeLimit || watchdog.degraded.exchange(true)) return;
+
+        const auto ok = doInMutex(
+            [this, &watchdog, subscriber]() {
+                // cleared or handed to another subscriber meanwhile
+                if (watchdog.owner.load() != subscriber) return true;
+                return degrade(watchdog, subscriber);
             },
-            kTag,
-            toCString(topic)
+            "checkBudget",
+            "degrade"
         );
+        if (!ok) {
+            // try again after the next strikes
+            ESP_LOGW("PubSub", "Could not degrade subscriber %p", subscriber);
+            watchdog.strikes.store(0);
+            watchdog.degraded.store(false);
+        }
     }
 
-    void PubSub::callSubscriber(const SubscriberMap &subscriberMap, const Message& msg) {
-        for (const auto &subscriber : subscriberMap.subscribers) {
-            if (msg.source == nullptr || msg.source != subscriber) {
-                subscriber->subscriberCallback(msg.topic, msg.message);
+    // Called with the mutex taken. Takes the subscriber out of the way of the others, as the budget says.
+    bool PubSub::degrade(Watchdog& watchdog, const SubscriberHandle subscriber) {
+        const auto& budget = watchdog.budget;
+        ESP_LOGW("PubSub", "Subscriber %p overran its budget of %lu us %lu times, %s", subscriber,
+            static_cast<unsigned long>(budget.budgetMicros), static_cast<unsigned long>(watchdog.overruns.load()),
+            budget.degrade == Degrade::Inbox ? "moving it to an inbox" : "decimating its messages");
+        if (budget.degrade == Degrade::Inbox) {
+            const auto* existing = findInbox(subscriber);
+            if (existing != nullptr && existing->isRunning()) return true;
+            auto* inbox = startInbox(subscriber, budget.inbox);
+            if (inbox == nullptr) return false;
+            // like subscribing with an inbox: all its subscriptions go through it
+            auto& registry = beginUpdate();
+            for (auto& subscribers : registry.topics) {
+                const auto entry = std::ranges::find(subscribers, subscriber, &Subscription::subscriber);
+                if (entry != subscribers.end()) {
+                    entry->inbox = inbox;
+                }
+            }
+            commitUpdate(registry);
+            return true;
+        }
+
+        auto& registry = beginUpdate();
+        TopicMask unlimited = 0;
+        for (size_t index = 0; index < kTopicCount; index++) {
+            const auto& subscribers = registry.topics[index];
+            const auto entry = std::ranges::find(subscribers, subscriber, &Subscription::subscriber);
+            if (entry != subscribers.end() && entry->rateLimiter == kNoRateLimiter) {
+                unlimited |= TopicMask{1} << index;
             }
         }
+        // changes nothing if it fails, so it goes before the limiters the subscriber has are touched
+        if (!limitSubscriptions(registry, subscriber, unlimited, RateLimit{.everyNth = budget.everyNth})) return false;
+        for (size_t index = 0; index < kTopicCount; index++) {
+            if ((unlimited & (TopicMask{1} << index)) != 0) continue;
+            const auto& subscribers = registry.topics[index];
+            const auto entry = std::ranges::find(subscribers, subscriber, &Subscription::subscriber);
+            if (entry == subscribers.end()) continue;
+            auto& limiter = m_rateLimiters[entry->rateLimiter];
+            SpinGuard guard(limiter.busy);
+            limiter.limit.everyNth = std::max(limiter.limit.everyNth, budget.everyNth);
+        }
+        commitUpdate(registry);
+        return true;
     }
 
-    bool PubSub::doesCallbackExist(const SubscriberMap& subscriberMap, const SubscriberHandle subscriber) {
-        return std::ranges::any_of(subscriberMap.subscribers, [subscriber](const auto& existingSubscriber) {
-            return existingSubscriber == subscriber;
-        });
+    // Called with the mutex taken
+    void PubSub::freeWatchdog(const SubscriberHandle subscriber) {
+        auto* watchdog = findWatchdog(subscriber);
+        if (watchdog == nullptr) return;
+        watchdog->owner.store(nullptr);
+        m_watchdogCount.fetch_sub(1);
+    }
+
+    void PubSub::countPublished(Lane& lane, const uint32_t count) {
+        m_publishedCount.fetch_add(count);
+        const auto depth = lane.pending.fetch_add(count) + count;
+        m_metrics.laneDepth(static_cast<size_t>(&lane - m_lanes.data()), depth);
+    }
+
+    // Writes off a message that was counted as published, but won't be dispatched.
+    // Counting it as dispatched keeps flush and isIdle right.
+    void PubSub::discard(Lane& lane, const Message& msg) {
+        if (msg.conflated) {
+            // the latest value went with the marker, so the next publish needs a new one
+            Message latest{};
+            doInMutex(
+                [this, &msg, &latest]() {
+                    auto& slot = m_conflationSlots[static_cast<size_t>(msg.topic)];
+                    latest = slot.latest;
+                    slot.latest = {};
+                    slot.pending = false;
+                    return true;
+                },
+                "discard",
+                toCString(msg.topic)
+            );
+            release(latest);
+        }
+        release(msg);
+        m_droppedCount[static_cast<size_t>(msg.topic)].fetch_add(1);
+        lane.pending.fetch_sub(1);
+        m_dispatchedCount.fetch_add(1);
+        if (m_flushWaiterCount.load() > 0) {
+            notifyFlushWaiters();
+        }
+    }
+
+    // Stores the value in the slot of the topic, and only sends a marker if there isn't one on its way already.
+    // The event loop takes the latest value when the marker comes in, so a burst never takes more than one place in the lane.
+    bool PubSub::publishConflated(Lane& lane, const Message& msg) {
+        const auto index = static_cast<size_t>(msg.topic);
+        bool needsMarker = false;
+        Message replaced{};
+        doInMutex(
+            [this, index, &msg, &needsMarker, &replaced]() {
+                auto& slot = m_conflationSlots[index];
+                if (slot.pending) {
+                    // the value that is still waiting is replaced, which counts as a drop
+                    m_droppedCount[index].fetch_add(1);
+                    replaced = slot.latest;
+                }
+                slot.latest = msg;
+                needsMarker = !slot.pending;
+                slot.pending = true;
+                return true;
+            },
+            "publish",
+            toCString(msg.topic)
+        );
+        release(replaced);
+        if (!needsMarker) return true;
+
+        Message marker{msg.source, 0, msg.topic, msg.sequence, true};
+        countPublished(lane, 1);
+        if (!lane.transport->send(marker, 0)) {
+            discard(lane, marker);
+            return false;
+        }
+        wakeEventLoop();
+        return true;
+    }
+
+    void PubSub::takeConflated(Message& msg) {
+        doInMutex(
+            [this, &msg]() {
+                auto& slot = m_conflationSlots[static_cast<size_t>(msg.topic)];
+                msg = slot.latest;
+                slot.latest = {};
+                slot.pending = false;
+                return true;
+            },
+            "receive",
+            toCString(msg.topic)
+        );
     }
 
     void PubSub::eventLoop(const std::shared_ptr<PubSub>& sharedPubSub) { 
         while (true) {
+            // handle everything that is waiting, then sleep until a publisher or end() wakes us up.
+            // A message arriving after the last receive leaves a pending notification, so we can't miss it.
+            // timers are checked between messages too, so a busy bus doesn't hold them up
+            sharedPubSub->runTimers();
+            while (!sharedPubSub->m_terminateFlag.load() && sharedPubSub->receive()) {
+                sharedPubSub->runTimers();
+            }
             if (sharedPubSub->m_terminateFlag.load()) {
                 ESP_LOGI("eventLoop", "Terminating. Reference count: %ld", sharedPubSub->getReferenceCount());
                 break;
             }
-            sharedPubSub->receive();
-            taskYIELD();
+            ulTaskNotifyTake(pdTRUE, sharedPubSub->timerWait());
         }
 
-        // Signal completion
+        // Signal completion. Clear the handle first, so nobody notifies the task once it is gone.
         ESP_LOGI("eventLoop", "Signalling completion");
+        sharedPubSub->doInMutex(
+            [&sharedPubSub]() {
+                sharedPubSub->m_eventLoopTaskHandle = nullptr;
+                return true;
+            },
+            "eventLoop",
+            "clear task handle"
+        );
         sharedPubSub->m_eventLoopFinished.store(true);
     }
 
@@ -234,68 +1521,491 @@ namespace pub_sub {
         vTaskDelete(nullptr);
     }
 
-    void PubSub::receive() {
+    bool PubSub::receive() {
         Message msg;
-        // not using doInMutex here, as we want to release the mutex before processing/waiting
-        if (xSemaphoreTake(m_mutex, 2* kMutexTimeout) == pdTRUE) {
-            if (xQueueReceive(m_message_queue, &msg, 0) == pdFAIL) {
-                // nothing waiting in the queue
-                m_processing = false;
-                xSemaphoreGive(m_mutex); 
-                vTaskDelay(pdMS_TO_TICKS(10)); 
-            } else {
-                m_processing = true;
-                char buffer[100];
-                std::visit(MessageVisitor(buffer), msg.message);
-                xSemaphoreGive(m_mutex);                
-                processMessage(msg);
-                m_processing = false;
+        if (!receiveFromLanes(msg)) {
+            return false;
+        }
+        if (msg.conflated) {
+            takeConflated(msg);
+        }
+        const auto* previousBus = dispatchingBus;
+        dispatchingBus = this;
+        dispatch(msg);
+        // what the callbacks published goes right after the message that caused it
+        while (takeDeferred(msg)) {
+            dispatch(msg);
+        }
+        dispatchingBus = previousBus;
+        return true;
+    }
+
+    void PubSub::dispatch(const Message& msg) {
+        if (m_traceMessages.load()) {
+            traceMessage(msg);
+        }
+        if (auto* tap = m_tap.load()) {
+            tap->onMessage(msg);
+        }
+        m_metrics.dispatched(msg);
+        processMessage(msg);
+        release(msg);
+        m_dispatchedCount.fetch_add(1);
+        if (m_flushWaiterCount.load() > 0) {
+            notifyFlushWaiters();
+        }
+    }
+
+    // A publish from a callback: the event loop can't wait for room in its own lanes, so the message goes to the deferred queue,
+    // which receive drains right after the current message. If that is full as well, the lane gets it if it has room.
+    bool PubSub::defer(Lane& lane, const Message& msg) {
+        if (m_deferredCount < m_deferred.size()) {
+            m_deferred[(m_deferredHead + m_deferredCount) % m_deferred.size()] = msg;
+            m_deferredCount++;
+            m_publishedCount.fetch_add(1);
+            return true;
+        }
+        countPublished(lane, 1);
+        if (!lane.transport->send(msg, 0)) {
+            discard(lane, msg);
+            return false;
+        }
+        return true;
+    }
+
+    bool PubSub::takeDeferred(Message& msg) {
+        if (m_deferredCount == 0) return false;
+        msg = m_deferred[m_deferredHead];
+        m_deferred[m_deferredHead] = {};
+        m_deferredHead = (m_deferredHead + 1) % m_deferred.size();
+        m_deferredCount--;
+        return true;
+    }
+
+    bool PubSub::receiveFromLanes(Message& msg) {
+        // an interrupt can't wait for room, so its queue goes first
+        if (m_isrPending.load() > 0 && xQueueReceive(m_isrQueue, &msg, 0) == pdPASS) {
+            m_isrPending.fetch_sub(1);
+            if (isRetained(msg.topic)) {
+                storeRetained(msg);
+            }
+            return true;
+        }
+        // a lower lane that waited long enough goes first
+        for (size_t index = 1; index < kPriorityCount; index++) {
+            auto& lane = m_lanes[index];
+            if (lane.skipped >= kStarvationBound && lane.transport->receive(msg)) {
+                lane.skipped = 0;
+                lane.pending.fetch_sub(1);
+                return true;
+            }
+        }
+        for (size_t index = 0; index < kPriorityCount; index++) {
+            auto& lane = m_lanes[index];
+            if (lane.pending.load() == 0 || !lane.transport->receive(msg)) continue;
+            lane.skipped = 0;
+            lane.pending.fetch_sub(1);
+            for (size_t lower = index + 1; lower < kPriorityCount; lower++) {
+                if (m_lanes[lower].pending.load() > 0) {
+                    m_lanes[lower].skipped++;
+                }
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void PubSub::notifyFlushWaiters() {
+        doInMutex(
+            [this]() {
+                for (const auto& [task, counter, target] : m_flushWaiters) {
+                    if (task != nullptr && isReached(counter->load(), target)) {
+                        xTaskNotifyGive(task);
+                    }
+                }
+                return true;
+            },
+            "notifyFlushWaiters",
+            "flush waiters"
+        );
+    }
+
+    void PubSub::traceMessage(const Message& msg) {
+        char buffer[100] = {};
+        std::visit(MessageVisitor(buffer), msg.message);
+        ESP_LOGI("trace", "Topic %s, payload %s", toCString(msg.topic), buffer);
+    }
+
+    void PubSub::processMessage(const Message& msg) {
+        const auto index = static_cast<size_t>(msg.topic);
+        if (index >= kTopicCount) return;
+        // Announce the snapshot we use before checking it's still the current one. A writer that swapped it in the meantime
+        // may not have seen the announcement and could reuse the slot, so then we take the new one.
+        const Registry* registry;
+        do {
+            registry = m_registry.load();
+            m_activeRegistry.store(registry);
+        } while (registry != m_registry.load());
+        callSubscribers(registry->topics[index], msg);
+        m_activeRegistry.store(nullptr);
+    }
+
+    // Returns how many of the messages went out. The rest were discarded, which counts them as dropped.
+    size_t PubSub::sendBatch(Lane& lane, const std::span<const Message> messages) {
+        if (messages.empty()) return 0;
+        size_t sent = 0;
+        if (dispatchingBus == this) {
+            for (const auto& message : messages) {
+                if (defer(lane, message)) sent++;
             }
-        } 
+            return sent;
+        }
+        countPublished(lane, static_cast<uint32_t>(messages.size()));
+        if (m_loopMode == LoopMode::Manual) {
+            // a batch larger than the room in the lane would wait forever, so send one by one and dispatch in between
+            for (const auto& message : messages) {
+                if (sendOrPump(lane, message, portMAX_DELAY)) {
+                    sent++;
+                } else {
+                    discard(lane, message);
+                }
+            }
+            return sent;
+        }
+        sent = lane.transport->sendBatch(messages);
+        if (sent < messages.size()) {
+            ESP_LOGE("publishBatch", "Dropped %u messages of a batch, starting with topic %s",
+                static_cast<unsigned>(messages.size() - sent), toCString(messages[sent].topic));
+            for (const auto& message : messages.subspan(sent)) {
+                discard(lane, message);
+            }
+        }
+        return sent;
     }
 
-    // expects the mutex to be taken before the operation
-    void PubSub::removeMapsToClear(const std::vector<SubscriberMap*>& mapsToClear) {
-        // remove all maps to clear from m_subscribers
-        for (auto* map : mapsToClear) {
-            std::erase_if(
-                m_subscribers,
-                [map](const SubscriberMap& sm) { return sm.topic == map->topic; });
+    bool PubSub::sendOrPump(Lane& lane, const Message& msg, const TickType_t timeout) {
+        if (m_loopMode != LoopMode::Manual) return lane.transport->send(msg, timeout);
+        // Nobody else empties the lanes, so waiting for room would never end. Dispatch to make room instead,
+        // unless this is a callback of a pump already.
+        while (!lane.transport->send(msg, 0)) {
+            if (timeout == 0 || pump() == 0) return false;
         }
+        return true;
     }
 
-    // expects the mutex to be taken
-    void PubSub::removeSubscriber(const SubscriberHandle subscriber, SubscriberMap& subscriberMap, std::vector<SubscriberMap*>& mapsToClear) {
-        // Manually iterate and remove subscribers that reference the specified callback
-        for (auto it = subscriberMap.subscribers.begin(); it != subscriberMap.subscribers.end(); ++it) {
-            if (static_cast<void*>(*it) == static_cast<void*>(subscriber)) {
-                it = subscriberMap.subscribers.erase(it);
+    bool PubSub::waitForDispatched(const std::atomic<uint32_t>& counter, const uint32_t target, const TickType_t timeout, const TaskHandle_t& countingTask) {
+        if (isReached(counter.load(), target)) return true;
+        const auto currentTask = xTaskGetCurrentTaskHandle();
+        const auto start = xTaskGetTickCount();
+        FlushWaiter* waiter = nullptr;
+        bool calledFromCountingTask = false;
+        doInMutex(
+            [this, &waiter, &calledFromCountingTask, &counter, &countingTask, currentTask, target]() {
+                // the counting task would be waiting for itself
+                if (currentTask == countingTask) {
+                    calledFromCountingTask = true;
+                    return true;
+                }
+                for (auto& candidate : m_flushWaiters) {
+                    if (candidate.task == nullptr) {
+                        candidate = {currentTask, &counter, target};
+                        waiter = &candidate;
+                        m_flushWaiterCount.fetch_add(1);
+                        break;
+                    }
+                }
+                return true;
+            },
+            "flush",
+            "register waiter"
+        );
+        if (calledFromCountingTask) return false;
+
+        // We registered before checking the count, and the counting task counts before checking for waiters.
+        // So either we see the count, or the counting task sees us and notifies.
+        bool result;
+        while (true) {
+            if (isReached(counter.load(), target)) {
+                result = true;
                 break;
             }
+            const auto elapsed = xTaskGetTickCount() - start;
+            if (timeout != portMAX_DELAY && elapsed >= timeout) {
+                result = false;
+                break;
+            }
+            if (waiter == nullptr) {
+                // all waiter slots taken, fall back to polling
+                vTaskDelay(1);
+            } else {
+                ulTaskNotifyTake(pdTRUE, timeout == portMAX_DELAY ? portMAX_DELAY : timeout - elapsed);
+            }
         }
 
-        if (subscriberMap.subscribers.empty()) {
-            mapsToClear.push_back(&subscriberMap);
+        if (waiter != nullptr) {
+            doInMutex(
+                [this, waiter]() {
+                    *waiter = {};
+                    m_flushWaiterCount.fetch_sub(1);
+                    return true;
+                },
+                "flush",
+                "unregister waiter"
+            );
         }
+        return result;
     }
-    void PubSub::processMessage(const Message& msg) const {
-        for (auto const& subscriberMap: m_subscribers) {
-            if (subscriberMap.topic == msg.topic) {
-                callSubscriber(subscriberMap, msg);
-                break;
+
+    void PubSub::wakeEventLoop() {
+        if (m_executor != nullptr) {
+            requestRun(nullptr);
+            return;
+        }
+        // Publishing after end() is not supported; once terminating, the task handle may disappear any moment.
+        if (m_eventLoopTaskHandle != nullptr && !m_terminateFlag.load()) {
+            xTaskNotifyGive(m_eventLoopTaskHandle);
+        }
+    }
+
+    // Runs the jobs that are due on the task that dispatches, and delivers what rate limits held back once its interval is over.
+    // As with callbacks, what the jobs publish goes to the deferred queue, so they never wait for room in the lanes,
+    // and it is dispatched right after them. Costs two atomic loads when nothing is scheduled.
+    size_t PubSub::runTimers() {
+        const auto nextDue = std::min(m_nextTimerDue.load(), m_nextHeldBackDue.load());
+        if (nextDue == kNever) return 0;
+        const auto now = m_clock->nowMicros();
+        if (now < nextDue) return 0;
+
+        const auto* previousBus = dispatchingBus;
+        dispatchingBus = this;
+        // restored rather than cleared at the end, so a nested run doesn't end the outer one early
+        const bool wasRunningTimers = m_runningTimers.load();
+        if (m_nextHeldBackDue.load() <= now) {
+            deliverHeldBack(now);
+        }
+        std::array<TimerWheel::Due, TimerWheel::kMaxTimers> due{};
+        size_t count = 0;
+        if (m_nextTimerDue.load() <= now) {
+            m_runningTimers.store(true);
+            doInMutex(
+                [this, now, &due, &count]() {
+                    count = m_timers.collectDue(now, due);
+                    m_nextTimerDue.store(m_timers.nextDue());
+                    return true;
+                },
+                "runTimers",
+                "timers"
+            );
+        }
+        for (size_t index = 0; index < count; index++) {
+            due[index].job->onTimer(due[index].scheduledMicros);
+        }
+        Message msg;
+        while (takeDeferred(msg)) {
+            dispatch(msg);
+        }
+        dispatchingBus = previousBus;
+        m_runningTimers.store(wasRunningTimers);
+        return count;
+    }
+
+    // How long the event loop may sleep before the next timer or held back message is due
+    TickType_t PubSub::timerWait() const {
+        const auto nextDue = std::min(m_nextTimerDue.load(), m_nextHeldBackDue.load());
+        if (nextDue == kNever) return portMAX_DELAY;
+        const auto remaining = nextDue - m_clock->nowMicros();
+        if (remaining <= 0) return 0;
+        constexpr int64_t kTickMicros = portTICK_PERIOD_MS * 1000;
+        return static_cast<TickType_t>((remaining + kTickMicros - 1) / kTickMicros);
+    }
+
+    // Puts the bus in the ready queue of the executor, unless it is there already. If a task is serving it right now,
+    // that task takes another turn instead. higherPriorityTaskWoken is only passed from interrupts.
+    void PubSub::requestRun(BaseType_t* higherPriorityTaskWoken) {
+        if (m_terminateFlag.load()) return;
+        auto state = m_runState.load();
+        while (true) {
+            if (state == RunState::Idle) {
+                if (m_runState.compare_exchange_weak(state, RunState::Scheduled)) break;
+            } else if (state == RunState::Running) {
+                if (m_runState.compare_exchange_weak(state, RunState::RunAgain)) return;
+            } else {
+                return;
+            }
+        }
+        const bool queued = higherPriorityTaskWoken != nullptr ?
+            m_executor->enqueueFromIsr(*this, higherPriorityTaskWoken) :
+            m_executor->enqueue(*this);
+        if (!queued) {
+            // not scheduled after all, so the next publish tries again
+            m_runState.store(RunState::Idle);
+            if (higherPriorityTaskWoken == nullptr) {
+                ESP_LOGE("requestRun", "Ready queue of the executor full");
             }
         }
     }
 
+    // Called by a task of the executor. Returns true if the bus needs another turn; when it returns false,
+    // end() may already have let the bus go, so the caller must not touch it anymore.
+    bool PubSub::serve(const size_t maxMessages) {
+        m_runState.store(RunState::Running);
+        const auto count = m_terminateFlag.load() ? 0 : dispatchMessages(maxMessages);
+        if (count < maxMessages) {
+            auto expected = RunState::Running;
+            if (m_runState.compare_exchange_strong(expected, RunState::Idle)) return false;
+        }
+        // more work: to the back of the queue, so the other buses get their turn
+        if (m_terminateFlag.load()) {
+            m_runState.store(RunState::Idle);
+            return false;
+        }
+        m_runState.store(RunState::Scheduled);
+        return true;
+    }
+
+    size_t PubSub::dispatchMessages(const size_t maxMessages) {
+        m_pumping = true;
+        runTimers();
+        size_t count = 0;
+        while (count < maxMessages && receive()) {
+            count++;
+            runTimers();
+        }
+        m_pumping = false;
+        return count;
+    }
+
     void PubSub::dumpSubscribers(const char* tag) const {
         constexpr auto kTag = "dump_subscribers";
         ESP_LOGI(kTag, "Dumping subscribers (tag %s)", tag);
-        for (const auto& [topic, subscribers]: m_subscribers) {
-            ESP_LOGI(kTag, "Topic %d", static_cast<uint8_t>(topic));
-            for (auto const& subscriber: subscribers) {
-                ESP_LOGI(kTag, "  Subscriber %p", subscriber);
+        // writers only replace the snapshot under the mutex, so holding it keeps ours intact
+        doInMutex(
+            [this]() {
+                const auto* registry = m_registry.load();
+                for (size_t index = 0; index < kTopicCount; index++) {
+                    const auto& subscribers = registry->topics[index];
+                    if (subscribers.empty()) continue;
+                    ESP_LOGI(kTag, "Topic %d", static_cast<uint8_t>(index));
+                    for (auto const& [subscriber, inbox, rateLimiter]: subscribers) {
+                        ESP_LOGI(kTag, "  Subscriber %p%s", subscriber, inbox != nullptr ? " (inbox)" : "");
+                    }
+                }
+                return true;
+            },
+            "dumpSubscribers",
+            tag
+        );
+    }
+
+    // Inbox
+
+    PubSub::Inbox::Inbox(PubSub& owner, const SubscriberHandle subscriber, const InboxOptions& options) :
+        m_owner(owner), m_subscriber(subscriber), m_options(options), m_transport(options.depth) {
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        m_lock = xSemaphoreCreateMutexStatic(&m_lockBuffer);
+#else
+        m_lock = xSemaphoreCreateMutex();
+#endif
+    }
+
+    PubSub::Inbox::~Inbox() {
+        if (isRunning()) {
+            stop();
+        }
+        if (m_lock != nullptr) {
+            vSemaphoreDelete(m_lock);
+        }
+    }
+
+    // called with the PubSub mutex taken
+    bool PubSub::Inbox::start() {
+        if (!m_transport.isValid() || m_lock == nullptr) return false;
+        m_terminateFlag.store(false);
+        m_finished.store(false);
+        xSemaphoreTake(m_lock, portMAX_DELAY);
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        // the stack is reused when the inbox restarts; the task that used it before has finished by then
+        m_taskHandle = xTaskCreateStaticPinnedToCore(
+            inboxTask, "Inbox", m_stack.size(), this, m_options.priority, m_stack.data(), &m_taskBuffer, m_options.core);
+        const bool created = m_taskHandle != nullptr;
+#else
+        const bool created = xTaskCreatePinnedToCore(inboxTask, "Inbox", m_options.stackSize, this, m_options.priority, &m_taskHandle, m_options.core) == pdPASS;
+#endif
+        xSemaphoreGive(m_lock);
+        if (!created) {
+            m_finished.store(true);
+            return false;
+        }
+        return true;
+    }
+
+    void PubSub::Inbox::stop() {
+        m_terminateFlag.store(true);
+        bool calledFromInbox = false;
+        xSemaphoreTake(m_lock, portMAX_DELAY);
+        if (m_taskHandle != nullptr) {
+            calledFromInbox = m_taskHandle == xTaskGetCurrentTaskHandle();
+            xTaskNotifyGive(m_taskHandle);
+        }
+        xSemaphoreGive(m_lock);
+        // the inbox task can't wait for itself; it stops as soon as the callback returns
+        if (calledFromInbox) return;
+        while (!m_finished.load()) {
+            vTaskDelay(1);
+        }
+    }
+
+    void PubSub::Inbox::post(const Message& msg) {
+        xSemaphoreTake(m_lock, portMAX_DELAY);
+        // a stopping inbox drops the message; the task may be gone already
+        if (m_terminateFlag.load() || m_taskHandle == nullptr) {
+            xSemaphoreGive(m_lock);
+            return;
+        }
+        // the event loop lets go of the message when it is done calling the subscribers, the inbox may still need it
+        m_postedCount.fetch_add(1);
+        m_owner.retain(msg);
+        if (m_transport.send(msg, 0)) {
+            xTaskNotifyGive(m_taskHandle);
+        } else {
+            // counted as processed, so the bus still becomes idle
+            m_owner.release(msg);
+            m_processedCount.fetch_add(1);
+            m_owner.m_droppedCount[static_cast<size_t>(msg.topic)].fetch_add(1);
+        }
+        xSemaphoreGive(m_lock);
+    }
+
+    void PubSub::Inbox::inboxTask(void* param) {
+        static_cast<Inbox*>(param)->run();
+        vTaskDelete(nullptr);
+    }
+
+    void PubSub::Inbox::run() {
+        Message msg;
+        while (true) {
+            while (!m_terminateFlag.load() && m_transport.receive(msg)) {
+                m_owner.deliver(m_subscriber, msg);
+                m_owner.release(msg);
+                m_processedCount.fetch_add(1);
+                if (m_owner.m_flushWaiterCount.load() > 0) {
+                    m_owner.notifyFlushWaiters();
+                }
             }
+            if (m_terminateFlag.load()) break;
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+
+        // Once we had the lock, a post that saw the terminate flag still clear is done, and no other one gets in.
+        // Then count what is left as processed, so the bus can become idle again and the strings and blocks go back.
+        xSemaphoreTake(m_lock, portMAX_DELAY);
+        m_taskHandle = nullptr;
+        xSemaphoreGive(m_lock);
+        while (m_transport.receive(msg)) {
+            m_owner.release(msg);
+            m_processedCount.fetch_add(1);
         }
+        m_finished.store(true);
     }
 
     void Subscriber::subscriberCallback(const Topic topic, const Payload &payload) {
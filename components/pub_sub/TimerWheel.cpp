@@ -0,0 +1,119 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+
+#include "TimerWheel.hpp"
+#include <algorithm>
+
+namespace pub_sub {
+
+    TimerWheel::TimerWheel() {
+        m_slots.fill(kNone);
+    }
+
+    TimerId TimerWheel::add(TimerJob& job, const int64_t now, const uint32_t periodMicros, const uint32_t phaseMicros) {
+        if (periodMicros == 0) return kNoTimer;
+        const auto found = std::ranges::find(m_entries, nullptr, &Entry::job);
+        if (found == m_entries.end()) return kNoTimer;
+        const auto index = static_cast<uint16_t>(found - m_entries.begin());
+        *found = {&job, now + phaseMicros, periodMicros};
+        if (m_tick < 0) {
+            m_tick = now / kResolutionMicros;
+        }
+        insert(index);
+        updateNextDue();
+        return index;
+    }
+
+    bool TimerWheel::remove(const TimerId id) {
+        if (id >= kMaxTimers || m_entries[id].job == nullptr) return false;
+        const auto index = static_cast<uint16_t>(id);
+        unlink(index);
+        m_entries[index] = {};
+        updateNextDue();
+        return true;
+    }
+
+    size_t TimerWheel::collectDue(const int64_t now, const std::span<Due, kMaxTimers> due) {
+        if (now < m_nextDue) return 0;
+        const auto nowTick = now / kResolutionMicros;
+        // after a full turn every slot has been seen, so a long gap costs no more than that
+        const auto steps = std::min<int64_t>(nowTick - m_tick + 1, kSlots);
+        std::array<uint16_t, kMaxTimers> fired{};
+        size_t count = 0;
+        for (int64_t step = 0; step < steps; step++) {
+            auto& head = m_slots[static_cast<size_t>(m_tick + step) % kSlots];
+            auto* link = &head;
+            while (*link != kNone) {
+                auto& entry = m_entries[*link];
+                if (entry.due > now) {
+                    link = &entry.next;
+                    continue;
+                }
+                fired[count] = *link;
+                *link = entry.next;
+                due[count++] = {entry.job, entry.due};
+            }
+        }
+        // the slot of the current tick may still hold jobs due later in the tick, so it is looked at again next time
+        m_tick = nowTick;
+        for (size_t index = 0; index < count; index++) {
+            auto& entry = m_entries[fired[index]];
+            const auto lateness = static_cast<uint64_t>(now - entry.due);
+            const auto missed = static_cast<uint32_t>(lateness / entry.period);
+            entry.stats.runs++;
+            entry.stats.missed += missed;
+            entry.stats.maxLatenessMicros = std::max(entry.stats.maxLatenessMicros, static_cast<uint32_t>(lateness));
+            entry.totalLateness += lateness;
+            entry.due += static_cast<int64_t>(entry.period) * (missed + 1);
+            insert(fired[index]);
+        }
+        updateNextDue();
+        return count;
+    }
+
+    TimerStats TimerWheel::getStats(const TimerId id) const {
+        if (id >= kMaxTimers || m_entries[id].job == nullptr) return {};
+        const auto& entry = m_entries[id];
+        auto stats = entry.stats;
+        if (stats.runs > 0) {
+            stats.meanLatenessMicros = static_cast<uint32_t>(entry.totalLateness / stats.runs);
+        }
+        return stats;
+    }
+
+    // Private methods
+
+    void TimerWheel::insert(const uint16_t index) {
+        auto& head = m_slots[slotOf(m_entries[index].due)];
+        m_entries[index].next = head;
+        head = index;
+    }
+
+    void TimerWheel::unlink(const uint16_t index) {
+        auto* link = &m_slots[slotOf(m_entries[index].due)];
+        while (*link != kNone && *link != index) {
+            link = &m_entries[*link].next;
+        }
+        if (*link == index) {
+            *link = m_entries[index].next;
+        }
+    }
+
+    void TimerWheel::updateNextDue() {
+        m_nextDue = kNever;
+        for (const auto& entry : m_entries) {
+            if (entry.job != nullptr) {
+                m_nextDue = std::min(m_nextDue, entry.due);
+            }
+        }
+    }
+}
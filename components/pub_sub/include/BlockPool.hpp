@@ -0,0 +1,160 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+// Fixed pool of data blocks for payloads that don't fit in a message, such as a batch of samples.
+// A producer borrows a block with loan(), fills it in place and publishes it. The message only carries a BlockRef,
+// so the data is never copied. Every message in flight holds a reference; the block goes back to the pool
+// when the last one is gone. Like the string arena, the pool is lock-free: a free block is claimed with a compare-and-swap
+// on its reference count.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+namespace pub_sub {
+
+    struct BlockHeader {
+        std::atomic<uint32_t> references = 0;
+        // bytes filled in by the producer
+        size_t size = 0;
+        size_t capacity = 0;
+        std::byte* data = nullptr;
+    };
+
+    // Read-only view of a published block, as subscribers get it in the payload. Valid until the callback returns,
+    // unless the subscriber keeps it with retain (and gives it back with release).
+    class BlockRef {
+    public:
+        BlockRef() = default;
+        explicit BlockRef(BlockHeader* block) : m_block(block) {}
+
+        template <typename T>
+        std::span<const T> as() const {
+            static_assert(std::is_trivially_copyable_v<T>, "Blocks hold plain data");
+            if (m_block == nullptr) return {};
+            return {reinterpret_cast<const T*>(m_block->data), m_block->size / sizeof(T)};
+        }
+
+        size_t size() const { return m_block == nullptr ? 0 : m_block->size; }
+        bool isValid() const { return m_block != nullptr; }
+
+        void retain() const {
+            if (m_block != nullptr) m_block->references.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void release() const {
+            if (m_block != nullptr) m_block->references.fetch_sub(1, std::memory_order_release);
+        }
+
+        // like retain, but fails if the block went back to the pool meanwhile
+        bool tryRetain() const {
+            if (m_block == nullptr) return true;
+            auto current = m_block->references.load(std::memory_order_relaxed);
+            while (current != 0) {
+                if (m_block->references.compare_exchange_weak(current, current + 1, std::memory_order_acquire)) return true;
+            }
+            return false;
+        }
+
+    private:
+        BlockHeader* m_block = nullptr;
+    };
+
+    // A borrowed block, writable by its owner until it is published. A loan that isn't published goes back when it is destroyed.
+    class Loan {
+    public:
+        Loan() = default;
+        explicit Loan(BlockHeader* block) : m_block(block) {}
+        ~Loan() { BlockRef(m_block).release(); }
+        Loan(const Loan&) = delete;
+        Loan& operator=(const Loan&) = delete;
+        Loan(Loan&& other) noexcept : m_block(std::exchange(other.m_block, nullptr)) {}
+        Loan& operator=(Loan&& other) noexcept {
+            if (this != &other) {
+                BlockRef(m_block).release();
+                m_block = std::exchange(other.m_block, nullptr);
+            }
+            return *this;
+        }
+
+        // the whole block as an array of T, to fill in
+        template <typename T>
+        std::span<T> as() {
+            static_assert(std::is_trivially_copyable_v<T>, "Blocks hold plain data");
+            if (m_block == nullptr) return {};
+            return {reinterpret_cast<T*>(m_block->data), m_block->capacity / sizeof(T)};
+        }
+
+        // the number of elements of T that subscribers get to see
+        template <typename T>
+        void setCount(const size_t count) {
+            if (m_block != nullptr) m_block->size = std::min(count * sizeof(T), m_block->capacity);
+        }
+
+        BlockRef ref() const { return BlockRef(m_block); }
+        bool isValid() const { return m_block != nullptr; }
+
+    private:
+        BlockHeader* m_block = nullptr;
+    };
+
+    template <size_t BlockSize, size_t BlockCount>
+    class BlockPool {
+        static_assert(BlockSize > 0 && BlockCount > 0, "The pool needs at least one block");
+
+    public:
+        BlockPool() {
+            for (size_t index = 0; index < BlockCount; index++) {
+                m_headers[index].capacity = BlockSize;
+                m_headers[index].data = m_data[index].bytes;
+            }
+        }
+        BlockPool(const BlockPool&) = delete;
+        BlockPool& operator=(const BlockPool&) = delete;
+        BlockPool(BlockPool&&) = delete;
+        BlockPool& operator=(BlockPool&&) = delete;
+
+        // returns an invalid loan if all blocks are in use
+        Loan loan() {
+            for (auto& header : m_headers) {
+                uint32_t expected = 0;
+                if (header.references.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+                    header.size = 0;
+                    return Loan(&header);
+                }
+            }
+            return {};
+        }
+
+        size_t inUse() const {
+            size_t count = 0;
+            for (const auto& header : m_headers) {
+                if (header.references.load(std::memory_order_relaxed) != 0) count++;
+            }
+            return count;
+        }
+
+    private:
+        struct alignas(std::max_align_t) AlignedBlock {
+            std::byte bytes[BlockSize];
+        };
+
+        std::array<BlockHeader, BlockCount> m_headers{};
+        std::array<AlignedBlock, BlockCount> m_data{};
+    };
+}
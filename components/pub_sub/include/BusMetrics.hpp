@@ -0,0 +1,172 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+// Runtime metrics of the bus: lane depths, messages per topic, and latency histograms.
+// The bus holds a BusMetrics<kMetricsEnabled>. Building with PUB_SUB_METRICS=0 picks the empty specialization,
+// so the calls compile to nothing and the snapshot only has what the bus counts anyway.
+
+#pragma once
+
+#include "esp_timer.h"
+#include "Message.hpp"
+#include <array>
+#include <atomic>
+#include <bit>
+
+#ifndef PUB_SUB_METRICS
+#define PUB_SUB_METRICS 1
+#endif
+
+namespace pub_sub {
+
+    constexpr bool kMetricsEnabled = PUB_SUB_METRICS != 0;
+
+    // Bucket 0 counts durations of 0 us, bucket n counts [2^(n-1), 2^n) us. The last bucket also takes everything longer.
+    constexpr size_t kHistogramBuckets = 16;
+    using Histogram = std::array<uint32_t, kHistogramBuckets>;
+
+    constexpr size_t histogramBucket(const uint32_t micros) {
+        const auto bucket = static_cast<size_t>(std::bit_width(micros));
+        return bucket < kHistogramBuckets ? bucket : kHistogramBuckets - 1;
+    }
+
+    // Subscribers beyond this number still get their messages, but their callbacks aren't timed
+    constexpr size_t kMaxTrackedSubscribers = 16;
+
+    struct LaneMetrics {
+        uint32_t depth = 0;
+        uint32_t highWater = 0;
+    };
+
+    struct TopicMetrics {
+        uint32_t published = 0;
+        uint32_t dispatched = 0;
+        uint32_t dropped = 0;
+    };
+
+    struct SubscriberMetrics {
+        SubscriberHandle subscriber = nullptr;
+        Histogram callbackMicros{};
+    };
+
+    struct MetricsSnapshot {
+        // false if the metrics were compiled out. Then only the lane depths and the drops are filled in.
+        bool enabled = false;
+        std::array<LaneMetrics, kPriorityCount> lanes{};
+        std::array<TopicMetrics, kTopicCount> topics{};
+        // from publish until the event loop dispatches the message
+        Histogram dispatchLatencyMicros{};
+        std::array<SubscriberMetrics, kMaxTrackedSubscribers> subscribers{};
+        size_t subscriberCount = 0;
+    };
+
+    template <bool Enabled>
+    class BusMetrics;
+
+    template <>
+    class BusMetrics<true> {
+    public:
+        // a 32 bit microsecond clock wraps after 71 minutes, which is fine for differences
+        static uint32_t now() { return static_cast<uint32_t>(esp_timer_get_time()); }
+
+        void laneDepth(const size_t lane, const uint32_t depth) {
+            auto highWater = m_highWater[lane].load(std::memory_order_relaxed);
+            while (depth > highWater && !m_highWater[lane].compare_exchange_weak(highWater, depth, std::memory_order_relaxed)) {}
+        }
+
+        void published(const Topic topic) {
+            const auto index = static_cast<size_t>(topic);
+            if (index >= kTopicCount) return;
+            m_topics[index].published.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void dispatched(const Message& msg) {
+            const auto index = static_cast<size_t>(msg.topic);
+            if (index >= kTopicCount) return;
+            m_topics[index].dispatched.fetch_add(1, std::memory_order_relaxed);
+            m_dispatchLatency[histogramBucket(now() - msg.publishedAt)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void callbackDone(const SubscriberHandle subscriber, const uint32_t start) {
+            auto* entry = findOrClaim(subscriber);
+            if (entry == nullptr) return;
+            entry->callbackMicros[histogramBucket(now() - start)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void fill(MetricsSnapshot& snapshot) const {
+            snapshot.enabled = true;
+            for (size_t lane = 0; lane < kPriorityCount; lane++) {
+                snapshot.lanes[lane].highWater = m_highWater[lane].load(std::memory_order_relaxed);
+            }
+            for (size_t topic = 0; topic < kTopicCount; topic++) {
+                snapshot.topics[topic].published = m_topics[topic].published.load(std::memory_order_relaxed);
+                snapshot.topics[topic].dispatched = m_topics[topic].dispatched.load(std::memory_order_relaxed);
+            }
+            copy(m_dispatchLatency, snapshot.dispatchLatencyMicros);
+            snapshot.subscriberCount = 0;
+            for (const auto& entry : m_subscribers) {
+                const auto subscriber = entry.subscriber.load(std::memory_order_acquire);
+                if (subscriber == nullptr) break;
+                auto& target = snapshot.subscribers[snapshot.subscriberCount++];
+                target.subscriber = subscriber;
+                copy(entry.callbackMicros, target.callbackMicros);
+            }
+        }
+
+    private:
+        using AtomicHistogram = std::array<std::atomic<uint32_t>, kHistogramBuckets>;
+
+        struct TopicCounters {
+            std::atomic<uint32_t> published = 0;
+            std::atomic<uint32_t> dispatched = 0;
+        };
+
+        struct SubscriberEntry {
+            std::atomic<SubscriberHandle> subscriber = nullptr;
+            AtomicHistogram callbackMicros{};
+        };
+
+        static void copy(const AtomicHistogram& source, Histogram& target) {
+            for (size_t bucket = 0; bucket < kHistogramBuckets; bucket++) {
+                target[bucket] = source[bucket].load(std::memory_order_relaxed);
+            }
+        }
+
+        // Entries are claimed in order and never given back, so the first empty entry ends the search.
+        // Inbox tasks time their callbacks too, hence the compare-exchange.
+        SubscriberEntry* findOrClaim(const SubscriberHandle subscriber) {
+            for (auto& entry : m_subscribers) {
+                auto current = entry.subscriber.load(std::memory_order_acquire);
+                if (current == nullptr && entry.subscriber.compare_exchange_strong(current, subscriber, std::memory_order_acq_rel)) {
+                    return &entry;
+                }
+                if (current == subscriber) return &entry;
+            }
+            return nullptr;
+        }
+
+        std::array<std::atomic<uint32_t>, kPriorityCount> m_highWater{};
+        std::array<TopicCounters, kTopicCount> m_topics{};
+        AtomicHistogram m_dispatchLatency{};
+        std::array<SubscriberEntry, kMaxTrackedSubscribers> m_subscribers{};
+    };
+
+    template <>
+    class BusMetrics<false> {
+    public:
+        static uint32_t now() { return 0; }
+        void laneDepth(size_t, uint32_t) {}
+        void published(Topic) {}
+        void dispatched(const Message&) {}
+        void callbackDone(SubscriberHandle, uint32_t) {}
+        void fill(MetricsSnapshot&) const {}
+    };
+}
@@ -0,0 +1,75 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+
+// A fixed pool of dispatcher tasks that serves any number of buses, so a bus doesn't need an event loop task and stack of its own.
+// A bus with work waiting goes into the ready queue once; a task takes it out, dispatches a batch of its messages and puts it
+// at the back again if there is more, so a busy bus can't starve the others. A bus is only served by one task at a time.
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "sdkconfig.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace pub_sub {
+
+    class PubSub;
+
+    class Executor {
+    public:
+        static constexpr size_t kMaxTasks = CONFIG_PUB_SUB_EXECUTOR_TASKS;
+        static constexpr size_t kMaxBuses = CONFIG_PUB_SUB_EXECUTOR_MAX_BUSES;
+        // messages a task dispatches for a bus before it moves on to the next one
+        static constexpr size_t kBatchSize = 32;
+
+        // Starts the tasks; taskCount is capped at kMaxTasks. All buses must have ended before the executor goes.
+        explicit Executor(size_t taskCount = kMaxTasks, UBaseType_t priority = 3);
+        ~Executor();
+        Executor(const Executor&) = delete;
+        Executor& operator=(const Executor&) = delete;
+        Executor(Executor&&) = delete;
+        Executor& operator=(Executor&&) = delete;
+
+        size_t getTaskCount() const { return m_taskCount; }
+        size_t getBusCount() const { return m_busCount.load(); }
+
+    private:
+        friend class PubSub;
+
+        // called by the buses. A bus is in the ready queue at most once, so room for kMaxBuses is enough,
+        // and enqueueing doesn't wait: a publisher must not block on the executor. Returns false if the queue is full anyway.
+        bool attach();
+        void detach();
+        bool enqueue(PubSub& bus);
+        bool enqueueFromIsr(PubSub& bus, BaseType_t* higherPriorityTaskWoken);
+
+        static void workerTask(void* param);
+        void run();
+
+        size_t m_taskCount;
+        QueueHandle_t m_ready = nullptr;
+        std::array<TaskHandle_t, kMaxTasks> m_tasks{};
+        std::atomic<size_t> m_busCount = 0;
+        std::atomic<size_t> m_finishedCount = 0;
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        std::array<uint8_t, (kMaxBuses + kMaxTasks) * sizeof(PubSub*)> m_readyItems{};
+        StaticQueue_t m_readyBuffer{};
+        std::array<std::array<StackType_t, CONFIG_PUB_SUB_EXECUTOR_STACK_SIZE>, kMaxTasks> m_stacks{};
+        std::array<StaticTask_t, kMaxTasks> m_taskBuffers{};
+#endif
+    };
+}
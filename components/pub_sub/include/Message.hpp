@@ -0,0 +1,192 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+// Message types that travel over the PubSub bus: the topics, the payload variant and the subscriber interface.
+
+#pragma once
+
+#include "BlockPool.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <variant>
+
+namespace pub_sub {
+
+    struct IntCoordinate {
+        int16_t x;
+        int16_t y;
+
+        IntCoordinate() : x(0), y(0) {}
+        IntCoordinate(const int16_t xIn, const int16_t yIn) : x(xIn), y(yIn) {}
+
+        // we need this to pass coordinates in a memory efficient way but still keep reasonable accuracy
+        static IntCoordinate times10(const double xIn, const double yIn) {
+            return {static_cast<int16_t>(xIn * 10), static_cast<int16_t>(yIn * 10)};
+        }
+
+        friend std::ostream& operator<<(std::ostream& os, const IntCoordinate& coordinate) {
+            os << "(" << coordinate.x << ", " << coordinate.y << ")";
+            return os;
+        }
+    };
+    
+    using Payload = std::variant<int, float, const char*, IntCoordinate, BlockRef>;
+
+    enum class Topic : uint8_t {
+        None = 0,
+        Anomaly,
+        Drifted,
+        NoFit,
+        Pulse,
+        Sample,
+        SensorWasReset,
+        AllTopics = UINT8_MAX
+    };
+
+    // Number of real topics (i.e. excluding AllTopics). Must be updated when a topic is added.
+    constexpr size_t kTopicCount = static_cast<size_t>(Topic::SensorWasReset) + 1;
+    static_assert(kTopicCount <= 32, "Topics must fit in a 32 bit mask");
+
+    using TopicMask = uint32_t;
+
+    constexpr TopicMask kAllTopicsMask = (TopicMask{1} << kTopicCount) - 1;
+
+    // AllTopics maps to all bits, values outside the topic range map to no bits at all.
+    constexpr TopicMask toMask(const Topic topic) {
+        if (topic == Topic::AllTopics) return kAllTopicsMask;
+        const auto index = static_cast<size_t>(topic);
+        return index < kTopicCount ? TopicMask{1} << index : 0;
+    }
+    
+    // Every topic travels in the lane of its priority. The event loop drains the higher lanes first,
+    // so a burst of samples or anomalies can't hold up a pulse.
+    enum class Priority : uint8_t {
+        High = 0,
+        Normal,
+        Low
+    };
+
+    constexpr size_t kPriorityCount = static_cast<size_t>(Priority::Low) + 1;
+
+    constexpr Priority defaultPriority(const Topic topic) {
+        switch (topic) {
+            case Topic::Pulse:
+            case Topic::SensorWasReset:
+                return Priority::High;
+            case Topic::Sample:
+                return Priority::Low;
+            default:
+                return Priority::Normal;
+        }
+    }
+
+    constexpr const char* toCString(Topic topic) {
+        switch (topic) {
+            case Topic::None: return "None";
+            case Topic::Anomaly: return "Anomaly";
+            case Topic::Drifted: return "Drifted";
+            case Topic::NoFit: return "NoFit";
+            case Topic::Pulse: return "Pulse";
+            case Topic::Sample: return "Sample";
+            case Topic::SensorWasReset: return "SensorWasReset";
+            case Topic::AllTopics: return "AllTopics";
+            default: return "Unknown";
+        }
+    }
+
+    class PubSub;
+
+    class Subscriber {
+        public:
+        Subscriber() = default;
+        virtual ~Subscriber() = default;
+        Subscriber(const Subscriber&) = delete;
+        Subscriber& operator=(const Subscriber&) = delete;
+        Subscriber(Subscriber&&) = delete;
+        Subscriber& operator=(Subscriber&&) = delete;
+        
+        [[nodiscard]] Topic getTopic() const { return m_topic; }
+            [[nodiscard]] Payload getPayload() const { return m_payload; }
+            // Sequence number of the message being delivered. Numbers count up per topic, so a gap means messages were dropped.
+            [[nodiscard]] uint32_t getSequence() const { return m_sequence; }
+            virtual void reset() { 
+                m_topic = Topic::None; 
+                m_payload = 0;
+            }
+            virtual void subscriberCallback(Topic topic, const Payload& payload);
+        private:
+            friend class PubSub;
+            Topic m_topic = Topic::None;
+            Payload m_payload = 0;
+            uint32_t m_sequence = 0;
+    };
+
+    using SubscriberHandle = Subscriber*;
+
+    struct Message {
+        SubscriberHandle source;
+        Payload message;
+        Topic topic;
+        uint32_t sequence = 0;
+        // the payload is in the conflation slot of the topic rather than in the message
+        bool conflated = false;
+        // microseconds, only set if the bus keeps metrics
+        uint32_t publishedAt = 0;
+    };
+
+    // Sees every message the bus dispatches, e.g. to record the stream. Called from the event loop, and from the publishing task
+    // for topics with inline dispatch, so it must be quick and safe to call from several tasks.
+    class MessageTap {
+    public:
+        MessageTap() = default;
+        virtual ~MessageTap() = default;
+        MessageTap(const MessageTap&) = delete;
+        MessageTap& operator=(const MessageTap&) = delete;
+        MessageTap(MessageTap&&) = delete;
+        MessageTap& operator=(MessageTap&&) = delete;
+
+        virtual void onMessage(const Message& message) = 0;
+    };
+
+    template <size_t BufferSize>
+    class MessageVisitor {
+        public:
+            explicit MessageVisitor(char(&buffer)[BufferSize]) :m_buffer(buffer) {}
+    
+            void operator()(const int value) const {
+                snprintf(m_buffer, m_bufferSize, "%d", value);
+            }
+
+            void operator()(const float value) const {
+                snprintf(m_buffer, m_bufferSize, "%f", value);
+            }
+
+            void operator()(const char* value) const {
+                strncpy(m_buffer, value, m_bufferSize - 1);
+                m_buffer[m_bufferSize - 1] = '\0';
+            }
+
+            void operator()(const IntCoordinate& value) const {
+                snprintf(m_buffer, m_bufferSize - 1, "%d, %d", value.x, value.y);
+            }
+
+            void operator()(const BlockRef& value) const {
+                snprintf(m_buffer, m_bufferSize, "block of %u bytes", static_cast<unsigned>(value.size()));
+            }
+
+        private:
+            char *m_buffer;
+            size_t m_bufferSize = BufferSize;
+    };
+}
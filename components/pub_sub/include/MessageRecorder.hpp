@@ -0,0 +1,138 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+// Records the message stream of a bus in a compact binary log, to reproduce problems on the host (see MessageReplayer.hpp).
+// The recorder is a MessageTap: it turns every dispatched message into a 12 byte record (tick, topic, payload, source id)
+// and puts it in a lock-free ring buffer. That is all the event loop pays. A task of its own takes the records out
+// with flush and writes them to a sink in chunks, e.g. a file or a UART.
+// Ints, floats and coordinates are recorded with their value; strings and blocks only with their kind, as their content
+// isn't in the message.
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "Message.hpp"
+#include "MpscRingBuffer.hpp"
+#include "PackedMessage.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+
+namespace pub_sub {
+
+    // The records are written as they are in memory, little endian on both the ESP32 and the usual hosts. The tick is the FreeRTOS tick count.
+    struct MessageRecord {
+        uint32_t tick = 0;
+        uint32_t value = 0;
+        Topic topic = Topic::None;
+        PayloadKind kind = PayloadKind::Int;
+        // 0 for no source, kUntrackedSource for a source that didn't fit in the table of the recorder
+        uint16_t source = 0;
+    };
+
+    static_assert(sizeof(MessageRecord) == 12, "A record takes 12 bytes");
+
+    constexpr uint16_t kUntrackedSource = UINT16_MAX;
+
+    class RecordSink {
+    public:
+        RecordSink() = default;
+        virtual ~RecordSink() = default;
+        RecordSink(const RecordSink&) = delete;
+        RecordSink& operator=(const RecordSink&) = delete;
+        RecordSink(RecordSink&&) = delete;
+        RecordSink& operator=(RecordSink&&) = delete;
+
+        // returns false if the records could not be written
+        virtual bool write(std::span<const MessageRecord> records) = 0;
+    };
+
+    // Appends the records to an open file. The caller owns the file.
+    class FileRecordSink final : public RecordSink {
+    public:
+        explicit FileRecordSink(FILE* file) : m_file(file) {}
+
+        bool write(const std::span<const MessageRecord> records) override {
+            return fwrite(records.data(), sizeof(MessageRecord), records.size(), m_file) == records.size();
+        }
+
+    private:
+        FILE* m_file;
+    };
+
+    template <size_t Capacity>
+    class MessageRecorder final : public MessageTap {
+    public:
+        // records per write to the sink
+        static constexpr size_t kChunk = 32;
+        // source ids are handed out on first use and never given back
+        static constexpr size_t kSourceSlots = 16;
+
+        void onMessage(const Message& message) override {
+            MessageRecord record{xTaskGetTickCount(), 0, message.topic, PayloadKind::Int, sourceId(message.source)};
+            if (!packValue(message.message, record.kind, record.value)) {
+                record.kind = PayloadKind::OutOfLine;
+                record.value = 0;
+            }
+            if (!m_buffer.tryPush(record)) {
+                m_droppedCount.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // Writes the records waiting in the buffer to the sink. Only one task may call this, and not from a subscriber callback,
+        // as the sink may be slow. Returns the number of records written.
+        size_t flush(RecordSink& sink) {
+            std::array<MessageRecord, kChunk> chunk;
+            size_t written = 0;
+            while (true) {
+                size_t count = 0;
+                while (count < kChunk && m_buffer.tryPop(chunk[count])) {
+                    count++;
+                }
+                if (count == 0) return written;
+                if (!sink.write(std::span<const MessageRecord>(chunk.data(), count))) {
+                    m_droppedCount.fetch_add(static_cast<uint32_t>(count), std::memory_order_relaxed);
+                    return written;
+                }
+                written += count;
+            }
+        }
+
+        size_t waiting() const { return m_buffer.size(); }
+        // records lost because the buffer was full or the sink failed
+        uint32_t getDroppedCount() const { return m_droppedCount.load(std::memory_order_relaxed); }
+        // the source with the given id, to make sense of a log. nullptr if the id isn't in use.
+        SubscriberHandle getSource(const uint16_t id) const {
+            return id == 0 || id > kSourceSlots ? nullptr : m_sources[id - 1].load(std::memory_order_acquire);
+        }
+
+    private:
+        // Entries are claimed in order and never given back, so the first empty entry ends the search.
+        uint16_t sourceId(const SubscriberHandle source) {
+            if (source == nullptr) return 0;
+            for (size_t index = 0; index < kSourceSlots; index++) {
+                auto current = m_sources[index].load(std::memory_order_acquire);
+                if (current == nullptr && m_sources[index].compare_exchange_strong(current, source, std::memory_order_acq_rel)) {
+                    return static_cast<uint16_t>(index + 1);
+                }
+                if (current == source) return static_cast<uint16_t>(index + 1);
+            }
+            return kUntrackedSource;
+        }
+
+        MpscRingBuffer<MessageRecord, Capacity> m_buffer;
+        std::array<std::atomic<SubscriberHandle>, kSourceSlots> m_sources{};
+        std::atomic<uint32_t> m_droppedCount = 0;
+    };
+}
@@ -0,0 +1,65 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+// Replays a log written by a MessageRecorder into a bus, e.g. on the host with the FlowDetector subscribed,
+// to reproduce what happened on the device. Either with the original timing, or as fast as the bus takes the messages.
+// Messages go out without a source, as the subscribers of the recording don't exist here.
+
+#pragma once
+
+#include "MessageRecorder.hpp"
+#include "PubSub.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <span>
+
+namespace pub_sub {
+
+    enum class ReplayTiming : uint8_t {
+        AsFastAsPossible = 0,
+        Original
+    };
+
+    struct ReplayStats {
+        size_t replayed = 0;
+        // strings and blocks, as the log doesn't have their content
+        size_t skipped = 0;
+        // from the first replayed record until the bus dispatched the last one
+        int64_t elapsedMicros = 0;
+        double messagesPerSecond = 0;
+    };
+
+    class MessageReplayer {
+    public:
+        MessageReplayer(std::shared_ptr<PubSub> pubsub, ReplayTiming timing);
+
+        // Can be called several times, e.g. per chunk of a large log; the timing carries on where the last chunk stopped.
+        void replay(std::span<const MessageRecord> records);
+        // Reads the rest of an open file. Returns false if the file ends in the middle of a record.
+        bool replay(FILE* file);
+        // Waits until the bus dispatched everything (unless called from one of its callbacks), then logs and returns the totals.
+        ReplayStats finish();
+
+    private:
+        static constexpr size_t kChunk = 64;
+
+        void waitForTick(uint32_t tick);
+
+        std::shared_ptr<PubSub> m_pubsub;
+        ReplayTiming m_timing;
+        bool m_started = false;
+        int64_t m_startMicros = 0;
+        uint32_t m_firstRecordTick = 0;
+        TickType_t m_startTick = 0;
+        ReplayStats m_stats;
+    };
+}
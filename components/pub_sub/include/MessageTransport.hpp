@@ -0,0 +1,257 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+// The transport carries messages from the publishers to the event loop of the PubSub.
+// QueueTransport is the original mechanism: a FreeRTOS queue. Only sending replacing the oldest and packing need a mutex.
+// RingBufferTransport is a lock-free multi-producer/single-consumer ring buffer, so publishers don't compete for a lock
+// with each other or with the event loop.
+// PackedQueueTransport is a QueueTransport that keeps its messages packed (see PackedMessage.hpp).
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "Message.hpp"
+#include "MpscRingBuffer.hpp"
+#include "PackedMessage.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <span>
+
+namespace pub_sub {
+
+    enum class Transport : uint8_t {
+        Queue = 0,
+        RingBuffer,
+        PackedQueue
+    };
+
+    class MessageTransport {
+    public:
+        MessageTransport() = default;
+        virtual ~MessageTransport() = default;
+        MessageTransport(const MessageTransport&) = delete;
+        MessageTransport& operator=(const MessageTransport&) = delete;
+        MessageTransport(MessageTransport&&) = delete;
+        MessageTransport& operator=(MessageTransport&&) = delete;
+
+        // Waits up to timeout ticks while the transport is full. Returns false if the message was not sent.
+        virtual bool send(const Message& message, TickType_t timeout) = 0;
+
+        // Sends without waiting. If the transport is full, it takes out the oldest message to make room and returns it in dropped.
+        // Returns false if the message was not sent, i.e. if the transport can't take out messages on the sending side.
+        virtual bool sendReplacingOldest(const Message& message, Message& dropped, bool& didDrop) = 0;
+
+        // Sends the messages in order, taking the lock (if any) once per chunk rather than once per message.
+        // Blocks while the transport is full. Returns how many were sent: all of them, unless the lock could not be taken.
+        virtual size_t sendBatch(std::span<const Message> messages) = 0;
+
+        // Does not block. Returns false if nothing is waiting.
+        virtual bool receive(Message& message) = 0;
+
+        virtual size_t waiting() const = 0;
+
+        // false if the underlying resources could not be created
+        virtual bool isValid() const { return true; }
+    };
+
+    // Lets senders wait for the receiver to free a slot, where the transport can't do that by itself.
+    // A counting semaphore, so several waiting senders each get a wake-up. The receiver only gives it while someone waits.
+    class RoomSignal {
+    public:
+        // the semaphore lives in the object, so this doesn't touch the heap either
+        explicit RoomSignal(size_t maxCount);
+        ~RoomSignal();
+        RoomSignal(const RoomSignal&) = delete;
+        RoomSignal& operator=(const RoomSignal&) = delete;
+        RoomSignal(RoomSignal&&) = delete;
+        RoomSignal& operator=(RoomSignal&&) = delete;
+
+        // Calls trySend until it succeeds, waiting for a freed slot between tries. Returns false if the timeout expired first.
+        template <typename TrySend>
+        bool sendWhenRoom(TrySend trySend, TickType_t timeout);
+
+        // the receiver freed a slot
+        void notify();
+
+        bool isValid() const { return m_semaphore != nullptr; }
+
+    private:
+        StaticSemaphore_t m_buffer{};
+        SemaphoreHandle_t m_semaphore;
+        std::atomic<uint32_t> m_waiters = 0;
+    };
+
+    template <typename TrySend>
+    bool RoomSignal::sendWhenRoom(TrySend trySend, const TickType_t timeout) {
+        const auto start = xTaskGetTickCount();
+        while (true) {
+            // count as waiting before trying, so a slot freed right after the try still gives the semaphore
+            m_waiters.fetch_add(1);
+            if (trySend()) {
+                m_waiters.fetch_sub(1);
+                return true;
+            }
+            const TickType_t elapsed = xTaskGetTickCount() - start;
+            if (timeout != portMAX_DELAY && elapsed >= timeout) {
+                m_waiters.fetch_sub(1);
+                return false;
+            }
+            xSemaphoreTake(m_semaphore, timeout == portMAX_DELAY ? portMAX_DELAY : timeout - elapsed);
+            m_waiters.fetch_sub(1);
+        }
+    }
+
+    class QueueTransport : public MessageTransport {
+    public:
+        explicit QueueTransport(size_t depth);
+        // creates the queue and the mutex in the given buffers rather than on the heap. The items buffer must hold depth messages.
+        QueueTransport(size_t depth, uint8_t* items, StaticQueue_t& queueBuffer, StaticSemaphore_t& mutexBuffer);
+        ~QueueTransport() override;
+        QueueTransport(const QueueTransport&) = delete;
+        QueueTransport& operator=(const QueueTransport&) = delete;
+        QueueTransport(QueueTransport&&) = delete;
+        QueueTransport& operator=(QueueTransport&&) = delete;
+
+        bool send(const Message& message, TickType_t timeout) override;
+        bool sendReplacingOldest(const Message& message, Message& dropped, bool& didDrop) override;
+        size_t sendBatch(std::span<const Message> messages) override;
+        bool receive(Message& message) override;
+        size_t waiting() const override;
+        bool isValid() const override { return m_mutex != nullptr && m_queue != nullptr && m_room.isValid(); }
+
+    protected:
+        // with a packer, the queue holds packed messages rather than messages
+        QueueTransport(size_t depth, MessagePacker* packer);
+        QueueTransport(size_t depth, MessagePacker* packer, uint8_t* items, StaticQueue_t& queueBuffer, StaticSemaphore_t& mutexBuffer);
+
+    private:
+        static constexpr int kMutexTimeout = pdMS_TO_TICKS(1000);
+
+        // Only a packed queue needs the mutex to send and receive: the packer is shared, and its messages must go into the
+        // queue in the order it packed them. Without a packer, these do nothing.
+        bool lockPacker() const;
+        void unlockPacker() const;
+
+        // Both need lockPacker. Neither blocks: put returns false if there is no room, take if the queue is empty.
+        bool put(const Message& message);
+        bool take(Message& message);
+
+        SemaphoreHandle_t m_mutex;
+        QueueHandle_t m_queue;
+        MessagePacker* m_packer;
+        // A packed queue can't wait in xQueueSend, as it must hold the mutex from packing until the message is in the queue.
+        // It waits for this instead, which receive gives. Running out of out of line slots also waits for it.
+        RoomSignal m_room;
+    };
+
+    // The buffers of a StaticQueueTransport. A base class, so they exist before QueueTransport creates the queue in them.
+    template <size_t MaxDepth, typename Item = Message>
+    struct StaticQueueBuffers {
+        std::array<uint8_t, MaxDepth * sizeof(Item)> items{};
+        StaticQueue_t queue{};
+        StaticSemaphore_t mutex{};
+    };
+
+    // A queue transport that doesn't touch the heap. Its depth is capped at MaxDepth.
+    template <size_t MaxDepth>
+    class StaticQueueTransport final : private StaticQueueBuffers<MaxDepth>, public QueueTransport {
+    public:
+        explicit StaticQueueTransport(const size_t depth = MaxDepth) :
+            QueueTransport(std::min(depth, MaxDepth), this->items.data(), this->queue, this->mutex) {}
+    };
+
+    class PackedQueueTransport : public QueueTransport {
+    public:
+        explicit PackedQueueTransport(const size_t depth) : QueueTransport(depth, &m_packer) {}
+
+    protected:
+        PackedQueueTransport(const size_t depth, uint8_t* items, StaticQueue_t& queueBuffer, StaticSemaphore_t& mutexBuffer) :
+            QueueTransport(depth, &m_packer, items, queueBuffer, mutexBuffer) {}
+
+    private:
+        // only used by the base class, after construction
+        MessagePacker m_packer;
+    };
+
+    template <size_t MaxDepth>
+    class StaticPackedQueueTransport final : private StaticQueueBuffers<MaxDepth, WireMessage>, public PackedQueueTransport {
+    public:
+        explicit StaticPackedQueueTransport(const size_t depth = MaxDepth) :
+            PackedQueueTransport(std::min(depth, MaxDepth), this->items.data(), this->queue, this->mutex) {}
+    };
+
+    // the ring buffer needs a power of two, so it takes the first one at or above the depth
+    constexpr size_t ringCapacity(const size_t depth) { return std::bit_ceil(std::max<size_t>(depth, 2)); }
+
+    // Has storage for MaxCapacity messages, of which it uses the ring capacity of its depth.
+    // A template, so it doesn't touch the heap. Not valid if the depth needs more than MaxCapacity.
+    template <size_t MaxCapacity>
+    class RingBufferTransport final : public MessageTransport {
+    public:
+        explicit RingBufferTransport(const size_t depth = MaxCapacity) :
+            m_isValid(Buffer::isPossible(ringCapacity(depth))), m_buffer(ringCapacity(depth)), m_room(m_buffer.capacity()) {}
+
+        bool send(const Message& message, TickType_t timeout) override;
+        // Only the event loop may take messages out of the ring buffer, so this can't make room. It drops the new message instead.
+        bool sendReplacingOldest(const Message& message, Message& dropped, bool& didDrop) override;
+        size_t sendBatch(std::span<const Message> messages) override;
+        bool receive(Message& message) override;
+        size_t waiting() const override { return m_buffer.size(); }
+        bool isValid() const override { return m_isValid && m_room.isValid(); }
+
+        size_t capacity() const { return m_buffer.capacity(); }
+
+    private:
+        using Buffer = MpscRingBuffer<Message, MaxCapacity>;
+
+        bool m_isValid;
+        Buffer m_buffer;
+        RoomSignal m_room;
+    };
+
+    template <size_t MaxCapacity>
+    bool RingBufferTransport<MaxCapacity>::send(const Message& message, const TickType_t timeout) {
+        // same semantics as xQueueSend: wait until the consumer made room or the timeout expired
+        return m_room.sendWhenRoom([this, &message] { return m_buffer.tryPush(message); }, timeout);
+    }
+
+    template <size_t MaxCapacity>
+    bool RingBufferTransport<MaxCapacity>::sendReplacingOldest(const Message& message, Message&, bool& didDrop) {
+        didDrop = false;
+        return m_buffer.tryPush(message);
+    }
+
+    template <size_t MaxCapacity>
+    size_t RingBufferTransport<MaxCapacity>::sendBatch(const std::span<const Message> messages) {
+        // large batches go in chunks, so they don't have to wait for the buffer to drain completely
+        const size_t maxChunk = std::max<size_t>(m_buffer.capacity() / 4, 1);
+        auto rest = messages;
+        while (!rest.empty()) {
+            const auto chunk = rest.first(std::min(rest.size(), maxChunk));
+            // every freed slot wakes us to try again, so a chunk waits for about as many receives as it is long
+            m_room.sendWhenRoom([this, chunk] { return m_buffer.tryPushBatch(chunk.data(), chunk.size()); }, portMAX_DELAY);
+            rest = rest.subspan(chunk.size());
+        }
+        return messages.size();
+    }
+
+    template <size_t MaxCapacity>
+    bool RingBufferTransport<MaxCapacity>::receive(Message& message) {
+        if (!m_buffer.tryPop(message)) return false;
+        m_room.notify();
+        return true;
+    }
+}
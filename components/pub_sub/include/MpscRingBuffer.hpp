@@ -0,0 +1,142 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+// Fixed capacity lock-free ring buffer for multiple producers and a single consumer.
+// Every slot carries a sequence number that tells whether it is free for the producer owning that position,
+// or filled and ready for the consumer. Producers claim a position with a compare-and-swap on the enqueue index,
+// so they never block each other or the consumer. Capacity must be a power of two so we can mask instead of divide.
+// The template parameter sizes the storage; a smaller power of two can be chosen at construction.
+
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+namespace pub_sub {
+
+    template <typename T, size_t Capacity>
+    class MpscRingBuffer {
+        static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    public:
+        // A capacity that isPossible rejects falls back to the full storage.
+        explicit MpscRingBuffer(const size_t capacity = Capacity) :
+            m_capacity(isPossible(capacity) ? capacity : Capacity), m_mask(m_capacity - 1) {
+            for (size_t i = 0; i < m_capacity; i++) {
+                m_slots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        MpscRingBuffer(const MpscRingBuffer&) = delete;
+        MpscRingBuffer& operator=(const MpscRingBuffer&) = delete;
+        MpscRingBuffer(MpscRingBuffer&&) = delete;
+        MpscRingBuffer& operator=(MpscRingBuffer&&) = delete;
+
+        // a power of two that fits in the storage
+        static constexpr bool isPossible(const size_t capacity) {
+            return capacity >= 2 && capacity <= Capacity && std::has_single_bit(capacity);
+        }
+
+        size_t capacity() const { return m_capacity; }
+
+        // returns false if the buffer is full. Safe to call from several tasks at the same time.
+        bool tryPush(const T& item) {
+            auto position = m_enqueuePosition.load(std::memory_order_relaxed);
+            while (true) {
+                auto& slot = m_slots[position & m_mask];
+                const auto sequence = slot.sequence.load(std::memory_order_acquire);
+                const auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+                if (difference == 0) {
+                    // slot is free for this position; try to claim it
+                    if (m_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        slot.item = item;
+                        slot.sequence.store(position + 1, std::memory_order_release);
+                        return true;
+                    }
+                    // another producer got there first, position was reloaded by the CAS
+                } else if (difference < 0) {
+                    // the consumer has not released this slot yet, so we're full
+                    return false;
+                } else {
+                    position = m_enqueuePosition.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Claims count consecutive slots in one go and fills them in order. Returns false if there isn't room for all of them,
+        // in which case nothing was pushed. Count may not exceed the capacity.
+        bool tryPushBatch(const T* items, const size_t count) {
+            if (count == 0) return true;
+            if (count > m_capacity) return false;
+            auto position = m_enqueuePosition.load(std::memory_order_relaxed);
+            while (true) {
+                const auto firstSequence = m_slots[position & m_mask].sequence.load(std::memory_order_acquire);
+                const auto difference = static_cast<intptr_t>(firstSequence) - static_cast<intptr_t>(position);
+                if (difference > 0) {
+                    // another producer claimed this position already
+                    position = m_enqueuePosition.load(std::memory_order_relaxed);
+                    continue;
+                }
+                if (difference < 0) return false;
+                // the consumer frees slots in order, so if the last one is free, the ones before it are too
+                const auto last = position + count - 1;
+                if (m_slots[last & m_mask].sequence.load(std::memory_order_acquire) != last) return false;
+                if (m_enqueuePosition.compare_exchange_weak(position, position + count, std::memory_order_relaxed)) {
+                    for (size_t i = 0; i < count; i++) {
+                        auto& slot = m_slots[(position + i) & m_mask];
+                        slot.item = items[i];
+                        slot.sequence.store(position + i + 1, std::memory_order_release);
+                    }
+                    return true;
+                }
+            }
+        }
+
+        // returns false if there is no committed item at the head. Only one task may call this.
+        bool tryPop(T& item) {
+            const auto position = m_dequeuePosition.load(std::memory_order_relaxed);
+            auto& slot = m_slots[position & m_mask];
+            const auto sequence = slot.sequence.load(std::memory_order_acquire);
+            if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1) < 0) {
+                return false;
+            }
+            item = slot.item;
+            // release the slot for the producer that will use it in the next round
+            slot.sequence.store(position + m_capacity, std::memory_order_release);
+            m_dequeuePosition.store(position + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        // number of claimed slots, including the ones a producer is still filling. Approximate while producers are active.
+        size_t size() const {
+            // read the consumer side first, so a concurrent pop can't make the result negative
+            const auto dequeuePosition = m_dequeuePosition.load(std::memory_order_acquire);
+            const auto enqueuePosition = m_enqueuePosition.load(std::memory_order_acquire);
+            return enqueuePosition - dequeuePosition;
+        }
+
+        bool empty() const { return size() == 0; }
+
+    private:
+        struct Slot {
+            std::atomic<size_t> sequence;
+            T item;
+        };
+
+        const size_t m_capacity;
+        const size_t m_mask;
+        Slot m_slots[Capacity];
+        std::atomic<size_t> m_enqueuePosition = 0;
+        std::atomic<size_t> m_dequeuePosition = 0;
+    };
+}
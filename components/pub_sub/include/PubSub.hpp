@@ -15,127 +15,127 @@
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
+#include "sdkconfig.h"
+#include "BusMetrics.hpp"
+#include "Executor.hpp"
+#include "Message.hpp"
+#include "MessageTransport.hpp"
+#include "StringArena.hpp"
+#include "TimerWheel.hpp"
+#include "TypedTopic.hpp"
+#include <algorithm>
+#include <array>
 #include <condition_variable>
 #include <vector>
 #include <variant>
 #include <memory>
+#include <optional>
+#include <span>
 #include <format>
 #include <atomic>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 
 namespace pub_sub {
 
-    struct IntCoordinate {
-        int16_t x;
-        int16_t y;
-
-        IntCoordinate() : x(0), y(0) {}
-        IntCoordinate(const int16_t xIn, const int16_t yIn) : x(xIn), y(yIn) {}
-
-        // we need this to pass coordinates in a memory efficient way but still keep reasonable accuracy
-        static IntCoordinate times10(const double xIn, const double yIn) {
-            return {static_cast<int16_t>(xIn * 10), static_cast<int16_t>(yIn * 10)};
-        }
-
-        friend std::ostream& operator<<(std::ostream& os, const IntCoordinate& coordinate) {
-            os << "(" << coordinate.x << ", " << coordinate.y << ")";
-            return os;
-        }
+    // A subscriber with an inbox gets its messages through a bounded queue, drained by a task of its own.
+    // That way a slow subscriber only delays itself; the event loop just hands the message over.
+    // If the inbox is full, the message is dropped for that subscriber and counted as dropped for its topic, so the event loop never waits.
+    // With static allocation, the depth is capped at CONFIG_PUB_SUB_MAX_INBOX_DEPTH and the stack size is CONFIG_PUB_SUB_INBOX_STACK_SIZE.
+    struct InboxOptions {
+        size_t depth = 32;
+        BaseType_t core = tskNO_AFFINITY;
+        UBaseType_t priority = 3;
+        uint32_t stackSize = 4096;
     };
-    
-    using Payload = std::variant<int, float, const char*, IntCoordinate>;
-
-    enum class Topic : uint8_t {
-        None = 0,
-        Anomaly,
-        Drifted,
-        NoFit,
-        Pulse,
-        Sample,
-        SensorWasReset,
-        AllTopics = UINT8_MAX
-    };
-    
-        constexpr const char* toCString(Topic topic) {
-        switch (topic) {
-            case Topic::None: return "None";
-            case Topic::Anomaly: return "Anomaly";
-            case Topic::Drifted: return "Drifted";
-            case Topic::NoFit: return "NoFit";
-            case Topic::Pulse: return "Pulse";
-            case Topic::Sample: return "Sample";
-            case Topic::SensorWasReset: return "SensorWasReset";
-            case Topic::AllTopics: return "AllTopics";
-            default: return "Unknown";
-        }
-    }
 
-    class Subscriber {
-        public:
-        Subscriber() = default;
-        virtual ~Subscriber() = default;
-        Subscriber(const Subscriber&) = delete;
-        Subscriber& operator=(const Subscriber&) = delete;
-        Subscriber(Subscriber&&) = delete;
-        Subscriber& operator=(Subscriber&&) = delete;
-        
-        [[nodiscard]] Topic getTopic() const { return m_topic; }
-            [[nodiscard]] Payload getPayload() const { return m_payload; }
-            virtual void reset() { 
-                m_topic = Topic::None; 
-                m_payload = 0;
-            }
-            virtual void subscriberCallback(Topic topic, const Payload& payload);
-        private:
-            Topic m_topic = Topic::None;
-            Payload m_payload = 0;
+    // Thins out what a subscription gets. The dispatcher filters before the inbox or the callback, so a message that is left out
+    // costs next to nothing. The filters apply in this order; a field with its default value doesn't filter.
+    struct RateLimit {
+        // only every Nth message, starting with the first
+        uint32_t everyNth = 1;
+        // a token bucket for bursty topics: up to burst messages at once, refilled at ratePerSecond. No token, no delivery.
+        uint32_t burst = 0;
+        uint32_t ratePerSecond = 0;
+        // At most one message per interval. A message that comes too early is held back, replacing the one held back before,
+        // and delivered when the interval is over, so the subscriber still gets the latest value. With LoopMode::Shared,
+        // a held back message waits for the next message on the bus.
+        uint32_t minIntervalMicros = 0;
     };
 
-    using SubscriberHandle = Subscriber*;
-
-    struct SubscriberMap {
-        Topic topic;
-        std::vector<SubscriberHandle> subscribers;
+    // What the watchdog does with a subscriber that keeps overrunning its callback budget
+    enum class Degrade : uint8_t {
+        Inbox = 0,  // move it off the event loop, to an inbox task of its own
+        Decimate,   // only give it every Nth message of its topics
     };
 
-    struct Message {
-        SubscriberHandle source;
-        Payload message;
-        Topic topic;
+    // A time budget for the callback of a subscriber, measured with the clock of the bus. A call that takes longer is an overrun
+    // and adds a strike, a call within budget takes one off. At strikeLimit strikes the subscriber is degraded (once), so the
+    // subscribers without a budget, like the FlowDetector on samples, no longer wait for it.
+    struct CallbackBudget {
+        uint32_t budgetMicros = 1000;
+        // 0 only records the overruns
+        uint32_t strikeLimit = 3;
+        Degrade degrade = Degrade::Inbox;
+        // With Inbox: the options of the inbox it moves to, by default with a low priority task.
+        // A subscriber that has a running inbox already is only marked as degraded.
+        InboxOptions inbox{.depth = 16, .priority = 1};
+        // With Decimate: the subscriptions of the subscriber only get every Nth message. One with a rate limit keeps it.
+        uint32_t everyNth = 4;
     };
 
-    template <size_t BufferSize>
-    class MessageVisitor {
-        public:
-            explicit MessageVisitor(char(&buffer)[BufferSize]) :m_buffer(buffer) {}
-    
-            void operator()(const int value) const {
-                snprintf(m_buffer, m_bufferSize, "%d", value);
-            }
+    struct CallbackStats {
+        uint32_t calls = 0;
+        uint32_t overruns = 0;
+        uint32_t maxMicros = 0;
+        bool degraded = false;
+    };
 
-            void operator()(const float value) const {
-                snprintf(m_buffer, m_bufferSize, "%f", value);
-            }
+    // What publish does when the lane of the topic is full
+    enum class Backpressure : uint8_t {
+        Block = 0,  // wait for room, up to the timeout of the policy
+        DropNewest, // drop the message being published
+        DropOldest, // make room by dropping the oldest message in the lane
+        Conflate    // only keep the latest value of the topic; never waits
+    };
 
-            void operator()(const char* value) const {
-                strncpy(m_buffer, value, m_bufferSize - 1);
-                m_buffer[m_bufferSize] = '\0';
-            }
+    // Queued messages go through a lane to the event loop. Inline messages are dispatched on the task of the publisher
+    // before publish returns, so they skip the copy into the lane and the task switch. Meant for topics whose subscribers
+    // are cheap and don't block.
+    enum class Dispatch : uint8_t {
+        Queued = 0,
+        Inline
+    };
 
-            void operator()(const IntCoordinate& value) const {
-                snprintf(m_buffer, m_bufferSize - 1, "%d, %d", value.x, value.y);
-            }
+    // With Task, the bus dispatches on an event loop task of its own. With Manual there is no such task: the caller dispatches
+    // with pump or pumpUntilIdle, which makes a run deterministic and cheap, e.g. to replay a recording on the host.
+    // Publish and pump from the same task then. A publisher that finds its lane full dispatches to make room rather than wait.
+    // With Shared, the tasks of an Executor dispatch for many buses, which saves a task and its stack per bus.
+    // With static allocation, the stack of the Task mode loop is reserved apart from the bus (CONFIG_PUB_SUB_STATIC_EVENT_LOOP_STACK).
+    enum class LoopMode : uint8_t {
+        Task = 0,
+        Manual,
+        Shared
+    };
 
-        private:
-            char *m_buffer;
-            size_t m_bufferSize = BufferSize;
+    struct BackpressurePolicy {
+        Backpressure mode = Backpressure::Block;
+        // only used for Block
+        TickType_t timeout = portMAX_DELAY;
     };
-    
+
+    // With CONFIG_PUB_SUB_STATIC_ALLOCATION, the bus takes everything it needs from static buffers sized by the Kconfig settings,
+    // so it never touches the heap (create included). Only one bus can exist at a time then.
     class PubSub final : public std::enable_shared_from_this<PubSub> {
     public:
-        PubSub();
-        static std::shared_ptr<PubSub> create();
+        static constexpr size_t kMaxSubscribersPerTopic = CONFIG_PUB_SUB_MAX_SUBSCRIBERS_PER_TOPIC;
+
+        explicit PubSub(Transport transport = Transport::Queue, LoopMode loopMode = LoopMode::Task);
+        static std::shared_ptr<PubSub> create(Transport transport = Transport::Queue, LoopMode loopMode = LoopMode::Task);
+        // A bus dispatched by the tasks of the executor, which must outlive it
+        PubSub(Transport transport, Executor& executor);
+        static std::shared_ptr<PubSub> create(Transport transport, Executor& executor);
         ~PubSub();
         PubSub(const PubSub&) = delete;
         PubSub& operator=(const PubSub&) = delete;
@@ -143,24 +143,361 @@ namespace pub_sub {
         PubSub& operator=(PubSub&&) = delete;
         void begin();
         void end();
+
+        // Waits until all messages published before the call have been dispatched (not the ones published while waiting).
+        // Returns false if the timeout expired first. Must not be called from a subscriber callback.
+        bool flush(TickType_t timeout = portMAX_DELAY);
         bool isIdle() const;
-        void publish(Topic topic, const Payload& message, SubscriberHandle source = nullptr);
-        void receive();
+        // Returns false if the message was dropped because of the backpressure policy of the topic.
+        // A queued message published from a subscriber callback skips the lane and its policy: the event loop dispatches it
+        // right after the current message, so it never waits for room in its own lanes (see CONFIG_PUB_SUB_DEFERRED_DEPTH).
+        bool publish(Topic topic, const Payload& message, SubscriberHandle source = nullptr);
+        // For interrupt handlers, e.g. a data ready or timer interrupt. Never blocks: returns false if the interrupt queue is full
+        // (see CONFIG_PUB_SUB_ISR_QUEUE_DEPTH). The event loop serves that queue before the lanes; inline topics are queued as well.
+        // Like xQueueSendFromISR, it sets higherPriorityTaskWoken if the caller should yield at the end of the handler;
+        // without it, publishFromIsr yields itself.
+        bool publishFromIsr(Topic topic, const Payload& message, BaseType_t* higherPriorityTaskWoken = nullptr);
+
+        template <typename Def>
+        bool publish(const typename Def::Type& payload, const SubscriberHandle source = nullptr) {
+            return publish(Def::kTopic, Payload(std::in_place_type<typename Def::Type>, payload), source);
+        }
+
+        // Copies the text into the string arena of the bus, so the caller may reuse its buffer right away.
+        // Subscribers get a pointer into the arena that is valid until their callback returns. Identical strings share a slot.
+        // Returns false if the arena is full or the message was dropped; text longer than CONFIG_PUB_SUB_STRING_LENGTH - 1 is cut off.
+        bool publishString(Topic topic, const char* text, SubscriberHandle source = nullptr);
+        // number of arena slots holding a string that is still on its way
+        size_t stringsInUse() const { return m_strings.inUse(); }
+
+        // Borrows a block from the pool of the bus to fill in place. Invalid if all blocks are in use.
+        Loan loan() { return m_blocks.loan(); }
+        // Publishes the block without copying it. Subscribers get a BlockRef; the block goes back to the pool after the last one is done.
+        // Returns false if the loan is invalid or the message was dropped.
+        bool publishBlock(Topic topic, Loan&& loan, SubscriberHandle source = nullptr);
+        size_t blocksInUse() const { return m_blocks.inUse(); }
+
+        // Publishes several messages in order at the cost of (about) one publish: one lock, one wakeup of the event loop.
+        // That holds for topics that wait for room without a timeout (the default policy); the other messages go one by one,
+        // with the backpressure policy of their topic. Returns how many were published, counting messages nobody listens to
+        // as publish does. The others were dropped (and counted as such) or had an invalid topic.
+        size_t publishBatch(std::span<const Message> messages);
+        bool receive();
         void subscribe(SubscriberHandle subscriber, Topic topic);
+        // Subscribes via an inbox. A subscriber has at most one inbox, shared by all its topics; the options of the first call count.
+        // The inbox stops when the subscriber is no longer subscribed to any topic.
+        void subscribe(SubscriberHandle subscriber, Topic topic, const InboxOptions& options);
+        // Subscribes with a rate limit per topic (also for a subscription that exists already; its inbox stays).
+        // A subscription with an inbox gets the messages that pass the limit via that inbox.
+        void subscribe(SubscriberHandle subscriber, Topic topic, const RateLimit& limit);
+
+        template <typename Def, typename SubscriberType>
+        void subscribe(SubscriberType* subscriber) {
+            static_assert(std::is_base_of_v<TopicHandler<Def>, SubscriberType>, "The subscriber has no handler for this topic");
+            subscribe(subscriber, Def::kTopic);
+        }
+
+        template <typename Def, typename SubscriberType>
+        void subscribe(SubscriberType* subscriber, const InboxOptions& options) {
+            static_assert(std::is_base_of_v<TopicHandler<Def>, SubscriberType>, "The subscriber has no handler for this topic");
+            subscribe(subscriber, Def::kTopic, options);
+        }
         void unsubscribe(SubscriberHandle subscriber, Topic topic = Topic::AllTopics);
         void unsubscribeAll();
-        void waitForIdle() const;
+
+        // Watches how long the callback of the subscriber takes (see CallbackBudget), on whatever task calls it.
+        // Replaces the budget it has; a degraded subscriber stays degraded. Returns false if all budgets are in use.
+        // The budget goes away with the last subscription of the subscriber.
+        bool setCallbackBudget(SubscriberHandle subscriber, const CallbackBudget& budget);
+        void clearCallbackBudget(SubscriberHandle subscriber);
+        CallbackStats getCallbackStats(SubscriberHandle subscriber) const;
+        // Waits until there is nothing left to dispatch, including messages published by subscribers while waiting.
+        // Returns false right away in a subscriber callback, which would wait for itself.
+        bool waitForIdle();
+
+        // Manual loop mode only: runs the timers that are due, then dispatches up to maxMessages of the waiting messages
+        // and returns how many it dispatched. Does nothing in a subscriber callback during a pump, or in Task mode.
+        size_t pump(size_t maxMessages = SIZE_MAX);
+        // Manual loop mode only: dispatches until nothing is left, including what subscribers publish meanwhile, and waits for the inboxes.
+        size_t pumpUntilIdle();
+        LoopMode getLoopMode() const { return m_loopMode; }
+
+        // Runs the job every period, the first time phase after now, on the task that dispatches (the event loop, or the one
+        // that pumps). What the job publishes is dispatched right after it. The timing is as good as the FreeRTOS tick.
+        // Returns kNoTimer if all timers are in use, or with Shared, as the executor doesn't keep time.
+        TimerId addTimer(TimerJob& job, uint32_t periodMicros, uint32_t phaseMicros = 0);
+        // Once it returns, the job doesn't run anymore (unless called from the job itself, which finishes its run).
+        void removeTimer(TimerId id);
+        TimerStats getTimerStats(TimerId id) const;
+        // The clock the timers run on, by default the system clock. Set it before adding timers; it must outlive the bus.
+        // Returns false for a clock that doesn't run by itself, like VirtualClock, unless the bus is in Manual mode.
+        bool setClock(const Clock& clock);
 
         void dumpSubscribers(const char* tag = "dump") const;
+        // logs every message the event loop dispatches. Off by default, as formatting the payload costs time.
+        void setTraceMessages(const bool trace) { m_traceMessages.store(trace); }
+        // Passes every dispatched message to the tap, before the subscribers get it. nullptr removes the tap.
+        // Removing it doesn't wait for a call in progress, so keep the tap alive until the bus is idle.
+        void setTap(MessageTap* tap) { m_tap.store(tap); }
         long getReferenceCount() const;
 
+        // true if at least one subscriber listens to the topic. Publishing to a topic nobody listens to is a no-op.
+        bool hasSubscribers(const Topic topic) const { return (m_subscriberMask.load() & toMask(topic)) != 0; }
+
+        // Moves a topic (or all topics) to another lane. Messages of the topic that are already in flight stay in their old lane,
+        // so do this before publishing to keep them in order.
+        void setPriority(Topic topic, Priority priority);
+        Priority getPriority(Topic topic) const;
+
+        // Sets what publish does if the lane of the topic (or of all topics) is full. The default is to block until there is room.
+        void setBackpressure(Topic topic, BackpressurePolicy policy);
+        BackpressurePolicy getBackpressure(Topic topic) const;
+        // Number of messages of the topic that were dropped or replaced by a newer value (with Conflate)
+        uint32_t getDroppedCount(Topic topic) const;
+
+        // Makes a topic (or all topics) queued or inline. An inline message overtakes the queued messages still in the lanes;
+        // messages of the topic that were queued before the switch stay queued, so do this before publishing to keep them in order.
+        // Inline messages don't wait for room, so the backpressure policy doesn't apply to them.
+        void setDispatch(Topic topic, Dispatch dispatch);
+        Dispatch getDispatch(Topic topic) const;
+
+        // Makes the bus keep the last value published on a topic (or all topics), also when nobody listens.
+        // A new subscriber gets the retained value right away, from subscribe (or via its inbox if it has one);
+        // a value published while subscribing may come in before it. Switching retaining off forgets the value.
+        void setRetained(Topic topic, bool retained);
+        bool isRetained(Topic topic) const;
+        // The last value published on a retained topic, or nothing if there is none yet. Lock-free and without queue traffic,
+        // so any task can poll it. A string or block in the value is only guaranteed to be valid until the next publish on the topic.
+        std::optional<Payload> latest(Topic topic) const;
+        // Also nothing if the value has another type than the definition says, e.g. from an untyped publish.
+        template <typename Def>
+        std::optional<typename Def::Type> latest() const {
+            const auto value = latest(Def::kTopic);
+            if (!value.has_value()) return std::nullopt;
+            const auto* typed = std::get_if<typename Def::Type>(&*value);
+            if (typed == nullptr) return std::nullopt;
+            return *typed;
+        }
+
+        // Copy of the counters and histograms. Cheap enough to call periodically, e.g. to log them.
+        MetricsSnapshot getMetrics() const;
+
+        // Once the higher lanes were served this many times in a row while a lower lane had messages waiting,
+        // the lower lane gets its turn.
+        static constexpr uint32_t kStarvationBound = 8;
+
     private:
-        bool addSubscriberToExistingTopic(SubscriberMap& subscriberMap, Topic topic, SubscriberHandle subscriber);
-        static void callSubscriber(const SubscriberMap &subscriberMap, const Message &msg);
-        static bool doesCallbackExist(const SubscriberMap& subscriberMap, SubscriberHandle subscriber);
+        friend class Executor;
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        using InboxTransport = StaticQueueTransport<CONFIG_PUB_SUB_MAX_INBOX_DEPTH>;
+#else
+        using InboxTransport = QueueTransport;
+#endif
+
+        class Inbox {
+        public:
+            Inbox(PubSub& owner, SubscriberHandle subscriber, const InboxOptions& options);
+            ~Inbox();
+            Inbox(const Inbox&) = delete;
+            Inbox& operator=(const Inbox&) = delete;
+            Inbox(Inbox&&) = delete;
+            Inbox& operator=(Inbox&&) = delete;
+
+            // returns false if the task could not be created
+            bool start();
+            // Drops whatever is still waiting. May be called from the inbox task itself, but not with the PubSub mutex taken.
+            void stop();
+            // Never waits: drops the message if the inbox is full or stopping
+            void post(const Message& msg);
+            bool isIdle() const { return m_processedCount.load() == m_postedCount.load(); }
+            bool isRunning() const { return !m_finished.load(); }
+            SubscriberHandle subscriber() const { return m_subscriber; }
+
+            std::atomic<uint32_t> m_postedCount = 0;
+            std::atomic<uint32_t> m_processedCount = 0;
+            // guarded by m_lock
+            TaskHandle_t m_taskHandle = nullptr;
+
+        private:
+            static void inboxTask(void* param);
+            void run();
+
+            PubSub& m_owner;
+            SubscriberHandle m_subscriber;
+            InboxOptions m_options;
+            InboxTransport m_transport;
+            // Posting checks the terminate flag and wakes the task under it, so the task can shut the door before its last drain
+            SemaphoreHandle_t m_lock;
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+            StaticSemaphore_t m_lockBuffer{};
+            std::array<StackType_t, CONFIG_PUB_SUB_INBOX_STACK_SIZE> m_stack{};
+            StaticTask_t m_taskBuffer{};
+#endif
+            std::atomic<bool> m_terminateFlag = false;
+            std::atomic<bool> m_finished = true;
+        };
+
+        static constexpr uint8_t kNoRateLimiter = UINT8_MAX;
+        static constexpr size_t kMaxRateLimiters = CONFIG_PUB_SUB_MAX_RATE_LIMITS;
+        static_assert(kMaxRateLimiters < kNoRateLimiter, "Rate limiters are indexed with a byte");
+
+        // an inbox of nullptr means the event loop calls the subscriber directly
+        struct Subscription {
+            SubscriberHandle subscriber;
+            Inbox* inbox;
+            uint8_t rateLimiter = kNoRateLimiter;
+        };
+
+        // State of a rate limited subscription. The snapshots only hold its index, as they are copies and this changes
+        // with every message. Queued and inline dispatches may use it at the same time, so it has a spin lock of its own.
+        // It is only handed out and freed under the mutex, and only freed once the dispatchers are done with the old snapshot.
+        struct RateLimiter {
+            std::atomic_flag busy;
+            SubscriberHandle owner = nullptr;
+            RateLimit limit{};
+            uint32_t seen = 0;
+            // in millionths of a token
+            int64_t tokens = 0;
+            int64_t refilledAt = 0;
+            int64_t deliveredAt = 0;
+            bool delivered = false;
+            Message heldBack{};
+            bool hasHeldBack = false;
+        };
+
+        static constexpr size_t kMaxWatchdogs = CONFIG_PUB_SUB_MAX_CALLBACK_BUDGETS;
+
+        // Callback budget of a subscriber. Handed out and changed under the mutex; the counters are updated by the task that
+        // calls the subscriber, without it. The budget itself is only read under the mutex, the dispatcher uses the copied limits.
+        struct Watchdog {
+            std::atomic<SubscriberHandle> owner = nullptr;
+            CallbackBudget budget{};
+            std::atomic<uint32_t> budgetMicros = 0;
+            std::atomic<uint32_t> strikeLimit = 0;
+            std::atomic<uint32_t> strikes = 0;
+            std::atomic<uint32_t> calls = 0;
+            std::atomic<uint32_t> overruns = 0;
+            std::atomic<uint32_t> maxMicros = 0;
+            std::atomic<bool> degraded = false;
+        };
+
+        // fixed capacity, so copying a registry doesn't allocate
+        struct SubscriberList {
+            std::array<Subscription, kMaxSubscribersPerTopic> entries{};
+            size_t count = 0;
+
+            const Subscription* begin() const { return entries.data(); }
+            const Subscription* end() const { return entries.data() + count; }
+            Subscription* begin() { return entries.data(); }
+            Subscription* end() { return entries.data() + count; }
+            bool empty() const { return count == 0; }
+        };
+
+        // Snapshot of the dispatch table. The event loop reads the current one without locking.
+        // Writers copy it to a free slot under the mutex, change the copy and then make that the current one.
+        struct Registry {
+            std::array<SubscriberList, kTopicCount> topics;
+        };
+
+        static constexpr size_t kMaxLaneDepth = std::max(CONFIG_PUB_SUB_HIGH_LANE_DEPTH, CONFIG_PUB_SUB_LANE_DEPTH);
+        // every lane has room for the deepest one, but only uses what its own depth needs
+        using LaneRingTransport = RingBufferTransport<ringCapacity(kMaxLaneDepth)>;
+
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        using TransportStorage = std::variant<std::monostate, StaticQueueTransport<kMaxLaneDepth>, LaneRingTransport, StaticPackedQueueTransport<kMaxLaneDepth>>;
+        using InboxSlot = std::optional<Inbox>;
+
+        // Hands out the static buffer the bus lives in (with the control block of its shared_ptr), so create doesn't touch the heap.
+        template <typename T>
+        struct ArenaAllocator {
+            using value_type = T;
+            ArenaAllocator() = default;
+            template <typename U>
+            ArenaAllocator(const ArenaAllocator<U>&) {}
+            T* allocate(size_t count);
+            void deallocate(T* pointer, size_t count);
+            template <typename U>
+            bool operator==(const ArenaAllocator<U>&) const { return true; }
+        };
+#else
+        using TransportStorage = std::unique_ptr<MessageTransport>;
+        using InboxSlot = std::unique_ptr<Inbox>;
+#endif
+
+        struct Lane {
+            MessageTransport* transport = nullptr;
+            TransportStorage storage;
+            // counted before sending, so the event loop can skip empty lanes without touching the transport
+            std::atomic<uint32_t> pending = 0;
+            // number of messages from higher lanes dispatched while this lane was waiting. Only used by the event loop.
+            uint32_t skipped = 0;
+        };
+
+        struct FlushWaiter {
+            TaskHandle_t task = nullptr;
+            const std::atomic<uint32_t>* counter = nullptr;
+            uint32_t target = 0;
+        };
+
+        // holds the latest value of a topic with the Conflate policy. Guarded by the mutex.
+        struct ConflationSlot {
+            Message latest{};
+            // a marker for this topic is on its way to the event loop
+            bool pending = false;
+        };
+
+        void callSubscribers(const SubscriberList& subscribers, const Message& msg);
+        bool admit(RateLimiter& limiter, const Message& msg);
+        bool takeHeldBack(RateLimiter& limiter, int64_t now, Message& msg);
+        void deliverHeldBack(int64_t now);
+        void freeRateLimiter(uint8_t index);
+        bool limitSubscriptions(Registry& registry, SubscriberHandle subscriber, TopicMask mask, const RateLimit& limit);
+        Watchdog* findWatchdog(SubscriberHandle subscriber);
+        void checkBudget(Watchdog& watchdog, SubscriberHandle subscriber, int64_t elapsedMicros);
+        bool degrade(Watchdog& watchdog, SubscriberHandle subscriber);
+        void freeWatchdog(SubscriberHandle subscriber);
+        Inbox* startInbox(SubscriberHandle subscriber, const InboxOptions& options);
+        void deliver(SubscriberHandle subscriber, const Message& msg);
+        void countPublished(Lane& lane, uint32_t count);
+        void discard(Lane& lane, const Message& msg);
+        bool publishConflated(Lane& lane, const Message& msg);
+        void takeConflated(Message& msg);
+        void dispatchInline(const Message& msg);
+        // take and drop a reference on the arena string or block the message may carry
+        void retain(const Message& msg) const;
+        void release(const Message& msg) const;
+        // for readers of a copy that may be stale: only takes a reference if the string or block is still in use
+        bool tryRetain(const Message& msg) const;
+        SubscriberList readSubscribers(size_t topicIndex) const;
+        static bool isReached(const uint32_t count, const uint32_t target) { return static_cast<int32_t>(count - target) >= 0; }
+        void notifyFlushWaiters();
+        static bool addSubscription(Registry& registry, SubscriberHandle subscriber, Topic topic, Inbox* inbox);
+        Registry& beginUpdate();
+        void commitUpdate(const Registry& registry);
+        void waitForReaders() const;
+        Inbox* findInbox(SubscriberHandle subscriber);
+        bool isSubscribed(SubscriberHandle subscriber) const;
+        Lane& laneOf(const Topic topic) { return m_lanes[static_cast<size_t>(getPriority(topic))]; }
+        bool receiveFromLanes(Message& msg);
+        size_t sendBatch(Lane& lane, std::span<const Message> messages);
+        bool sendWithBackpressure(Lane& lane, const Message& msg);
+        bool sendOrPump(Lane& lane, const Message& msg, TickType_t timeout);
+        bool defer(Lane& lane, const Message& msg);
+        void storeRetained(const Message& msg, bool keep = true);
+        bool readRetained(size_t topicIndex, Message& msg) const;
+        void deliverRetained(SubscriberHandle subscriber, Topic topic);
+        bool takeDeferred(Message& msg);
+        void dispatch(const Message& msg);
+        size_t runTimers();
+        TickType_t timerWait() const;
+        void requestRun(BaseType_t* higherPriorityTaskWoken);
+        bool serve(size_t maxMessages);
+        size_t dispatchMessages(size_t maxMessages);
+        // waits until the counter reaches the target. Returns false right away if the current task is the one that would have to count.
+        bool waitForDispatched(const std::atomic<uint32_t>& counter, uint32_t target, TickType_t timeout, const TaskHandle_t& countingTask);
 
         template <typename Func>
-        bool doInMutex(Func&& operation, const char* context, const char* detail) {
+        bool doInMutex(Func&& operation, const char* context, const char* detail) const {
             if (xSemaphoreTake(m_mutex, kMutexTimeout + 2) != pdTRUE) {
                 throwRuntimeError(context, std::string("Failed to take semaphore for " + std::string(detail)));
             }
@@ -173,20 +510,115 @@ namespace pub_sub {
 
         static void eventLoop(const std::shared_ptr<PubSub>& sharedPubSub);
         static void eventLoopTask(void* param);
-        void processMessage(const Message &msg) const;
-        void removeMapsToClear(const std::vector<SubscriberMap*>& mapsToClear);
-        static void removeSubscriber(SubscriberHandle subscriber, SubscriberMap &subscriberMap, std::vector<SubscriberMap*>& mapsToClear);
+        void processMessage(const Message &msg);
+        static void traceMessage(const Message& msg);
+        void wakeEventLoop();
         [[noreturn]] static void throwRuntimeError(const std::string& context, const std::string& detail);
 
         static constexpr int kMutexTimeout = pdMS_TO_TICKS(1000);
+        // pulses and resets come in one at a time, samples and anomalies may come in bursts
+        static constexpr std::array<size_t, kPriorityCount> kLaneDepth = {
+            CONFIG_PUB_SUB_HIGH_LANE_DEPTH, CONFIG_PUB_SUB_LANE_DEPTH, CONFIG_PUB_SUB_LANE_DEPTH
+        };
+        static constexpr size_t kMaxFlushWaiters = 4;
+        static constexpr size_t kBatchChunk = 16;
+        static constexpr size_t kMaxInboxes = CONFIG_PUB_SUB_MAX_INBOXES;
+        // the current snapshot, the one the event loop may still be using, and one to write the next version in
+        static constexpr size_t kRegistrySlots = 3;
 
+        const LoopMode m_loopMode;
+        // With Shared: Idle, or waiting in the ready queue of the executor, or being served by one of its tasks.
+        // RunAgain means new work came in while being served.
+        enum class RunState : uint8_t {
+            Idle = 0,
+            Scheduled,
+            Running,
+            RunAgain
+        };
+        Executor* m_executor = nullptr;
+        std::atomic<RunState> m_runState = RunState::Idle;
+        bool m_attached = false;
+        // messages published from callbacks, in a ring. Only used by the task that dispatches.
+        std::array<Message, CONFIG_PUB_SUB_DEFERRED_DEPTH> m_deferred{};
+        size_t m_deferredHead = 0;
+        size_t m_deferredCount = 0;
+        // messages from interrupts. Pending is raised before the message goes in, so the event loop can skip the queue when it is 0.
+        QueueHandle_t m_isrQueue = nullptr;
+        std::atomic<uint32_t> m_isrPending = 0;
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        std::array<uint8_t, CONFIG_PUB_SUB_ISR_QUEUE_DEPTH * sizeof(Message)> m_isrQueueItems{};
+        StaticQueue_t m_isrQueueBuffer{};
+#endif
+        // set while pumping in Manual mode, or while a task of the executor serves the bus in Shared mode
+        bool m_pumping = false;
         std::atomic<bool> m_eventLoopFinished = true;
-        TaskHandle_t m_eventLoopTaskHandle;
+        TaskHandle_t m_eventLoopTaskHandle = nullptr;
         SemaphoreHandle_t m_mutex;
-        QueueHandle_t m_message_queue;
-        bool m_processing;
-        std::vector<SubscriberMap> m_subscribers;
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        StaticSemaphore_t m_mutexBuffer{};
+#endif
+        std::array<Lane, kPriorityCount> m_lanes;
+        std::array<std::atomic<Priority>, kTopicCount> m_topicPriority;
+        // Published is counted before the message goes into the transport, dispatched after the subscribers were called.
+        // If they are equal, there is nothing in flight. Both may wrap around.
+        std::atomic<uint32_t> m_publishedCount = 0;
+        std::atomic<uint32_t> m_dispatchedCount = 0;
+        std::array<FlushWaiter, kMaxFlushWaiters> m_flushWaiters{};
+        std::atomic<size_t> m_flushWaiterCount = 0;
+        // dispatch table snapshots indexed by topic, and a bit per topic that is set if the topic has subscribers
+        std::array<Registry, kRegistrySlots> m_registrySlots{};
+        std::atomic<const Registry*> m_registry = &m_registrySlots[0];
+        // the snapshot the event loop is dispatching with, nullptr if none
+        std::atomic<const Registry*> m_activeRegistry = nullptr;
+        // Odd while a writer fills the slot. Inline dispatch copies the subscribers of its topic and checks the version didn't change,
+        // as there may be any number of inline dispatches going on, and the slot they read may be reused.
+        std::array<std::atomic<uint32_t>, kRegistrySlots> m_slotVersions{};
+        // number of inline dispatches going on, so unsubscribe can wait for them
+        std::atomic<uint32_t> m_inlineReaders = 0;
+        std::array<std::atomic<Dispatch>, kTopicCount> m_dispatch{};
+        // Last value of a retained topic, guarded by a sequence lock. The version is odd while a publisher writes the value.
+        // The value is kept in atomic words, so a reader may copy them while a writer changes them; the copy only counts
+        // if the version didn't change meanwhile. The topic is the index of the slot.
+        struct RetainedSlot {
+            std::atomic<uint32_t> version = 0;
+            // the variant index of the payload plus one, or 0 if there is no value
+            std::atomic<uint8_t> kind = 0;
+            std::atomic<uint64_t> payload = 0;
+            std::atomic<SubscriberHandle> source = nullptr;
+            std::atomic<uint32_t> sequence = 0;
+            std::atomic<uint32_t> publishedAt = 0;
+        };
+        std::array<std::atomic<bool>, kTopicCount> m_retained{};
+        std::array<RetainedSlot, kTopicCount> m_retainedSlots{};
+        std::atomic<TopicMask> m_subscriberMask = 0;
+        // inboxes are only added (under the mutex), never removed before the destructor, so they can be read without the mutex
+        std::array<InboxSlot, kMaxInboxes> m_inboxes;
+        std::atomic<size_t> m_inboxCount = 0;
         std::atomic<bool> m_terminateFlag;
+        std::atomic<bool> m_traceMessages = false;
+        std::atomic<MessageTap*> m_tap = nullptr;
+        // the wheel is guarded by the mutex; the next due time is copied out so the dispatcher can check it without the mutex
+        TimerWheel m_timers;
+        const Clock* m_clock;
+        std::atomic<int64_t> m_nextTimerDue = kNever;
+        std::array<RateLimiter, kMaxRateLimiters> m_rateLimiters{};
+        // when the first held back message is due, or kNever. Only ever lowered, except when the dispatcher recomputes it.
+        std::atomic<int64_t> m_nextHeldBackDue = kNever;
+        std::array<Watchdog, kMaxWatchdogs> m_watchdogs{};
+        // number of subscribers with a budget, so calling one without a budget doesn't look for it
+        std::atomic<size_t> m_watchdogCount = 0;
+        std::atomic<bool> m_runningTimers = false;
+        // per topic: backpressure policy (kept in two atomics, as a 64 bit atomic isn't lock-free on the ESP32),
+        // the last sequence number handed out and the number of dropped messages
+        std::array<std::atomic<Backpressure>, kTopicCount> m_backpressureMode{};
+        std::array<std::atomic<TickType_t>, kTopicCount> m_blockTimeout{};
+        std::array<std::atomic<uint32_t>, kTopicCount> m_sequence{};
+        std::array<std::atomic<uint32_t>, kTopicCount> m_droppedCount{};
+        std::array<ConflationSlot, kTopicCount> m_conflationSlots{};
+        BusMetrics<kMetricsEnabled> m_metrics;
+        // mutable, as readers like latest() take references too
+        mutable StringArena<CONFIG_PUB_SUB_STRING_SLOTS, CONFIG_PUB_SUB_STRING_LENGTH> m_strings;
+        BlockPool<CONFIG_PUB_SUB_BLOCK_SIZE, CONFIG_PUB_SUB_BLOCK_COUNT> m_blocks;
 
     };
 
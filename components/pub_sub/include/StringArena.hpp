@@ -0,0 +1,136 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+// Fixed set of string slots with reference counts, so a string payload can outlive the buffer of its publisher
+// without a malloc per message. Interning a string that is already in the arena shares its slot.
+// Lock-free: a slot is claimed with a compare-and-swap on its reference count, and a reference is only taken on a slot
+// that is in use. The text is only read while holding a reference, so it can't change underneath the reader.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace pub_sub {
+
+    template <size_t Slots, size_t Length>
+    class StringArena {
+        static_assert(Slots > 0 && Length > 1, "The arena needs at least one slot with room for a character");
+
+    public:
+        StringArena() = default;
+        StringArena(const StringArena&) = delete;
+        StringArena& operator=(const StringArena&) = delete;
+        StringArena(StringArena&&) = delete;
+        StringArena& operator=(StringArena&&) = delete;
+
+        // Returns a copy of the text in the arena with one reference, or nullptr if all slots are in use.
+        // Text longer than Length - 1 characters is cut off.
+        const char* intern(const char* text) {
+            char truncated[Length];
+            strncpy(truncated, text, Length - 1);
+            truncated[Length - 1] = '\0';
+            const auto hash = hashOf(truncated);
+
+            for (size_t index = 0; index < Slots; index++) {
+                if (m_slots[index].hash.load(std::memory_order_relaxed) == hash && tryAcquire(index)) {
+                    if (strcmp(m_text[index].data(), truncated) == 0) return m_text[index].data();
+                    release(index);
+                }
+            }
+            for (size_t index = 0; index < Slots; index++) {
+                auto& slot = m_slots[index];
+                uint32_t expected = 0;
+                if (slot.references.compare_exchange_strong(expected, kWriting, std::memory_order_acquire)) {
+                    memcpy(m_text[index].data(), truncated, Length);
+                    slot.hash.store(hash, std::memory_order_relaxed);
+                    slot.references.store(1, std::memory_order_release);
+                    return m_text[index].data();
+                }
+            }
+            return nullptr;
+        }
+
+        bool owns(const char* text) const {
+            return text >= m_text.front().data() && text < m_text.back().data() + Length;
+        }
+
+        // Adds a reference to a string from this arena. Other pointers are ignored.
+        void acquire(const char* text) {
+            if (!owns(text)) return;
+            m_slots[indexOf(text)].references.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Like acquire, but only takes a reference on a string that is still in use, for readers that may hold a stale pointer.
+        // Returns false if the slot was freed meanwhile. Other pointers are ignored.
+        bool tryAcquire(const char* text) {
+            if (!owns(text)) return true;
+            return tryAcquire(indexOf(text));
+        }
+
+        // Drops a reference to a string from this arena. The slot is free again when the last one is gone. Other pointers are ignored.
+        void release(const char* text) {
+            if (!owns(text)) return;
+            release(indexOf(text));
+        }
+
+        size_t inUse() const {
+            size_t count = 0;
+            for (const auto& slot : m_slots) {
+                if (slot.references.load(std::memory_order_relaxed) != 0) count++;
+            }
+            return count;
+        }
+
+    private:
+        // the reference count of a slot that is being filled
+        static constexpr uint32_t kWriting = UINT32_MAX;
+
+        struct Slot {
+            std::atomic<uint32_t> references = 0;
+            // lets intern skip slots without touching them. May be stale; the text is compared after taking a reference.
+            std::atomic<uint32_t> hash = 0;
+        };
+
+        // FNV-1a
+        static uint32_t hashOf(const char* text) {
+            uint32_t hash = 2166136261u;
+            for (; *text != '\0'; text++) {
+                hash = (hash ^ static_cast<uint8_t>(*text)) * 16777619u;
+            }
+            return hash;
+        }
+
+        size_t indexOf(const char* text) const {
+            return static_cast<size_t>(text - m_text.front().data()) / Length;
+        }
+
+        // takes a reference on a slot that is in use; fails on a free slot or one that is being filled
+        bool tryAcquire(const size_t index) {
+            auto& references = m_slots[index].references;
+            auto current = references.load(std::memory_order_relaxed);
+            while (current != 0 && current != kWriting) {
+                if (references.compare_exchange_weak(current, current + 1, std::memory_order_acquire)) return true;
+            }
+            return false;
+        }
+
+        void release(const size_t index) {
+            m_slots[index].references.fetch_sub(1, std::memory_order_release);
+        }
+
+        std::array<Slot, Slots> m_slots{};
+        std::array<std::array<char, Length>, Slots> m_text{};
+    };
+}
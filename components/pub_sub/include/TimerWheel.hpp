@@ -0,0 +1,126 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+
+// Periodic jobs for the bus, such as a sampler, a summary report or a health beacon. The dispatcher of the bus runs them,
+// so they share its task instead of each needing a task of their own. A job runs on a fixed schedule (start + n * period),
+// so it doesn't drift when a run is late. A run that is more than a period late skips the periods it missed rather than
+// catching up in a burst, and its statistics record how late it was.
+// The timers live in a hashed wheel: a slot per millisecond tick, modulo the number of slots, so finding the due jobs
+// only looks at the slots that passed since the last time.
+
+#pragma once
+
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+
+namespace pub_sub {
+
+    class Clock {
+    public:
+        virtual ~Clock() = default;
+        virtual int64_t nowMicros() const = 0;
+        // false if time only moves when told to. Then a sleeping event loop would never see a timer come due.
+        virtual bool runsByItself() const { return true; }
+    };
+
+    class SystemClock final : public Clock {
+    public:
+        int64_t nowMicros() const override { return esp_timer_get_time(); }
+    };
+
+    // Time only moves when told to, so a test or a replay on the host decides exactly when timers are due.
+    // Only for LoopMode::Manual (setClock rejects it otherwise): advance the clock, then pump.
+    class VirtualClock final : public Clock {
+    public:
+        explicit VirtualClock(const int64_t startMicros = 0) : m_now(startMicros) {}
+        int64_t nowMicros() const override { return m_now.load(); }
+        void advance(const int64_t micros) { m_now.fetch_add(micros); }
+        void set(const int64_t micros) { m_now.store(micros); }
+        bool runsByItself() const override { return false; }
+
+    private:
+        std::atomic<int64_t> m_now;
+    };
+
+    class TimerJob {
+    public:
+        virtual ~TimerJob() = default;
+        // scheduledMicros is when the run was due; the clock may be a bit further already
+        virtual void onTimer(int64_t scheduledMicros) = 0;
+    };
+
+    using TimerId = size_t;
+    constexpr TimerId kNoTimer = std::numeric_limits<TimerId>::max();
+    constexpr int64_t kNever = std::numeric_limits<int64_t>::max();
+
+    struct TimerStats {
+        uint32_t runs = 0;
+        // periods skipped because a run came more than a period late
+        uint32_t missed = 0;
+        // how late the runs were against their schedule
+        uint32_t maxLatenessMicros = 0;
+        uint32_t meanLatenessMicros = 0;
+    };
+
+    // Not thread safe: the bus guards it with its mutex, and runs the due jobs after letting go of it.
+    class TimerWheel {
+    public:
+        static constexpr size_t kMaxTimers = CONFIG_PUB_SUB_MAX_TIMERS;
+        static constexpr size_t kSlots = 64;
+        static constexpr int64_t kResolutionMicros = 1000;
+
+        struct Due {
+            TimerJob* job = nullptr;
+            int64_t scheduledMicros = 0;
+        };
+
+        TimerWheel();
+
+        // The first run is phase after now. Returns kNoTimer if all timers are in use or the period is 0.
+        TimerId add(TimerJob& job, int64_t now, uint32_t periodMicros, uint32_t phaseMicros);
+        bool remove(TimerId id);
+        // Takes the jobs that are due at now out of the wheel, puts them back for their next run, and returns how many there were.
+        size_t collectDue(int64_t now, std::span<Due, kMaxTimers> due);
+        // when the first job is due, or kNever if there are no timers
+        int64_t nextDue() const { return m_nextDue; }
+        TimerStats getStats(TimerId id) const;
+
+    private:
+        static constexpr uint16_t kNone = UINT16_MAX;
+
+        struct Entry {
+            TimerJob* job = nullptr;
+            int64_t due = 0;
+            uint32_t period = 0;
+            uint16_t next = kNone;
+            TimerStats stats{};
+            uint64_t totalLateness = 0;
+        };
+
+        static size_t slotOf(const int64_t micros) { return static_cast<size_t>(micros / kResolutionMicros) % kSlots; }
+        void insert(uint16_t index);
+        void unlink(uint16_t index);
+        void updateNextDue();
+
+        std::array<Entry, kMaxTimers> m_entries{};
+        std::array<uint16_t, kSlots> m_slots{};
+        // the tick up to which the slots have been looked at
+        int64_t m_tick = -1;
+        int64_t m_nextDue = kNever;
+    };
+}
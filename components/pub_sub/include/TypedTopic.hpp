@@ -0,0 +1,81 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+// Typed topics on top of the Payload variant. A TopicDef ties a topic to the one payload type it carries,
+// so publishing the wrong type, or subscribing without a handler for the topic, does not compile.
+// A TypedSubscriber finds the handler by comparing the topic with its own (compile-time) topic list,
+// and passes the payload on as the type it is, without visiting the variant.
+
+#pragma once
+
+#include "Message.hpp"
+#include <type_traits>
+#include <variant>
+
+namespace pub_sub {
+
+    template <typename T, typename Variant>
+    struct IsAlternativeOf : std::false_type {};
+
+    template <typename T, typename... Types>
+    struct IsAlternativeOf<T, std::variant<Types...>> : std::disjunction<std::is_same<T, Types>...> {};
+
+    template <Topic TopicValue, typename PayloadType>
+    struct TopicDef {
+        static_assert(IsAlternativeOf<PayloadType, Payload>::value, "The payload type must be one of the types in Payload");
+        static_assert(TopicValue != Topic::AllTopics && toMask(TopicValue) != 0, "A typed topic must be a single, existing topic");
+
+        static constexpr Topic kTopic = TopicValue;
+        using Type = PayloadType;
+    };
+
+    using AnomalyTopic = TopicDef<Topic::Anomaly, int>;
+    using DriftedTopic = TopicDef<Topic::Drifted, int>;
+    using NoFitTopic = TopicDef<Topic::NoFit, int>;
+    using PulseTopic = TopicDef<Topic::Pulse, int>;
+    using SampleTopic = TopicDef<Topic::Sample, IntCoordinate>;
+    using SensorWasResetTopic = TopicDef<Topic::SensorWasReset, int>;
+
+    // The topic definition is passed as a tag, so one subscriber can handle several topics with the same payload type.
+    template <typename Def>
+    class TopicHandler {
+    public:
+        TopicHandler() = default;
+        virtual ~TopicHandler() = default;
+        TopicHandler(const TopicHandler&) = delete;
+        TopicHandler& operator=(const TopicHandler&) = delete;
+        TopicHandler(TopicHandler&&) = delete;
+        TopicHandler& operator=(TopicHandler&&) = delete;
+
+        virtual void onMessage(Def topic, const typename Def::Type& payload) = 0;
+    };
+
+    template <typename... Defs>
+    class TypedSubscriber : public Subscriber, public TopicHandler<Defs>... {
+    public:
+        void subscriberCallback(const Topic topic, const Payload& payload) final {
+            (dispatch<Defs>(topic, payload) || ...);
+        }
+
+        static constexpr TopicMask topics() { return (toMask(Defs::kTopic) | ...); }
+
+    private:
+        template <typename Def>
+        bool dispatch(const Topic topic, const Payload& payload) {
+            if (topic != Def::kTopic) return false;
+            // an untyped publish may have put in another type. Ignore that rather than throw.
+            if (const auto* value = std::get_if<typename Def::Type>(&payload)) {
+                static_cast<TopicHandler<Def>&>(*this).onMessage(Def{}, *value);
+            }
+            return true;
+        }
+    };
+}
@@ -0,0 +1,377 @@
+// Copyright 2024 Rik Essenius
+// 
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software distributed under the License
+// is distributed on an "AS IS" BASIS WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and limitations under the License.
+
+#include "unity.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <variant>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "MpscRingBuffer.hpp"
+#include "PubSub.hpp"
+#include "TestPubSub.hpp"
+
+namespace pub_sub_test {
+    using pub_sub::MpscRingBuffer;
+    using pub_sub::PubSub;
+    using pub_sub::Subscriber;
+    using pub_sub::Topic;
+    using pub_sub::Payload;
+    using pub_sub::Transport;
+
+    // keeps the callback as cheap as possible so we measure the bus, not the subscriber
+    class CountingSubscriber final : public Subscriber {
+    public:
+        void subscriberCallback(Topic, const Payload&) override { m_count++; }
+        unsigned int count() const { return m_count.load(); }
+    private:
+        std::atomic<unsigned int> m_count = 0;
+    };
+
+    struct ProducerContext {
+        PubSub* pubsub = nullptr;
+        int messages = 0;
+        double totalMicros = 0;
+        double maxMicros = 0;
+        std::atomic<bool> done = false;
+    };
+
+    void producerTask(void* param) {
+        auto* context = static_cast<ProducerContext*>(param);
+        for (int i = 0; i < context->messages; i++) {
+            const auto start = std::chrono::high_resolution_clock::now();
+            context->pubsub->publish(Topic::Sample, i);
+            const auto duration = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+            context->totalMicros += duration;
+            if (duration > context->maxMicros) context->maxMicros = duration;
+        }
+        context->done.store(true);
+        vTaskDelete(nullptr);
+    }
+
+    void runTransportStress(const Transport transport, const char* name) {
+        constexpr int kProducers = 4;
+        constexpr int kMessagesPerProducer = 2000;
+        auto pubsub = PubSub::create(transport);
+        CountingSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Sample);
+
+        ProducerContext contexts[kProducers];
+        TaskHandle_t handles[kProducers];
+        const auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < kProducers; i++) {
+            contexts[i].pubsub = pubsub.get();
+            contexts[i].messages = kMessagesPerProducer;
+            TEST_ASSERT_EQUAL_MESSAGE(pdPASS, xTaskCreate(producerTask, "Producer", 4096, &contexts[i], 3, &handles[i]), "Producer created");
+        }
+        for (auto& context : contexts) {
+            while (!context.done.load()) {
+                vTaskDelay(1);
+            }
+        }
+        pubsub->waitForIdle();
+        const auto elapsedMicros = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+
+        double totalMicros = 0;
+        double maxMicros = 0;
+        for (const auto& context : contexts) {
+            totalMicros += context.totalMicros;
+            if (context.maxMicros > maxMicros) maxMicros = context.maxMicros;
+        }
+        constexpr int kTotal = kProducers * kMessagesPerProducer;
+        printf("%s transport: %d messages in %.0f us (%.0f msg/s), publish latency avg %.2f us, max %.1f us\n",
+            name, kTotal, elapsedMicros, kTotal * 1e6 / elapsedMicros, totalMicros / kTotal, maxMicros);
+        TEST_ASSERT_EQUAL_MESSAGE(kTotal, subscriber.count(), "All messages delivered");
+        pubsub->end();
+    }
+
+    // publishes the same number of messages one by one and in batches, and reports the throughput of both
+    void runBatchBenchmark(const Transport transport, const char* name) {
+        constexpr int kMessages = 10000;
+        constexpr size_t kBatchSize = 8;
+        auto pubsub = PubSub::create(transport);
+        CountingSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Sample);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < kMessages; i++) {
+            pubsub->publish(Topic::Sample, i);
+        }
+        pubsub->waitForIdle();
+        const auto singleMicros = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+        TEST_ASSERT_EQUAL_MESSAGE(kMessages, subscriber.count(), "All single messages delivered");
+
+        std::array<pub_sub::Message, kBatchSize> batch{};
+        start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < kMessages; i += kBatchSize) {
+            for (size_t j = 0; j < kBatchSize; j++) {
+                batch[j] = {nullptr, static_cast<int>(i + j), Topic::Sample};
+            }
+            pubsub->publishBatch(batch);
+        }
+        pubsub->waitForIdle();
+        const auto batchMicros = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+        TEST_ASSERT_EQUAL_MESSAGE(2 * kMessages, subscriber.count(), "All batched messages delivered");
+
+        printf("%s transport: single publish %.0f msg/s, batches of %zu %.0f msg/s\n",
+            name, kMessages * 1e6 / singleMicros, kBatchSize, kMessages * 1e6 / batchMicros);
+        pubsub->end();
+    }
+
+    // the payload is the publish time in microseconds since the start, so the callback can work out the latency per topic
+    class LatencySubscriber final : public Subscriber {
+    public:
+        LatencySubscriber() : m_start(std::chrono::steady_clock::now()) {}
+        int now() const {
+            return static_cast<int>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count());
+        }
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            auto& statistics = topic == Topic::Pulse ? m_pulse : m_sample;
+            const auto latency = now() - std::get<int>(payload);
+            statistics.count++;
+            statistics.totalMicros += latency;
+            if (latency > statistics.maxMicros) statistics.maxMicros = latency;
+        }
+        struct Statistics {
+            unsigned int count = 0;
+            double totalMicros = 0;
+            int maxMicros = 0;
+            double average() const { return count == 0 ? 0 : totalMicros / count; }
+        };
+        const Statistics& pulse() const { return m_pulse; }
+        const Statistics& sample() const { return m_sample; }
+    private:
+        std::chrono::steady_clock::time_point m_start;
+        Statistics m_pulse;
+        Statistics m_sample;
+    };
+
+    // Floods the sample topic with a pulse in between every now and then, and reports the latency of both.
+    // With lanes, the pulses overtake the samples; with everything in one lane, they queue up behind them.
+    void runLaneLatency(const Transport transport, const bool useLanes, const char* name) {
+        constexpr int kRounds = 200;
+        constexpr int kSamplesPerPulse = 20;
+        auto pubsub = PubSub::create(transport);
+        if (!useLanes) {
+            pubsub->setPriority(Topic::AllTopics, pub_sub::Priority::Normal);
+        }
+        LatencySubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Sample);
+        pubsub->subscribe(&subscriber, Topic::Pulse);
+        for (int round = 0; round < kRounds; round++) {
+            for (int i = 0; i < kSamplesPerPulse; i++) {
+                pubsub->publish(Topic::Sample, subscriber.now());
+            }
+            pubsub->publish(Topic::Pulse, subscriber.now());
+        }
+        pubsub->waitForIdle();
+        printf("%s: pulse latency avg %.1f us, max %d us; sample latency avg %.1f us, max %d us\n",
+            name, subscriber.pulse().average(), subscriber.pulse().maxMicros, subscriber.sample().average(), subscriber.sample().maxMicros);
+        TEST_ASSERT_EQUAL_MESSAGE(kRounds, subscriber.pulse().count, "All pulses delivered");
+        TEST_ASSERT_EQUAL_MESSAGE(kRounds * kSamplesPerPulse, subscriber.sample().count, "All samples delivered");
+        pubsub->end();
+    }
+
+    DEFINE_TEST_CASE(mpsc_ring_buffer) {
+        MpscRingBuffer<int, 4> buffer;
+        int value = 0;
+        TEST_ASSERT_FALSE_MESSAGE(buffer.tryPop(value), "Nothing to pop from an empty buffer");
+        for (int round = 0; round < 3; round++) {
+            for (int i = 0; i < 4; i++) {
+                TEST_ASSERT_TRUE_MESSAGE(buffer.tryPush(round * 10 + i), "Push succeeds while not full");
+            }
+            TEST_ASSERT_FALSE_MESSAGE(buffer.tryPush(99), "Push fails when full");
+            TEST_ASSERT_EQUAL_MESSAGE(4, buffer.size(), "Buffer is full");
+            for (int i = 0; i < 4; i++) {
+                TEST_ASSERT_TRUE_MESSAGE(buffer.tryPop(value), "Pop succeeds");
+                TEST_ASSERT_EQUAL_MESSAGE(round * 10 + i, value, "Items come out in order (also after wrapping around)");
+            }
+            TEST_ASSERT_TRUE_MESSAGE(buffer.empty(), "Buffer empty again");
+        }
+
+        const int items[] = {1, 2, 3};
+        TEST_ASSERT_TRUE_MESSAGE(buffer.tryPush(0), "Push before batch");
+        TEST_ASSERT_TRUE_MESSAGE(buffer.tryPushBatch(items, 3), "Batch fits in the remaining room");
+        TEST_ASSERT_FALSE_MESSAGE(buffer.tryPushBatch(items, 1), "Batch fails when full");
+        TEST_ASSERT_TRUE_MESSAGE(buffer.tryPop(value), "Pop one");
+        TEST_ASSERT_FALSE_MESSAGE(buffer.tryPushBatch(items, 2), "Batch fails if only part of it fits");
+        TEST_ASSERT_EQUAL_MESSAGE(3, buffer.size(), "Failed batch pushed nothing");
+        for (int i = 1; i <= 3; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(buffer.tryPop(value), "Pop batch item");
+            TEST_ASSERT_EQUAL_MESSAGE(i, value, "Batch items come out in order");
+        }
+
+        MpscRingBuffer<int, 8> smaller(2);
+        TEST_ASSERT_EQUAL_MESSAGE(2, smaller.capacity(), "Uses less than its storage");
+        TEST_ASSERT_TRUE_MESSAGE(smaller.tryPush(1) && smaller.tryPush(2), "Fill the smaller capacity");
+        TEST_ASSERT_FALSE_MESSAGE(smaller.tryPush(3), "Full at the smaller capacity");
+        TEST_ASSERT_FALSE_MESSAGE(decltype(smaller)::isPossible(6), "Capacity must be a power of two");
+        TEST_ASSERT_FALSE_MESSAGE(decltype(smaller)::isPossible(16), "Capacity must fit in the storage");
+
+        pub_sub::RingBufferTransport<128> ring(16);
+        TEST_ASSERT_TRUE_MESSAGE(ring.isValid(), "Ring transport fits");
+        TEST_ASSERT_EQUAL_MESSAGE(16, ring.capacity(), "Ring capacity follows the depth");
+        TEST_ASSERT_EQUAL_MESSAGE(128, pub_sub::RingBufferTransport<128>(100).capacity(), "Depth rounded up to a power of two");
+        TEST_ASSERT_FALSE_MESSAGE(pub_sub::RingBufferTransport<64>(100).isValid(), "Depth that doesn't fit the storage rejected");
+    }
+
+    DEFINE_TEST_CASE(static_queue_transport) {
+        pub_sub::StaticQueueTransport<4> transport(10);
+        TEST_ASSERT_TRUE_MESSAGE(transport.isValid(), "Queue and mutex created in the static buffers");
+        for (int i = 0; i < 4; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(transport.send({nullptr, i, Topic::Sample}, 0), "Send within the depth");
+        }
+        TEST_ASSERT_FALSE_MESSAGE(transport.send({nullptr, 4, Topic::Sample}, 0), "Depth capped at the size of the buffer");
+        TEST_ASSERT_EQUAL_MESSAGE(4, transport.waiting(), "Four messages waiting");
+        pub_sub::Message message{};
+        for (int i = 0; i < 4; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(transport.receive(message), "Receive what was sent");
+            TEST_ASSERT_EQUAL_MESSAGE(i, std::get<int>(message.message), "Messages come out in order");
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(0, transport.waiting(), "Nothing left");
+    }
+
+    bool samePayload(const Payload& left, const Payload& right) {
+        char leftText[32];
+        char rightText[32];
+        std::visit(pub_sub::MessageVisitor(leftText), left);
+        std::visit(pub_sub::MessageVisitor(rightText), right);
+        return left.index() == right.index() && strcmp(leftText, rightText) == 0;
+    }
+
+    struct BlockedSend {
+        pub_sub::MessageTransport* transport = nullptr;
+        pub_sub::Message message{};
+        std::atomic<bool> sent = false;
+    };
+
+    void blockedSendTask(void* param) {
+        auto* context = static_cast<BlockedSend*>(param);
+        context->sent.store(context->transport->send(context->message, portMAX_DELAY));
+        vTaskDelete(nullptr);
+    }
+
+    DEFINE_TEST_CASE(packed_queue_transport) {
+        using pub_sub::Message;
+        TEST_ASSERT_EQUAL_MESSAGE(pub_sub::kMetricsEnabled ? 12 : 8, sizeof(pub_sub::WireMessage), "Packed message size");
+
+        pub_sub::PackedQueueTransport transport(40);
+        TEST_ASSERT_TRUE_MESSAGE(transport.isValid(), "Packed queue created");
+        CountingSubscriber source;
+        const char* text = "out of line on a 64 bit host";
+        const Message sent[] = {
+            {&source, 42, Topic::Pulse, 1, false, 1000},
+            {nullptr, 1.5f, Topic::Sample, 1},
+            {&source, pub_sub::IntCoordinate(-3, 7), Topic::Sample, 2},
+            {nullptr, text, Topic::Anomaly, 1},
+            {nullptr, 0, Topic::Pulse, 2, true},
+            {&source, -5, Topic::Pulse, 9},
+            {&source, -4, Topic::Pulse, 8},
+            {&source, -6, Topic::Pulse, 100000},
+            {&source, -7, Topic::Pulse, 100001}
+        };
+        for (const auto& message : sent) {
+            TEST_ASSERT_TRUE_MESSAGE(transport.send(message, 0), "Send packed");
+        }
+        for (const auto& expected : sent) {
+            Message message{};
+            TEST_ASSERT_TRUE_MESSAGE(transport.receive(message), "Receive packed");
+            TEST_ASSERT_TRUE_MESSAGE(message.source == expected.source, "Source restored");
+            TEST_ASSERT_EQUAL_MESSAGE(expected.topic, message.topic, "Topic restored");
+            TEST_ASSERT_EQUAL_MESSAGE(expected.sequence, message.sequence, "Sequence restored, also out of order and after a jump");
+            TEST_ASSERT_EQUAL_MESSAGE(expected.conflated, message.conflated, "Conflated flag restored");
+            TEST_ASSERT_TRUE_MESSAGE(samePayload(expected.message, message.message), "Payload restored");
+            TEST_ASSERT_EQUAL_MESSAGE(pub_sub::kMetricsEnabled ? expected.publishedAt : 0, message.publishedAt, "Publish time kept with metrics");
+        }
+
+        // blocks go out of line, until the table is full
+        for (size_t i = 0; i < pub_sub::MessagePacker::kOutOfLineSlots; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(transport.send({nullptr, pub_sub::BlockRef(), Topic::Drifted, 1}, 0), "Out of line while there is room");
+        }
+        TEST_ASSERT_FALSE_MESSAGE(transport.send({nullptr, pub_sub::BlockRef(), Topic::Drifted, 1}, 0), "Out of line table full");
+        Message message{};
+        TEST_ASSERT_TRUE_MESSAGE(transport.receive(message), "Receive frees a slot");
+        TEST_ASSERT_TRUE_MESSAGE(transport.send({nullptr, pub_sub::BlockRef(), Topic::Drifted, 1}, 0), "Room again");
+        while (transport.receive(message)) {}
+
+        pub_sub::PackedQueueTransport small(2);
+        TEST_ASSERT_TRUE_MESSAGE(small.send({nullptr, 1, Topic::NoFit, 1}, 0), "First of two");
+        TEST_ASSERT_TRUE_MESSAGE(small.send({nullptr, 2, Topic::NoFit, 2}, 0), "Second of two");
+        Message dropped{};
+        bool didDrop = false;
+        TEST_ASSERT_TRUE_MESSAGE(small.sendReplacingOldest({nullptr, 3, Topic::NoFit, 3}, dropped, didDrop), "Replaced the oldest");
+        TEST_ASSERT_TRUE_MESSAGE(didDrop, "Dropped one");
+        TEST_ASSERT_EQUAL_MESSAGE(1, dropped.sequence, "Dropped the first");
+        for (uint32_t sequence = 2; sequence <= 3; sequence++) {
+            TEST_ASSERT_TRUE_MESSAGE(small.receive(message), "Receive the rest");
+            TEST_ASSERT_EQUAL_MESSAGE(sequence, message.sequence, "Sequence still counts along after a drop");
+        }
+
+        // a full packed queue can't wait in the queue itself, so a receive has to wake the waiting sender
+        TEST_ASSERT_TRUE_MESSAGE(small.send({nullptr, 4, Topic::NoFit, 4}, 0), "Fill again");
+        TEST_ASSERT_TRUE_MESSAGE(small.send({nullptr, 5, Topic::NoFit, 5}, 0), "Full");
+        TEST_ASSERT_FALSE_MESSAGE(small.send({nullptr, 6, Topic::NoFit, 6}, 2), "Timeout expires while full");
+        BlockedSend blocked{&small, {nullptr, 6, Topic::NoFit, 6}};
+        TaskHandle_t handle = nullptr;
+        TEST_ASSERT_EQUAL_MESSAGE(pdPASS, xTaskCreate(blockedSendTask, "BlockedSend", 4096, &blocked, 3, &handle), "Sender created");
+        vTaskDelay(5);
+        TEST_ASSERT_FALSE_MESSAGE(blocked.sent.load(), "Sender waits while full");
+        TEST_ASSERT_TRUE_MESSAGE(small.receive(message), "Receive makes room");
+        for (int i = 0; i < 100 && !blocked.sent.load(); i++) {
+            vTaskDelay(1);
+        }
+        TEST_ASSERT_TRUE_MESSAGE(blocked.sent.load(), "Sender woken by the receive");
+        for (uint32_t sequence = 5; sequence <= 6; sequence++) {
+            TEST_ASSERT_TRUE_MESSAGE(small.receive(message), "Receive after the wait");
+            TEST_ASSERT_EQUAL_MESSAGE(sequence, message.sequence, "The waiting sender's message came last");
+        }
+
+        // the source table starts over once nothing packed is left
+        constexpr auto kSources = pub_sub::MessagePacker::kSourceSlots + 1;
+        pub_sub::MessagePacker packer;
+        std::array<CountingSubscriber, kSources> sources;
+        std::array<pub_sub::WireMessage, kSources> packed{};
+        for (size_t i = 0; i < kSources; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(packer.pack({&sources[i], 0, Topic::Pulse, static_cast<uint32_t>(i + 1)}, packed[i]), "Packed");
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(1, packer.outOfLineInUse(), "One source too many goes out of line while ids are in flight");
+        for (size_t i = 0; i < kSources; i++) {
+            packer.unpack(packed[i], message);
+            TEST_ASSERT_TRUE_MESSAGE(message.source == &sources[i], "Source restored");
+        }
+        auto* last = &sources[kSources - 1];
+        TEST_ASSERT_TRUE_MESSAGE(packer.pack({last, 0, Topic::Pulse, static_cast<uint32_t>(kSources + 1)}, packed[0]), "Pack after draining");
+        TEST_ASSERT_EQUAL_MESSAGE(0, packer.outOfLineInUse(), "The table started over, so the new source fits");
+        packer.unpack(packed[0], message);
+        TEST_ASSERT_TRUE_MESSAGE(message.source == last, "Source restored from the new table");
+    }
+
+    DEFINE_TEST_CASE(pubsub_transport_stress) {
+        runTransportStress(Transport::Queue, "Queue");
+        runTransportStress(Transport::RingBuffer, "Ring buffer");
+        runTransportStress(Transport::PackedQueue, "Packed queue");
+    }
+
+    DEFINE_TEST_CASE(pubsub_batch_benchmark) {
+        runBatchBenchmark(Transport::Queue, "Queue");
+        runBatchBenchmark(Transport::RingBuffer, "Ring buffer");
+    }
+
+    DEFINE_TEST_CASE(pubsub_lane_latency) {
+        runLaneLatency(Transport::Queue, false, "Queue, single lane");
+        runLaneLatency(Transport::Queue, true, "Queue, priority lanes");
+        runLaneLatency(Transport::RingBuffer, false, "Ring buffer, single lane");
+        runLaneLatency(Transport::RingBuffer, true, "Ring buffer, priority lanes");
+    }
+}
@@ -11,9 +11,16 @@
 
 #include <limits.h>
 #include "unity.h"
+#include "MessageReplayer.hpp"
 #include "PubSub.hpp"
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <thread>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
 #include <esp_log.h>
 #include "TestPubSub.hpp"
 #include "TestSubscriber.hpp"
@@ -192,4 +199,1344 @@ namespace pub_sub_test {
         pubsub->end();
         }
     }
+
+    DEFINE_TEST_CASE(pubsub_all_topics_and_presence) {
+        auto pubsub = PubSub::create();
+        TestSubscriber allSubscriber(1);
+        TestSubscriber pulseSubscriber(2);
+
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->hasSubscribers(Topic::Pulse), "No subscribers for Pulse yet");
+        // nobody listens, so this should not even reach the event loop
+        pubsub->publish(Topic::Pulse, 1);
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->isIdle(), "Publish without subscribers leaves the bus idle");
+
+        pubsub->subscribe(&allSubscriber, Topic::AllTopics);
+        pubsub->subscribe(&pulseSubscriber, Topic::Pulse);
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->hasSubscribers(Topic::NoFit), "AllTopics subscription covers NoFit");
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->hasSubscribers(Topic::AllTopics), "AllTopics reports subscribers when any topic has one");
+
+        pubsub->publish(Topic::NoFit, 3);
+        pubsub->publish(Topic::Pulse, 4);
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(2, allSubscriber.getCallCount(), "AllTopics subscriber got both messages");
+        TEST_ASSERT_EQUAL_MESSAGE(1, pulseSubscriber.getCallCount(), "Pulse subscriber got the pulse only");
+        TEST_ASSERT_EQUAL_STRING_MESSAGE("4", pulseSubscriber.getBuffer(), "Pulse subscriber got the right value");
+
+        pubsub->unsubscribe(&allSubscriber);
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->hasSubscribers(Topic::NoFit), "No subscribers left for NoFit");
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->hasSubscribers(Topic::Pulse), "Pulse subscriber is still there");
+
+        allSubscriber.reset();
+        pulseSubscriber.reset();
+        pubsub->publish(Topic::Pulse, 5);
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(0, allSubscriber.getCallCount(), "Unsubscribed from all topics");
+        TEST_ASSERT_EQUAL_MESSAGE(1, pulseSubscriber.getCallCount(), "Pulse subscriber still called");
+        pubsub->end();
+    }
+
+    DEFINE_TEST_CASE(pubsub_wakes_on_publish_and_end) {
+        auto pubsub = PubSub::create();
+        TestSubscriber subscriber(1);
+        pubsub->subscribe(&subscriber, Topic::Pulse);
+
+        // let the event loop go to sleep, then check it wakes up right away on a publish
+        vTaskDelay(pdMS_TO_TICKS(50));
+        const auto start = std::chrono::steady_clock::now();
+        pubsub->publish(Topic::Pulse, 7);
+        while (!pubsub->isIdle() && std::chrono::steady_clock::now() - start < std::chrono::seconds(1)) {
+            taskYIELD();
+        }
+        const auto wakeMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        printf("Delivery after idle: %.1f us\n", wakeMicros);
+        TEST_ASSERT_EQUAL_MESSAGE(1, subscriber.getCallCount(), "Message delivered after idle period");
+        TEST_ASSERT_LESS_THAN_MESSAGE(pdMS_TO_TICKS(10) * portTICK_PERIOD_MS * 1000.0, wakeMicros, "Delivered faster than the old polling interval");
+
+        const auto endStart = std::chrono::steady_clock::now();
+        pubsub->end();
+        const auto endMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - endStart).count();
+        printf("End took %.1f us\n", endMicros);
+        TEST_ASSERT_LESS_THAN_MESSAGE(pdMS_TO_TICKS(10) * portTICK_PERIOD_MS * 1000.0, endMicros, "End wakes the event loop right away");
+    }
+
+    // holds up the event loop until released, so we can see what happens with messages in flight
+    class BlockingSubscriber final : public Subscriber {
+    public:
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            while (!m_release.load()) {
+                taskYIELD();
+            }
+            Subscriber::subscriberCallback(topic, payload);
+            m_callCount++;
+        }
+        void release() { m_release.store(true); }
+        unsigned int getCallCount() const { return m_callCount.load(); }
+    private:
+        std::atomic<bool> m_release = false;
+        std::atomic<unsigned int> m_callCount = 0;
+    };
+
+    // waits for the bus from its callback, which can't work
+    class IdleWaitingSubscriber final : public Subscriber {
+    public:
+        explicit IdleWaitingSubscriber(PubSub& pubsub) : m_pubsub(pubsub) {}
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            if (m_pubsub.waitForIdle()) m_succeeded++;
+            m_callCount++;
+        }
+        int getCallCount() const { return m_callCount.load(); }
+        int getSucceeded() const { return m_succeeded.load(); }
+    private:
+        PubSub& m_pubsub;
+        std::atomic<int> m_callCount = 0;
+        std::atomic<int> m_succeeded = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_flush) {
+        auto pubsub = PubSub::create();
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->flush(0), "Flush on an idle bus succeeds right away");
+
+        BlockingSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Sample);
+        pubsub->publish(Topic::Sample, 1);
+        pubsub->publish(Topic::Sample, 2);
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->isIdle(), "Bus not idle with messages in flight");
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->flush(pdMS_TO_TICKS(50)), "Flush reports the deadline was missed");
+        TEST_ASSERT_EQUAL_MESSAGE(0, subscriber.getCallCount(), "Subscriber still blocked");
+
+        subscriber.release();
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->flush(pdMS_TO_TICKS(1000)), "Flush succeeds once the subscriber lets go");
+        TEST_ASSERT_EQUAL_MESSAGE(2, subscriber.getCallCount(), "Both messages were dispatched before flush returned");
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->isIdle(), "Bus is idle after the flush");
+
+        IdleWaitingSubscriber waiting(*pubsub);
+        pubsub->subscribe(&waiting, Topic::Pulse);
+        pubsub->publish(Topic::Pulse, 1);
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->waitForIdle(), "Waiting from the test task works");
+        TEST_ASSERT_EQUAL_MESSAGE(1, waiting.getCallCount(), "The callback returned");
+        TEST_ASSERT_EQUAL_MESSAGE(0, waiting.getSucceeded(), "Waiting in a callback fails instead of hanging");
+        pubsub->end();
+    }
+
+    // remembers the int payloads in the order they arrived
+    class RecordingSubscriber final : public Subscriber {
+    public:
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            if (m_count < m_values.size()) {
+                m_values[m_count++] = std::get<int>(payload);
+            }
+        }
+        size_t count() const { return m_count; }
+        int value(const size_t index) const { return m_values[index]; }
+    private:
+        std::array<int, 64> m_values{};
+        size_t m_count = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_publish_batch) {
+        auto pubsub = PubSub::create();
+        RecordingSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Sample);
+
+        // more than one chunk, with messages nobody listens to mixed in
+        std::array<pub_sub::Message, 40> batch{};
+        int expected = 0;
+        for (size_t i = 0; i < batch.size(); i++) {
+            const auto topic = i % 3 == 0 ? Topic::Pulse : Topic::Sample;
+            batch[i] = {nullptr, static_cast<int>(i), topic};
+            if (topic == Topic::Sample) expected++;
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(batch.size(), pubsub->publishBatch(batch), "Messages without subscribers count as published");
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(expected, subscriber.count(), "Only the messages with subscribers were delivered");
+        int previous = -1;
+        for (size_t i = 0; i < subscriber.count(); i++) {
+            TEST_ASSERT_NOT_EQUAL_MESSAGE(0, subscriber.value(i) % 3, "Messages without subscribers were skipped");
+            TEST_ASSERT_GREATER_THAN_MESSAGE(previous, subscriber.value(i), "Messages arrive in the order they were in the batch");
+            previous = subscriber.value(i);
+        }
+
+        pubsub->publishBatch({});
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->isIdle(), "An empty batch sends nothing");
+        pubsub->end();
+    }
+
+    // holds up the event loop on the first message until released, then remembers the order in which the messages came in
+    class OrderSubscriber final : public Subscriber {
+    public:
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            while (!m_release.load()) {
+                taskYIELD();
+            }
+            if (m_count < m_entries.size()) {
+                m_entries[m_count++] = {topic, std::get<int>(payload)};
+            }
+        }
+        void release() { m_release.store(true); }
+        size_t count() const { return m_count; }
+        Topic topic(const size_t index) const { return m_entries[index].first; }
+        int value(const size_t index) const { return m_entries[index].second; }
+    private:
+        std::atomic<bool> m_release = false;
+        std::array<std::pair<Topic, int>, 32> m_entries{};
+        size_t m_count = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_priority_lanes) {
+        auto pubsub = PubSub::create();
+        TEST_ASSERT_EQUAL_MESSAGE(pub_sub::Priority::High, pubsub->getPriority(Topic::Pulse), "Pulse is high priority by default");
+        TEST_ASSERT_EQUAL_MESSAGE(pub_sub::Priority::Low, pubsub->getPriority(Topic::Sample), "Sample is low priority by default");
+
+        OrderSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Pulse);
+        pubsub->subscribe(&subscriber, Topic::Sample);
+        pubsub->subscribe(&subscriber, Topic::Anomaly);
+
+        // the first pulse blocks the event loop, so everything after it is waiting in the lanes
+        pubsub->publish(Topic::Pulse, 0);
+        while (pubsub->isIdle()) {
+            taskYIELD();
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+        pubsub->publish(Topic::Sample, 100);
+        pubsub->publish(Topic::Anomaly, 200);
+        constexpr int kPulses = 12;
+        for (int i = 1; i <= kPulses; i++) {
+            pubsub->publish(Topic::Pulse, i);
+        }
+        subscriber.release();
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(kPulses + 3, subscriber.count(), "All messages delivered");
+
+        // pulses overtake the rest until the starvation bound kicks in; the anomaly (normal lane) goes first then
+        constexpr auto kBound = PubSub::kStarvationBound;
+        for (size_t i = 0; i <= kBound; i++) {
+            TEST_ASSERT_EQUAL_MESSAGE(Topic::Pulse, subscriber.topic(i), "Pulses go first");
+            TEST_ASSERT_EQUAL_MESSAGE(static_cast<int>(i), subscriber.value(i), "Pulses stay in order");
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(Topic::Anomaly, subscriber.topic(kBound + 1), "Normal lane served after the starvation bound");
+        TEST_ASSERT_EQUAL_MESSAGE(Topic::Sample, subscriber.topic(kBound + 2), "Low lane served after the starvation bound");
+        TEST_ASSERT_EQUAL_MESSAGE(Topic::Pulse, subscriber.topic(kBound + 3), "Then the remaining pulses");
+
+        pubsub->setPriority(Topic::AllTopics, pub_sub::Priority::Normal);
+        TEST_ASSERT_EQUAL_MESSAGE(pub_sub::Priority::Normal, pubsub->getPriority(Topic::Pulse), "Priority changed for all topics");
+        pubsub->end();
+    }
+
+    DEFINE_TEST_CASE(pubsub_inbox) {
+        auto pubsub = PubSub::create();
+        BlockingSubscriber slowSubscriber;
+        TestSubscriber fastSubscriber(1);
+        pub_sub::InboxOptions options;
+        options.depth = 8;
+        options.core = 1;
+        pubsub->subscribe(&slowSubscriber, Topic::Sample, options);
+        pubsub->subscribe(&fastSubscriber, Topic::Sample);
+        // the inbox applies to later subscriptions of the same subscriber too
+        pubsub->subscribe(&slowSubscriber, Topic::Pulse);
+
+        pubsub->publish(Topic::Sample, 1);
+        pubsub->publish(Topic::Sample, 2);
+        pubsub->publish(Topic::Pulse, 3);
+        // the slow subscriber blocks its own inbox only, so the fast one gets its messages
+        const auto start = std::chrono::steady_clock::now();
+        while (fastSubscriber.getCallCount() < 2 && std::chrono::steady_clock::now() - start < std::chrono::seconds(1)) {
+            taskYIELD();
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(2, fastSubscriber.getCallCount(), "Fast subscriber not held up by the slow one");
+        TEST_ASSERT_EQUAL_MESSAGE(0, slowSubscriber.getCallCount(), "Slow subscriber still blocked");
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->isIdle(), "Bus not idle while the inbox has work");
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->flush(pdMS_TO_TICKS(50)), "Flush waits for the inbox");
+
+        slowSubscriber.release();
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->flush(pdMS_TO_TICKS(1000)), "Flush succeeds once the inbox is drained");
+        TEST_ASSERT_EQUAL_MESSAGE(3, slowSubscriber.getCallCount(), "Slow subscriber got all messages");
+
+        // a subscriber does not get its own messages back via the inbox either
+        pubsub->publish(Topic::Pulse, 4, &slowSubscriber);
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(3, slowSubscriber.getCallCount(), "Own message not delivered");
+
+        // a full inbox drops what doesn't fit rather than holding up the event loop
+        BlockingSubscriber stuckSubscriber;
+        pubsub->subscribe(&stuckSubscriber, Topic::Anomaly, options);
+        constexpr int kAnomalies = 12;
+        for (int i = 0; i < kAnomalies; i++) {
+            pubsub->publish(Topic::Anomaly, i);
+        }
+        pubsub->publish(Topic::Sample, 6);
+        // one anomaly may be in the callback, the inbox holds the depth
+        const uint32_t minDropped = kAnomalies - 1 - options.depth;
+        const auto fullStart = std::chrono::steady_clock::now();
+        while ((fastSubscriber.getCallCount() < 3 || pubsub->getDroppedCount(Topic::Anomaly) < minDropped) &&
+               std::chrono::steady_clock::now() - fullStart < std::chrono::seconds(1)) {
+            taskYIELD();
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(3, fastSubscriber.getCallCount(), "Event loop not held up by a full inbox");
+        TEST_ASSERT_GREATER_OR_EQUAL_MESSAGE(minDropped, pubsub->getDroppedCount(Topic::Anomaly), "What didn't fit was dropped");
+        stuckSubscriber.release();
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->flush(pdMS_TO_TICKS(1000)), "Drops don't hold up flush");
+        const auto dropped = pubsub->getDroppedCount(Topic::Anomaly);
+        TEST_ASSERT_EQUAL_MESSAGE(kAnomalies - dropped, stuckSubscriber.getCallCount(), "The rest was delivered");
+        pubsub->unsubscribe(&stuckSubscriber);
+
+        pubsub->unsubscribe(&slowSubscriber);
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->isIdle(), "Bus idle after the inbox stopped");
+        pubsub->publish(Topic::Sample, 5);
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(4, slowSubscriber.getCallCount(), "Unsubscribed subscriber gets nothing");
+        TEST_ASSERT_EQUAL_MESSAGE(4, fastSubscriber.getCallCount(), "Fast subscriber still subscribed");
+        pubsub->end();
+    }
+
+    class TypedTestSubscriber final : public pub_sub::TypedSubscriber<pub_sub::SampleTopic, pub_sub::PulseTopic, pub_sub::AnomalyTopic> {
+    public:
+        void onMessage(pub_sub::SampleTopic, const IntCoordinate& sample) override { m_sample = sample; m_sampleCount++; }
+        void onMessage(pub_sub::PulseTopic, const int& pulse) override { m_pulse = pulse; m_pulseCount++; }
+        void onMessage(pub_sub::AnomalyTopic, const int& anomaly) override { m_anomaly = anomaly; }
+        IntCoordinate m_sample;
+        int m_sampleCount = 0;
+        int m_pulse = 0;
+        int m_pulseCount = 0;
+        int m_anomaly = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_typed_topics) {
+        static_assert(TypedTestSubscriber::topics() == (pub_sub::toMask(Topic::Sample) | pub_sub::toMask(Topic::Pulse) | pub_sub::toMask(Topic::Anomaly)));
+        auto pubsub = PubSub::create();
+        TypedTestSubscriber subscriber;
+        pubsub->subscribe<pub_sub::SampleTopic>(&subscriber);
+        pubsub->subscribe<pub_sub::PulseTopic>(&subscriber);
+        pubsub->subscribe<pub_sub::AnomalyTopic>(&subscriber);
+
+        pubsub->publish<pub_sub::SampleTopic>(IntCoordinate{3, -4});
+        pubsub->publish<pub_sub::PulseTopic>(true);
+        pubsub->publish<pub_sub::AnomalyTopic>(17);
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(1, subscriber.m_sampleCount, "Sample handler called once");
+        TEST_ASSERT_EQUAL_MESSAGE(3, subscriber.m_sample.x, "Sample x correct");
+        TEST_ASSERT_EQUAL_MESSAGE(-4, subscriber.m_sample.y, "Sample y correct");
+        TEST_ASSERT_EQUAL_MESSAGE(1, subscriber.m_pulse, "Pulse handler got the value");
+        TEST_ASSERT_EQUAL_MESSAGE(17, subscriber.m_anomaly, "Anomaly handler got the value");
+
+        // an untyped publish with the wrong payload type is ignored instead of throwing
+        pubsub->setTraceMessages(true);
+        pubsub->publish(Topic::Pulse, 1.5f);
+        pubsub->waitForIdle();
+        pubsub->setTraceMessages(false);
+        TEST_ASSERT_EQUAL_MESSAGE(1, subscriber.m_pulseCount, "Wrongly typed pulse ignored");
+        pubsub->end();
+    }
+
+    struct PublisherContext {
+        PubSub* pubsub = nullptr;
+        std::atomic<bool> stop = false;
+        std::atomic<bool> done = false;
+        int published = 0;
+    };
+
+    void publisherTask(void* param) {
+        auto* context = static_cast<PublisherContext*>(param);
+        while (!context->stop.load()) {
+            context->pubsub->publish(Topic::Sample, context->published++);
+        }
+        context->done.store(true);
+        vTaskDelete(nullptr);
+    }
+
+    DEFINE_TEST_CASE(pubsub_subscribe_while_dispatching) {
+        auto pubsub = PubSub::create();
+        TestSubscriber steadySubscriber(1);
+        pubsub->subscribe(&steadySubscriber, Topic::Sample);
+
+        PublisherContext context;
+        context.pubsub = pubsub.get();
+        TaskHandle_t handle;
+        TEST_ASSERT_EQUAL_MESSAGE(pdPASS, xTaskCreate(publisherTask, "Publisher", 4096, &context, 3, &handle), "Publisher created");
+
+        // no need to quiesce the bus: a subscriber may be deleted right after unsubscribe returns
+        for (int i = 0; i < 200; i++) {
+            auto subscriber = std::make_unique<TestSubscriber>(2);
+            pubsub->subscribe(subscriber.get(), Topic::Sample);
+            taskYIELD();
+            pubsub->unsubscribe(subscriber.get());
+        }
+        context.stop.store(true);
+        while (!context.done.load()) {
+            vTaskDelay(1);
+        }
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(context.published, steadySubscriber.getCallCount(), "Steady subscriber got every message");
+
+        pubsub->end();
+    }
+
+    // holds up the event loop until released, and remembers the values and sequence numbers it got
+    class GateSubscriber final : public Subscriber {
+    public:
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            m_entered.store(true);
+            while (!m_release.load()) {
+                taskYIELD();
+            }
+            if (m_count < m_values.size()) {
+                m_values[m_count] = std::get<int>(payload);
+                m_sequences[m_count] = getSequence();
+                m_count++;
+            }
+        }
+        // publishes a message and waits until the event loop is stuck on it
+        void close(PubSub& pubsub, const int value) {
+            m_release.store(false);
+            m_entered.store(false);
+            pubsub.publish(Topic::Pulse, value);
+            while (!m_entered.load()) {
+                taskYIELD();
+            }
+        }
+        void open() { m_release.store(true); }
+        void clear() { m_count = 0; }
+        size_t count() const { return m_count; }
+        int value(const size_t index) const { return m_values[index]; }
+        uint32_t sequence(const size_t index) const { return m_sequences[index]; }
+    private:
+        std::atomic<bool> m_release = true;
+        std::atomic<bool> m_entered = false;
+        std::array<int, 64> m_values{};
+        std::array<uint32_t, 64> m_sequences{};
+        size_t m_count = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_backpressure) {
+        // the high priority lane takes 16 messages
+        constexpr int kLaneDepth = 16;
+        auto pubsub = PubSub::create();
+        GateSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Pulse);
+        TEST_ASSERT_EQUAL_MESSAGE(pub_sub::Backpressure::Block, pubsub->getBackpressure(Topic::Pulse).mode, "Blocks by default");
+
+        pubsub->setBackpressure(Topic::Pulse, {pub_sub::Backpressure::DropNewest});
+        subscriber.close(*pubsub, 0);
+        int rejected = 0;
+        for (int i = 1; i <= 40; i++) {
+            if (!pubsub->publish(Topic::Pulse, i)) rejected++;
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(40 - kLaneDepth, rejected, "Messages that didn't fit were rejected");
+        TEST_ASSERT_EQUAL_MESSAGE(40 - kLaneDepth, pubsub->getDroppedCount(Topic::Pulse), "Drops were counted");
+        subscriber.open();
+        pubsub->waitForIdle();
+        pubsub->publish(Topic::Pulse, 41);
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(kLaneDepth + 2, subscriber.count(), "The messages that fitted were delivered");
+        TEST_ASSERT_EQUAL_MESSAGE(kLaneDepth, subscriber.value(kLaneDepth), "The newest messages were dropped");
+        TEST_ASSERT_EQUAL_MESSAGE(kLaneDepth + 1, subscriber.sequence(kLaneDepth), "Sequence without gaps up to the drops");
+        TEST_ASSERT_EQUAL_MESSAGE(42, subscriber.sequence(kLaneDepth + 1), "Sequence gap shows the drops");
+
+        // a batch follows the policy of its topic as well, rather than waiting for room
+        subscriber.clear();
+        subscriber.close(*pubsub, 50);
+        std::array<pub_sub::Message, 40> batch{};
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i] = {nullptr, static_cast<int>(51 + i), Topic::Pulse};
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(kLaneDepth, pubsub->publishBatch(batch), "The batch reports how many fitted");
+        TEST_ASSERT_EQUAL_MESSAGE(2 * (40 - kLaneDepth), pubsub->getDroppedCount(Topic::Pulse), "Batch drops were counted");
+        subscriber.open();
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(kLaneDepth + 1, subscriber.count(), "The batch messages that fitted were delivered");
+        TEST_ASSERT_EQUAL_MESSAGE(50 + kLaneDepth, subscriber.value(kLaneDepth), "The newest batch messages were dropped");
+
+        pubsub->setBackpressure(Topic::Pulse, {pub_sub::Backpressure::Conflate});
+        subscriber.clear();
+        subscriber.close(*pubsub, 100);
+        for (int i = 101; i <= 110; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(pubsub->publish(Topic::Pulse, i), "Conflated publish never fails while the lane has room");
+        }
+        subscriber.open();
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(2, subscriber.count(), "Burst conflated into one message");
+        TEST_ASSERT_EQUAL_MESSAGE(110, subscriber.value(1), "Latest value delivered");
+        TEST_ASSERT_EQUAL_MESSAGE(2 * (40 - kLaneDepth) + 9, pubsub->getDroppedCount(Topic::Pulse), "Replaced values count as drops");
+
+        pubsub->setBackpressure(Topic::Pulse, {pub_sub::Backpressure::DropOldest});
+        subscriber.clear();
+        subscriber.close(*pubsub, 200);
+        for (int i = 201; i <= 220; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(pubsub->publish(Topic::Pulse, i), "Drop oldest always takes the new message");
+        }
+        subscriber.open();
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(kLaneDepth + 1, subscriber.count(), "A full lane of messages delivered");
+        TEST_ASSERT_EQUAL_MESSAGE(220 - kLaneDepth + 1, subscriber.value(1), "The oldest messages were dropped");
+        TEST_ASSERT_EQUAL_MESSAGE(220, subscriber.value(kLaneDepth), "The newest message was kept");
+
+        pubsub->setBackpressure(Topic::AllTopics, {pub_sub::Backpressure::Block, pdMS_TO_TICKS(20)});
+        TEST_ASSERT_EQUAL_MESSAGE(pdMS_TO_TICKS(20), pubsub->getBackpressure(Topic::Sample).timeout, "AllTopics sets every topic");
+        subscriber.close(*pubsub, 300);
+        for (int i = 301; i <= 300 + kLaneDepth; i++) {
+            pubsub->publish(Topic::Pulse, i);
+        }
+        const auto droppedBefore = pubsub->getDroppedCount(Topic::Pulse);
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->publish(Topic::Pulse, 400), "Blocking publish gives up after the timeout");
+        TEST_ASSERT_EQUAL_MESSAGE(droppedBefore + 1, pubsub->getDroppedCount(Topic::Pulse), "Timed out message counted as dropped");
+        subscriber.open();
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->flush(pdMS_TO_TICKS(1000)), "Dropped messages don't hold up flush");
+        pubsub->end();
+    }
+
+    DEFINE_TEST_CASE(pubsub_publish_invalid_topic) {
+        auto pubsub = PubSub::create(pub_sub::Transport::Queue, pub_sub::LoopMode::Manual);
+        RecordingSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::AllTopics);
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->publish(Topic::AllTopics, 1), "AllTopics can't be published to");
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->publishString(Topic::AllTopics, "all"), "Not as a string either");
+        const std::array<pub_sub::Message, 2> batch{{{nullptr, 2, Topic::AllTopics}, {nullptr, 3, Topic::Sample}}};
+        TEST_ASSERT_EQUAL_MESSAGE(1, pubsub->publishBatch(batch), "AllTopics isn't published");
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(1, subscriber.count(), "The batch skipped AllTopics");
+        TEST_ASSERT_EQUAL_MESSAGE(3, subscriber.value(0), "The rest of the batch delivered");
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->publish(Topic::None, 4), "None is a topic like the others");
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(2, subscriber.count(), "None delivered");
+        TEST_ASSERT_EQUAL_MESSAGE(4, subscriber.value(1), "With its payload");
+        pubsub->end();
+    }
+
+    DEFINE_TEST_CASE(pubsub_metrics) {
+        auto pubsub = PubSub::create();
+        TestSubscriber subscriber(1);
+        pubsub->subscribe(&subscriber, Topic::Sample);
+        for (int i = 0; i < 10; i++) {
+            pubsub->publish(Topic::Sample, i);
+        }
+        pubsub->publish(Topic::Pulse, 1);
+        pubsub->waitForIdle();
+
+        const auto metrics = pubsub->getMetrics();
+        const auto sample = static_cast<size_t>(Topic::Sample);
+        const auto low = static_cast<size_t>(pub_sub::Priority::Low);
+        TEST_ASSERT_EQUAL_MESSAGE(0, metrics.lanes[low].depth, "Lane empty after waitForIdle");
+        TEST_ASSERT_EQUAL_MESSAGE(0, metrics.topics[sample].dropped, "Nothing dropped");
+        if (!pub_sub::kMetricsEnabled) {
+            TEST_ASSERT_FALSE_MESSAGE(metrics.enabled, "Metrics compiled out");
+            pubsub->end();
+            return;
+        }
+        TEST_ASSERT_TRUE_MESSAGE(metrics.enabled, "Metrics enabled");
+        TEST_ASSERT_GREATER_OR_EQUAL_MESSAGE(1, metrics.lanes[low].highWater, "High-water mark recorded");
+        TEST_ASSERT_EQUAL_MESSAGE(10, metrics.topics[sample].published, "Publishes counted");
+        TEST_ASSERT_EQUAL_MESSAGE(10, metrics.topics[sample].dispatched, "Dispatches counted");
+        TEST_ASSERT_EQUAL_MESSAGE(0, metrics.topics[static_cast<size_t>(Topic::Pulse)].published, "Publish without subscribers not counted");
+
+        uint32_t latencyCount = 0;
+        for (const auto count : metrics.dispatchLatencyMicros) latencyCount += count;
+        TEST_ASSERT_EQUAL_MESSAGE(10, latencyCount, "Every dispatch in the latency histogram");
+
+        TEST_ASSERT_EQUAL_MESSAGE(1, metrics.subscriberCount, "One subscriber timed");
+        TEST_ASSERT_EQUAL_MESSAGE(&subscriber, metrics.subscribers[0].subscriber, "The right subscriber timed");
+        uint32_t callbackCount = 0;
+        for (const auto count : metrics.subscribers[0].callbackMicros) callbackCount += count;
+        TEST_ASSERT_EQUAL_MESSAGE(10, callbackCount, "Every callback in the duration histogram");
+        pubsub->end();
+    }
+
+    // remembers the task it was called on, and can unsubscribe itself from its callback
+    class InlineSubscriber final : public Subscriber {
+    public:
+        explicit InlineSubscriber(PubSub& pubsub) : m_pubsub(pubsub) {}
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            Subscriber::subscriberCallback(topic, payload);
+            m_task = xTaskGetCurrentTaskHandle();
+            m_callCount++;
+            if (m_unsubscribe) {
+                m_pubsub.unsubscribe(this);
+            }
+        }
+        void unsubscribeOnNextCall() { m_unsubscribe = true; }
+        TaskHandle_t task() const { return m_task; }
+        unsigned int getCallCount() const { return m_callCount.load(); }
+    private:
+        PubSub& m_pubsub;
+        TaskHandle_t m_task = nullptr;
+        bool m_unsubscribe = false;
+        std::atomic<unsigned int> m_callCount = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_inline_dispatch) {
+        auto pubsub = PubSub::create();
+        pubsub->setDispatch(Topic::Sample, pub_sub::Dispatch::Inline);
+        TEST_ASSERT_EQUAL_MESSAGE(pub_sub::Dispatch::Inline, pubsub->getDispatch(Topic::Sample), "Sample is inline");
+        TEST_ASSERT_EQUAL_MESSAGE(pub_sub::Dispatch::Queued, pubsub->getDispatch(Topic::Pulse), "Pulse still queued");
+
+        InlineSubscriber subscriber(*pubsub);
+        TestSubscriber queuedSubscriber(1);
+        pubsub->subscribe(&subscriber, Topic::Sample);
+        pubsub->subscribe(&queuedSubscriber, Topic::Pulse);
+
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->publish(Topic::Sample, 1), "Inline publish succeeds");
+        TEST_ASSERT_EQUAL_MESSAGE(1, subscriber.getCallCount(), "Delivered before publish returned");
+        TEST_ASSERT_TRUE_MESSAGE(subscriber.task() == xTaskGetCurrentTaskHandle(), "Delivered on the task of the publisher");
+        TEST_ASSERT_EQUAL_MESSAGE(1, subscriber.getSequence(), "Inline messages get sequence numbers too");
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->isIdle(), "Nothing went through the lanes");
+
+        // an inline message overtakes the queued ones
+        pubsub->publish(Topic::Pulse, 2);
+        pubsub->publish(Topic::Sample, 3);
+        TEST_ASSERT_EQUAL_MESSAGE(3, std::get<int>(subscriber.getPayload()), "Inline message delivered right away");
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(1, queuedSubscriber.getCallCount(), "Queued message delivered by the event loop");
+
+        // unsubscribing from an inline callback doesn't wait for itself
+        subscriber.unsubscribeOnNextCall();
+        pubsub->publish(Topic::Sample, 4);
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->hasSubscribers(Topic::Sample), "Subscriber unsubscribed itself");
+        pubsub->publish(Topic::Sample, 5);
+        TEST_ASSERT_EQUAL_MESSAGE(3, subscriber.getCallCount(), "No messages after unsubscribing");
+
+        pubsub->setDispatch(Topic::AllTopics, pub_sub::Dispatch::Queued);
+        TEST_ASSERT_EQUAL_MESSAGE(pub_sub::Dispatch::Queued, pubsub->getDispatch(Topic::Sample), "AllTopics sets every topic");
+        pubsub->end();
+    }
+
+    // waits for the gate to open, then keeps a copy of the last string it got
+    class StringSubscriber final : public Subscriber {
+    public:
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            while (!m_open.load()) {
+                taskYIELD();
+            }
+            strncpy(m_text, std::get<const char*>(payload), sizeof(m_text) - 1);
+            m_callCount++;
+        }
+        void close() { m_open.store(false); }
+        void open() { m_open.store(true); }
+        const char* text() const { return m_text; }
+        unsigned int getCallCount() const { return m_callCount.load(); }
+    private:
+        std::atomic<bool> m_open = true;
+        char m_text[100] = {0};
+        std::atomic<unsigned int> m_callCount = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_string_arena) {
+        auto pubsub = PubSub::create();
+        StringSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Anomaly);
+
+        char buffer[100];
+        snprintf(buffer, sizeof(buffer), "status %d", 42);
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->publishString(Topic::Anomaly, buffer), "String published");
+        strcpy(buffer, "overwritten");
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_STRING_MESSAGE("status 42", subscriber.text(), "Subscriber got the copy, not the reused buffer");
+        TEST_ASSERT_EQUAL_MESSAGE(0, pubsub->stringsInUse(), "Slot recycled after dispatch");
+
+        subscriber.close();
+        for (int i = 0; i < 3; i++) {
+            pubsub->publishString(Topic::Anomaly, "same");
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(1, pubsub->stringsInUse(), "Identical strings share a slot");
+        int published = 0;
+        for (int i = 0; published < CONFIG_PUB_SUB_STRING_SLOTS + 1; i++) {
+            snprintf(buffer, sizeof(buffer), "message %d", i);
+            if (!pubsub->publishString(Topic::Anomaly, buffer)) break;
+            published++;
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(CONFIG_PUB_SUB_STRING_SLOTS - 1, published, "Publish fails once the arena is full");
+        TEST_ASSERT_EQUAL_MESSAGE(1, pubsub->getDroppedCount(Topic::Anomaly), "The string that didn't fit counts as dropped");
+        subscriber.open();
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(1 + 3 + CONFIG_PUB_SUB_STRING_SLOTS - 1, subscriber.getCallCount(), "All strings that fit were delivered");
+        TEST_ASSERT_EQUAL_MESSAGE(0, pubsub->stringsInUse(), "All slots recycled");
+
+        std::string longText(200, 'x');
+        pubsub->publishString(Topic::Anomaly, longText.c_str());
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(CONFIG_PUB_SUB_STRING_LENGTH - 1, strlen(subscriber.text()), "Long strings are cut off");
+        pubsub->end();
+    }
+
+    struct TimedSample {
+        int16_t x;
+        int16_t y;
+        int16_t z;
+        uint32_t timestamp;
+    };
+
+    // checks the samples in the block and can hold on to the block after the callback
+    class BlockSubscriber final : public Subscriber {
+    public:
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            const auto& block = std::get<pub_sub::BlockRef>(payload);
+            const auto samples = block.as<TimedSample>();
+            m_data = samples.data();
+            m_count = samples.size();
+            m_ok = true;
+            for (size_t i = 0; i < samples.size(); i++) {
+                m_ok = m_ok && samples[i].z == static_cast<int16_t>(-i) && samples[i].timestamp == 1000 + i;
+            }
+            if (m_keep) {
+                block.retain();
+                m_kept = block;
+            }
+            m_callCount++;
+        }
+        void keepNext() { m_keep = true; }
+        void letGo() { m_kept.release(); m_kept = {}; }
+        const void* data() const { return m_data; }
+        size_t count() const { return m_count; }
+        bool ok() const { return m_ok; }
+        unsigned int getCallCount() const { return m_callCount.load(); }
+    private:
+        const void* m_data = nullptr;
+        size_t m_count = 0;
+        bool m_ok = false;
+        bool m_keep = false;
+        pub_sub::BlockRef m_kept;
+        std::atomic<unsigned int> m_callCount = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_loaned_blocks) {
+        auto pubsub = PubSub::create();
+        BlockSubscriber subscriber;
+        BlockSubscriber inboxSubscriber;
+        pubsub->subscribe(&subscriber, Topic::Sample);
+        pubsub->subscribe(&inboxSubscriber, Topic::Sample, pub_sub::InboxOptions{});
+
+        auto loan = pubsub->loan();
+        TEST_ASSERT_TRUE_MESSAGE(loan.isValid(), "Block loaned");
+        auto samples = loan.as<TimedSample>();
+        TEST_ASSERT_GREATER_OR_EQUAL_MESSAGE(32, samples.size(), "Room for 32 samples");
+        for (size_t i = 0; i < 32; i++) {
+            samples[i] = {static_cast<int16_t>(i), static_cast<int16_t>(2 * i), static_cast<int16_t>(-i), static_cast<uint32_t>(1000 + i)};
+        }
+        loan.setCount<TimedSample>(32);
+        const void* data = samples.data();
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->publishBlock(Topic::Sample, std::move(loan)), "Block published");
+        pubsub->waitForIdle();
+        TEST_ASSERT_TRUE_MESSAGE(subscriber.data() == data, "Subscriber reads the block in place");
+        TEST_ASSERT_EQUAL_MESSAGE(32, subscriber.count(), "Subscriber sees the samples that were filled in");
+        TEST_ASSERT_TRUE_MESSAGE(subscriber.ok(), "Samples arrive intact, z and timestamp included");
+        TEST_ASSERT_TRUE_MESSAGE(inboxSubscriber.ok() && inboxSubscriber.data() == data, "Inbox subscriber reads the same block");
+        TEST_ASSERT_EQUAL_MESSAGE(0, pubsub->blocksInUse(), "Block back in the pool after the last reader");
+
+        subscriber.keepNext();
+        {
+            auto next = pubsub->loan();
+            next.setCount<TimedSample>(0);
+            pubsub->publishBlock(Topic::Sample, std::move(next));
+        }
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(1, pubsub->blocksInUse(), "A retained block stays out of the pool");
+        subscriber.letGo();
+        TEST_ASSERT_EQUAL_MESSAGE(0, pubsub->blocksInUse(), "Released once the subscriber lets go");
+
+        {
+            std::array<pub_sub::Loan, CONFIG_PUB_SUB_BLOCK_COUNT> loans;
+            for (auto& held : loans) {
+                held = pubsub->loan();
+            }
+            TEST_ASSERT_FALSE_MESSAGE(pubsub->loan().isValid(), "No loan from an exhausted pool");
+            TEST_ASSERT_FALSE_MESSAGE(pubsub->publishBlock(Topic::Sample, pubsub->loan()), "An invalid loan isn't published");
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(0, pubsub->blocksInUse(), "Unpublished loans go back when they are destroyed");
+        pubsub->end();
+    }
+
+    // keeps the records in memory rather than in a file, so the test also runs on the device
+    class MemorySink final : public pub_sub::RecordSink {
+    public:
+        bool write(const std::span<const pub_sub::MessageRecord> records) override {
+            m_records.insert(m_records.end(), records.begin(), records.end());
+            m_writes++;
+            return true;
+        }
+        const std::vector<pub_sub::MessageRecord>& records() const { return m_records; }
+        size_t writes() const { return m_writes; }
+    private:
+        std::vector<pub_sub::MessageRecord> m_records;
+        size_t m_writes = 0;
+    };
+
+    // keeps every payload in the order of arrival, to compare a replay with the original run
+    class PayloadLog final : public Subscriber {
+    public:
+        void subscriberCallback(Topic, const Payload& payload) override { m_payloads.push_back(payload); }
+        const std::vector<Payload>& payloads() const { return m_payloads; }
+    private:
+        std::vector<Payload> m_payloads;
+    };
+
+    DEFINE_TEST_CASE(pubsub_record_replay) {
+        using pub_sub::MessageRecord;
+        using pub_sub::PayloadKind;
+        constexpr int kSamples = 40;
+        MemorySink sink;
+        {
+            auto pubsub = PubSub::create();
+            pub_sub::MessageRecorder<64> recorder;
+            TestSubscriber subscriber(1);
+            pubsub->subscribe(&subscriber, Topic::AllTopics);
+            pubsub->setTap(&recorder);
+            for (int i = 0; i < kSamples; i++) {
+                pubsub->publish(Topic::Sample, IntCoordinate(static_cast<int16_t>(i), static_cast<int16_t>(-i)));
+            }
+            pubsub->publish(Topic::Drifted, 2.5f, &subscriber);
+            pubsub->publishString(Topic::NoFit, "not in the log");
+            pubsub->waitForIdle();
+            pubsub->setTap(nullptr);
+            TEST_ASSERT_EQUAL_MESSAGE(kSamples + 2, recorder.flush(sink), "Every dispatched message recorded");
+            TEST_ASSERT_EQUAL_MESSAGE(0, recorder.getDroppedCount(), "Nothing dropped");
+            TEST_ASSERT_EQUAL_MESSAGE(2, sink.writes(), "Written in chunks");
+            // in the order of dispatch, which depends on when the event loop got to the lanes, so look them up by topic
+            const auto& records = sink.records();
+            const auto drifted = std::ranges::find(records, Topic::Drifted, &MessageRecord::topic);
+            TEST_ASSERT_TRUE_MESSAGE(drifted != records.end(), "Drifted recorded");
+            TEST_ASSERT_EQUAL_MESSAGE(PayloadKind::Float, drifted->kind, "Float recorded");
+            TEST_ASSERT_TRUE_MESSAGE(recorder.getSource(drifted->source) == &subscriber, "Source id maps back to the source");
+            const auto noFit = std::ranges::find(records, Topic::NoFit, &MessageRecord::topic);
+            TEST_ASSERT_TRUE_MESSAGE(noFit != records.end(), "String recorded");
+            TEST_ASSERT_EQUAL_MESSAGE(PayloadKind::OutOfLine, noFit->kind, "String recorded without content");
+            TEST_ASSERT_EQUAL_MESSAGE(kSamples, std::ranges::count(records, Topic::Sample, &MessageRecord::topic), "Every sample recorded");
+            pubsub->end();
+        }
+
+        pub_sub::ReplayStats stats;
+        {
+            auto pubsub = PubSub::create();
+            TestSubscriber subscriber(2);
+            pubsub->subscribe(&subscriber, Topic::Sample);
+            pub_sub::MessageReplayer replayer(pubsub, pub_sub::ReplayTiming::AsFastAsPossible);
+            replayer.replay(sink.records());
+            stats = replayer.finish();
+            TEST_ASSERT_EQUAL_MESSAGE(kSamples + 1, stats.replayed, "Values replayed");
+            TEST_ASSERT_EQUAL_MESSAGE(1, stats.skipped, "String skipped");
+            TEST_ASSERT_TRUE_MESSAGE(stats.messagesPerSecond > 0, "Throughput reported");
+            TEST_ASSERT_EQUAL_MESSAGE(kSamples, subscriber.getCallCount(), "Samples arrived");
+            TEST_ASSERT_EQUAL_STRING_MESSAGE("39, -39", subscriber.getBuffer(), "Last sample replayed intact");
+
+            // ten ticks apart in the recording, so also ten ticks apart in the replay
+            const MessageRecord timed[] = {
+                {1000, 1, Topic::Sample, PayloadKind::Coordinate, 0},
+                {1010, 2, Topic::Sample, PayloadKind::Coordinate, 0}
+            };
+            pub_sub::MessageReplayer timedReplayer(pubsub, pub_sub::ReplayTiming::Original);
+            timedReplayer.replay(timed);
+            stats = timedReplayer.finish();
+            TEST_ASSERT_EQUAL_MESSAGE(2, stats.replayed, "Timed records replayed");
+            TEST_ASSERT_GREATER_OR_EQUAL_MESSAGE(9 * portTICK_PERIOD_MS * 1000, stats.elapsedMicros, "Original timing kept");
+            pubsub->end();
+        }
+
+        // The round trip as a consumer sees it, the way a replay runs on the host: into a Manual bus, dispatched on this task.
+        // Every value arrives as it was published, in the same order.
+        auto manualBus = PubSub::create(pub_sub::Transport::RingBuffer, pub_sub::LoopMode::Manual);
+        PayloadLog samples;
+        PayloadLog drifts;
+        manualBus->subscribe(&samples, Topic::Sample);
+        manualBus->subscribe(&drifts, Topic::Drifted);
+        pub_sub::MessageReplayer manualReplayer(manualBus, pub_sub::ReplayTiming::AsFastAsPossible);
+        manualReplayer.replay(sink.records());
+        stats = manualReplayer.finish();
+        TEST_ASSERT_EQUAL_MESSAGE(kSamples + 1, stats.replayed, "Values replayed into the Manual bus");
+        TEST_ASSERT_TRUE_MESSAGE(manualBus->isIdle(), "Finish pumped everything");
+        TEST_ASSERT_EQUAL_MESSAGE(kSamples, samples.payloads().size(), "Every sample arrived");
+        for (int i = 0; i < kSamples; i++) {
+            const auto* sample = std::get_if<IntCoordinate>(&samples.payloads()[i]);
+            TEST_ASSERT_NOT_NULL_MESSAGE(sample, "Replayed as a coordinate");
+            TEST_ASSERT_EQUAL_MESSAGE(i, sample->x, "x replayed in order");
+            TEST_ASSERT_EQUAL_MESSAGE(-i, sample->y, "y replayed in order");
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(1, drifts.payloads().size(), "The float arrived");
+        TEST_ASSERT_EQUAL_FLOAT_MESSAGE(2.5f, std::get<float>(drifts.payloads().front()), "Float replayed intact");
+        manualBus->end();
+    }
+
+    DEFINE_TEST_CASE(pubsub_manual_pump) {
+        // without locks, the ring buffer is the cheapest transport for a single task
+        auto pubsub = PubSub::create(pub_sub::Transport::RingBuffer, pub_sub::LoopMode::Manual);
+        InlineSubscriber subscriber(*pubsub);
+        pubsub->subscribe(&subscriber, Topic::Sample);
+        for (int i = 0; i < 3; i++) {
+            pubsub->publish(Topic::Sample, i);
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(0, subscriber.getCallCount(), "Nothing dispatched without a pump");
+        TEST_ASSERT_EQUAL_MESSAGE(1, pubsub->pump(1), "Pumped one");
+        TEST_ASSERT_EQUAL_MESSAGE(0, std::get<int>(subscriber.getPayload()), "Oldest first");
+        TEST_ASSERT_TRUE_MESSAGE(subscriber.task() == xTaskGetCurrentTaskHandle(), "Dispatched on the task that pumps");
+        TEST_ASSERT_EQUAL_MESSAGE(2, pubsub->pumpUntilIdle(), "Pumped the rest");
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->isIdle(), "Idle after pumping");
+
+        // far more than the lanes hold: the publisher makes room itself
+        constexpr int kSamples = 200000;
+        const auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < kSamples; i++) {
+            pubsub->publish(Topic::Sample, IntCoordinate(static_cast<int16_t>(i), 0));
+        }
+        pubsub->waitForIdle();
+        const auto elapsedMicros = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+        printf("Manual pump: %d samples in %.0f us (%.0f msg/s)\n", kSamples, elapsedMicros, kSamples * 1e6 / elapsedMicros);
+        TEST_ASSERT_EQUAL_MESSAGE(3 + kSamples, subscriber.getCallCount(), "Every sample delivered");
+
+        std::array<pub_sub::Message, 300> batch{};
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i] = {nullptr, static_cast<int>(i), Topic::Sample};
+        }
+        // a batch larger than a lane gets through too
+        pubsub->publishBatch(batch);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(3 + kSamples + batch.size(), subscriber.getCallCount(), "Every batch message delivered");
+
+        IdleWaitingSubscriber waiting(*pubsub);
+        pubsub->subscribe(&waiting, Topic::Pulse);
+        pubsub->publish(Topic::Pulse, 1);
+        TEST_ASSERT_EQUAL_MESSAGE(1, pubsub->pumpUntilIdle(), "The pump isn't stuck in the callback");
+        TEST_ASSERT_EQUAL_MESSAGE(0, waiting.getSucceeded(), "Waiting in a callback during a pump fails");
+        pubsub->end();
+    }
+
+    // publishes a number of pulses from its callback for every sample, and remembers the order in which everything came in
+    class EchoSubscriber final : public Subscriber {
+    public:
+        EchoSubscriber(PubSub& pubsub, const int echoes) : m_pubsub(pubsub), m_echoes(echoes) {}
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            if (static_cast<size_t>(m_count) < m_topics.size()) {
+                m_topics[m_count] = topic;
+            }
+            m_count++;
+            if (topic != Topic::Sample) return;
+            for (int i = 0; i < m_echoes; i++) {
+                if (!m_pubsub.publish(Topic::Pulse, i)) m_failed++;
+            }
+        }
+        int count() const { return m_count; }
+        int failed() const { return m_failed; }
+        Topic topic(const size_t index) const { return m_topics[index]; }
+    private:
+        PubSub& m_pubsub;
+        const int m_echoes;
+        std::array<Topic, 32> m_topics{};
+        int m_count = 0;
+        int m_failed = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_deferred_publish) {
+        auto pubsub = PubSub::create();
+        // far more pulses than the high lane holds: the event loop would wait for itself if they went through the lane
+        constexpr int kEchoes = 5;
+        constexpr int kSamples = 50;
+        EchoSubscriber subscriber(*pubsub, kEchoes);
+        pubsub->subscribe(&subscriber, Topic::Sample);
+        pubsub->subscribe(&subscriber, Topic::Pulse);
+        for (int i = 0; i < kSamples; i++) {
+            pubsub->publish(Topic::Sample, i);
+        }
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(kSamples * (kEchoes + 1), subscriber.count(), "Every sample and pulse delivered");
+        TEST_ASSERT_EQUAL_MESSAGE(0, subscriber.failed(), "No pulse dropped");
+        for (size_t i = 0; i < 2 * (kEchoes + 1); i++) {
+            const auto expected = i % (kEchoes + 1) == 0 ? Topic::Sample : Topic::Pulse;
+            TEST_ASSERT_EQUAL_MESSAGE(expected, subscriber.topic(i), "Pulses come right after the sample that caused them");
+        }
+
+        // when the deferred queue is full, the lane takes what it can and the rest is dropped
+        constexpr int kRoom = CONFIG_PUB_SUB_DEFERRED_DEPTH + CONFIG_PUB_SUB_HIGH_LANE_DEPTH;
+        EchoSubscriber flooder(*pubsub, kRoom + 2);
+        pubsub->unsubscribe(&subscriber);
+        pubsub->subscribe(&flooder, Topic::Sample);
+        pubsub->subscribe(&flooder, Topic::Pulse);
+        pubsub->publish(Topic::Sample, 0);
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(2, flooder.failed(), "Pulses beyond the room were dropped");
+        TEST_ASSERT_EQUAL_MESSAGE(2, pubsub->getDroppedCount(Topic::Pulse), "Drops counted");
+        TEST_ASSERT_EQUAL_MESSAGE(1 + kRoom, flooder.count(), "The rest delivered");
+        pubsub->end();
+    }
+
+    void coordinatePublisherTask(void* param) {
+        auto* context = static_cast<PublisherContext*>(param);
+        while (!context->stop.load()) {
+            const auto value = static_cast<int16_t>(context->published++ % INT16_MAX);
+            context->pubsub->publish(Topic::Sample, IntCoordinate(value, static_cast<int16_t>(-value)));
+        }
+        context->done.store(true);
+        vTaskDelete(nullptr);
+    }
+
+    DEFINE_TEST_CASE(pubsub_retained_topics) {
+        auto pubsub = PubSub::create();
+        pubsub->publish(Topic::Pulse, 4);
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->latest(Topic::Pulse).has_value(), "Nothing kept if the topic isn't retained");
+
+        pubsub->setRetained(Topic::Pulse, true);
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->isRetained(Topic::Pulse), "Pulse is retained");
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->isRetained(Topic::Sample), "Sample isn't");
+        pubsub->publish(Topic::Pulse, 5);
+        TEST_ASSERT_EQUAL_MESSAGE(5, pubsub->latest<pub_sub::PulseTopic>().value_or(0), "Kept without subscribers");
+        pubsub->publish(Topic::Pulse, 1.5f);
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->latest<pub_sub::PulseTopic>().has_value(), "Nothing rather than an exception for a value of another type");
+        pubsub->publish(Topic::Pulse, 5);
+
+        RecordingSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Pulse);
+        TEST_ASSERT_EQUAL_MESSAGE(1, subscriber.count(), "A new subscriber gets the retained value right away");
+        TEST_ASSERT_EQUAL_MESSAGE(5, subscriber.value(0), "Retained value delivered");
+        pubsub->publish(Topic::Pulse, 6);
+        pubsub->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(2, subscriber.count(), "Then the new values");
+        TEST_ASSERT_EQUAL_MESSAGE(6, std::get<int>(*pubsub->latest(Topic::Pulse)), "Latest value replaced");
+
+        // readers on other tasks never see half a value
+        pubsub->setRetained(Topic::Sample, true);
+        PublisherContext context;
+        context.pubsub = pubsub.get();
+        TaskHandle_t handle;
+        TEST_ASSERT_EQUAL_MESSAGE(pdPASS, xTaskCreate(coordinatePublisherTask, "Publisher", 4096, &context, 3, &handle), "Publisher created");
+        int reads = 0;
+        while (reads < 100000) {
+            if (const auto latest = pubsub->latest<pub_sub::SampleTopic>()) {
+                TEST_ASSERT_EQUAL_MESSAGE(latest->x, -latest->y, "Consistent value");
+                reads++;
+            }
+        }
+        context.stop.store(true);
+        while (!context.done.load()) {
+            vTaskDelay(1);
+        }
+        TEST_ASSERT_EQUAL_MESSAGE((context.published - 1) % INT16_MAX, pubsub->latest<pub_sub::SampleTopic>()->x, "Last published value kept");
+
+        pubsub->setRetained(Topic::AllTopics, false);
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->latest(Topic::Pulse).has_value(), "Value forgotten when no longer retained");
+
+        // strings too, with the arena slot held by the retained value only
+        pubsub->setRetained(Topic::Drifted, true);
+        pubsub->publishString(Topic::Drifted, "drifted");
+        const auto text = pubsub->latest(Topic::Drifted);
+        TEST_ASSERT_TRUE_MESSAGE(text.has_value(), "String kept without subscribers");
+        TEST_ASSERT_EQUAL_STRING_MESSAGE("drifted", std::get<const char*>(*text), "Retained string");
+        TEST_ASSERT_EQUAL_MESSAGE(1, pubsub->stringsInUse(), "Held by the retained value");
+        pubsub->setRetained(Topic::Drifted, false);
+        TEST_ASSERT_EQUAL_MESSAGE(0, pubsub->stringsInUse(), "Freed when no longer retained");
+        pubsub->end();
+    }
+
+    DEFINE_TEST_CASE(pubsub_publish_from_isr) {
+        auto pubsub = PubSub::create(pub_sub::Transport::Queue, pub_sub::LoopMode::Manual);
+        RecordingSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Pulse);
+        BaseType_t woken = pdFALSE;
+        for (int i = 0; i < CONFIG_PUB_SUB_ISR_QUEUE_DEPTH; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(pubsub->publishFromIsr(Topic::Pulse, i, &woken), "Room in the interrupt queue");
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(pdTRUE, woken, "Asks for a yield");
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->publishFromIsr(Topic::Pulse, -1, &woken), "Full queue drops instead of waiting");
+        TEST_ASSERT_EQUAL_MESSAGE(1, pubsub->getDroppedCount(Topic::Pulse), "Drop counted");
+
+        // the interrupt queue goes before the lanes
+        pubsub->publish(Topic::Pulse, 100);
+        TEST_ASSERT_EQUAL_MESSAGE(CONFIG_PUB_SUB_ISR_QUEUE_DEPTH + 1, pubsub->pumpUntilIdle(), "Everything dispatched");
+        for (int i = 0; i < CONFIG_PUB_SUB_ISR_QUEUE_DEPTH; i++) {
+            TEST_ASSERT_EQUAL_MESSAGE(i, subscriber.value(i), "Interrupt messages in order");
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(100, subscriber.value(CONFIG_PUB_SUB_ISR_QUEUE_DEPTH), "Then the lanes");
+
+        // the event loop keeps the value of a retained topic, also without subscribers
+        pubsub->setRetained(Topic::Sample, true);
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->publishFromIsr(Topic::Sample, IntCoordinate(3, 4)), "Published retained value");
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(3, pubsub->latest<pub_sub::SampleTopic>()->x, "Retained value kept");
+        pubsub->end();
+        pubsub.reset();
+
+        // in Task mode, the interrupt wakes the event loop
+        auto taskBus = PubSub::create();
+        RecordingSubscriber taskSubscriber;
+        taskBus->subscribe(&taskSubscriber, Topic::Pulse);
+        taskBus->publishFromIsr(Topic::Pulse, 7);
+        taskBus->waitForIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(1, taskSubscriber.count(), "Dispatched by the event loop");
+        taskBus->end();
+    }
+
+    DEFINE_TEST_CASE(pubsub_shared_executor) {
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+        // only one bus can exist then
+        constexpr size_t kBuses = 1;
+#else
+        constexpr size_t kBuses = 4;
+#endif
+        constexpr int kMessages = 500;
+        pub_sub::Executor executor(2);
+        TEST_ASSERT_EQUAL_MESSAGE(2, executor.getTaskCount(), "Two dispatcher tasks");
+        std::array<std::shared_ptr<PubSub>, kBuses> buses;
+        std::array<std::unique_ptr<EchoSubscriber>, kBuses> subscribers;
+        for (size_t bus = 0; bus < kBuses; bus++) {
+            buses[bus] = PubSub::create(pub_sub::Transport::Queue, executor);
+            TEST_ASSERT_EQUAL_MESSAGE(pub_sub::LoopMode::Shared, buses[bus]->getLoopMode(), "Shared loop mode");
+            subscribers[bus] = std::make_unique<EchoSubscriber>(*buses[bus], 1);
+            buses[bus]->subscribe(subscribers[bus].get(), Topic::Sample);
+            buses[bus]->subscribe(subscribers[bus].get(), Topic::Pulse);
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(kBuses, executor.getBusCount(), "Buses attached");
+
+        // more than a lane holds, interleaved over the buses, so publishers wait for the executor to make room
+        for (int i = 0; i < kMessages; i++) {
+            for (size_t bus = 0; bus < kBuses; bus++) {
+                buses[bus]->publish(Topic::Sample, i);
+            }
+        }
+        for (size_t bus = 0; bus < kBuses; bus++) {
+            buses[bus]->waitForIdle();
+            // every sample comes with the pulse its callback published
+            TEST_ASSERT_EQUAL_MESSAGE(2 * kMessages, subscribers[bus]->count(), "Every message dispatched");
+            TEST_ASSERT_EQUAL_MESSAGE(0, subscribers[bus]->failed(), "Nothing dropped");
+            TEST_ASSERT_TRUE_MESSAGE(buses[bus]->publishFromIsr(Topic::Pulse, 1), "Interrupts schedule the bus too");
+            buses[bus]->waitForIdle();
+            TEST_ASSERT_EQUAL_MESSAGE(2 * kMessages + 1, subscribers[bus]->count(), "Interrupt message dispatched");
+        }
+        for (auto& bus : buses) {
+            bus->end();
+            bus.reset();
+        }
+        TEST_ASSERT_EQUAL_MESSAGE(0, executor.getBusCount(), "Buses detached");
+    }
+
+    // publishes a pulse with its run count on every run
+    class PulseJob final : public pub_sub::TimerJob {
+    public:
+        explicit PulseJob(PubSub& pubsub) : m_pubsub(pubsub) {}
+        void onTimer(const int64_t scheduledMicros) override {
+            m_lastScheduled = scheduledMicros;
+            m_pubsub.publish(Topic::Pulse, ++m_runs);
+        }
+        int runs() const { return m_runs; }
+        int64_t lastScheduled() const { return m_lastScheduled; }
+    private:
+        PubSub& m_pubsub;
+        std::atomic<int> m_runs = 0;
+        int64_t m_lastScheduled = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_timers) {
+        auto pubsub = PubSub::create(pub_sub::Transport::Queue, pub_sub::LoopMode::Manual);
+        pub_sub::VirtualClock clock(1000000);
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->setClock(clock), "Virtual clock accepted in Manual mode");
+        RecordingSubscriber subscriber;
+        pubsub->subscribe(&subscriber, Topic::Pulse);
+        PulseJob job(*pubsub);
+        PulseJob slowJob(*pubsub);
+        const auto id = pubsub->addTimer(job, 10000, 5000);
+        const auto slowId = pubsub->addTimer(slowJob, 1000000, 1000000);
+        TEST_ASSERT_NOT_EQUAL_MESSAGE(pub_sub::kNoTimer, id, "Timer added");
+
+        clock.advance(4999);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(0, job.runs(), "Not due before its phase");
+        clock.advance(1);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(1, job.runs(), "Due after its phase");
+        TEST_ASSERT_EQUAL_MESSAGE(1, subscriber.count(), "What the job published was dispatched");
+        clock.advance(10000);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(2, job.runs(), "Due after a period");
+        TEST_ASSERT_EQUAL_MESSAGE(1015000, job.lastScheduled(), "On schedule");
+
+        // 25 ms late: the two periods in between are skipped, and the schedule stays the same
+        clock.advance(35000);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(3, job.runs(), "No burst to catch up");
+        auto stats = pubsub->getTimerStats(id);
+        TEST_ASSERT_EQUAL_MESSAGE(3, stats.runs, "Runs counted");
+        TEST_ASSERT_EQUAL_MESSAGE(2, stats.missed, "Missed periods counted");
+        TEST_ASSERT_EQUAL_MESSAGE(25000, stats.maxLatenessMicros, "Lateness measured");
+        clock.advance(5000);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(4, job.runs(), "Back on schedule");
+        TEST_ASSERT_EQUAL_MESSAGE(1055000, job.lastScheduled(), "Schedule didn't drift");
+        TEST_ASSERT_EQUAL_MESSAGE(0, slowJob.runs(), "The other job shares the wheel but isn't due");
+
+        // more than a turn of the wheel at once
+        clock.advance(1000000);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(1, slowJob.runs(), "Slow job due");
+        pubsub->removeTimer(id);
+        pubsub->removeTimer(slowId);
+        clock.advance(1000000);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(5, job.runs(), "No runs after removal");
+        pubsub->end();
+        pubsub.reset();
+
+        // the event loop sleeps until the next timer is due
+        auto taskBus = PubSub::create();
+        TEST_ASSERT_FALSE_MESSAGE(taskBus->setClock(clock), "Nothing would wake the event loop when a virtual clock moves");
+        PulseJob taskJob(*taskBus);
+        const auto taskId = taskBus->addTimer(taskJob, 20000);
+        std::this_thread::sleep_for(std::chrono::milliseconds(110));
+        taskBus->removeTimer(taskId);
+        TEST_ASSERT_GREATER_OR_EQUAL_MESSAGE(3, taskJob.runs(), "Ran on the event loop");
+        TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(6, taskJob.runs(), "Not more often than its period");
+        taskBus->end();
+        taskBus.reset();
+
+        // the executor doesn't keep time, so a shared bus has no timers
+        pub_sub::Executor executor(1);
+        auto sharedBus = PubSub::create(pub_sub::Transport::Queue, executor);
+        PulseJob sharedJob(*sharedBus);
+        TEST_ASSERT_EQUAL_MESSAGE(pub_sub::kNoTimer, sharedBus->addTimer(sharedJob, 20000), "No timers on a shared bus");
+        sharedBus->end();
+        sharedBus.reset();
+    }
+    DEFINE_TEST_CASE(pubsub_rate_limits) {
+        auto pubsub = PubSub::create(pub_sub::Transport::Queue, pub_sub::LoopMode::Manual);
+        pub_sub::VirtualClock clock(1000000);
+        pubsub->setClock(clock);
+        RecordingSubscriber everyThird;
+        RecordingSubscriber bursty;
+        RecordingSubscriber paced;
+        RecordingSubscriber unlimited;
+        pubsub->subscribe(&everyThird, Topic::Sample, pub_sub::RateLimit{.everyNth = 3});
+        pubsub->subscribe(&bursty, Topic::Anomaly, pub_sub::RateLimit{.burst = 2, .ratePerSecond = 1});
+        pubsub->subscribe(&paced, Topic::Pulse, pub_sub::RateLimit{.minIntervalMicros = 100000});
+        pubsub->subscribe(&unlimited, Topic::Sample);
+
+        for (int i = 0; i < 10; i++) {
+            pubsub->publish(Topic::Sample, i);
+        }
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(4, everyThird.count(), "Every third sample");
+        TEST_ASSERT_EQUAL_MESSAGE(9, everyThird.value(3), "Starting with the first");
+        TEST_ASSERT_EQUAL_MESSAGE(10, unlimited.count(), "The limit is per subscription");
+
+        for (int i = 0; i < 5; i++) {
+            pubsub->publish(Topic::Anomaly, i);
+        }
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(2, bursty.count(), "A burst of two");
+        clock.advance(1000000);
+        for (int i = 5; i < 8; i++) {
+            pubsub->publish(Topic::Anomaly, i);
+        }
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(3, bursty.count(), "One token refilled in a second");
+        TEST_ASSERT_EQUAL_MESSAGE(5, bursty.value(2), "The first after the refill");
+
+        pubsub->publish(Topic::Pulse, 1);
+        pubsub->pumpUntilIdle();
+        clock.advance(10000);
+        pubsub->publish(Topic::Pulse, 2);
+        pubsub->publish(Topic::Pulse, 3);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(1, paced.count(), "Too early ones held back");
+        clock.advance(89999);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(1, paced.count(), "Not before the interval is over");
+        clock.advance(1);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(2, paced.count(), "Held back one delivered");
+        TEST_ASSERT_EQUAL_MESSAGE(3, paced.value(1), "The latest value");
+        clock.advance(100000);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(2, paced.count(), "Nothing else held back");
+
+        // a held back message goes away with the subscription, and the limiter can be used again
+        clock.advance(10000);
+        pubsub->publish(Topic::Pulse, 4);
+        pubsub->publish(Topic::Pulse, 5);
+        pubsub->pumpUntilIdle();
+        pubsub->unsubscribe(&paced, Topic::Pulse);
+        pubsub->subscribe(&paced, Topic::Pulse, pub_sub::RateLimit{.everyNth = 2});
+        clock.advance(1000000);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(3, paced.count(), "Held back message dropped on unsubscribe");
+        pubsub->publish(Topic::Pulse, 6);
+        pubsub->publish(Topic::Pulse, 7);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(4, paced.count(), "New limit applies");
+        TEST_ASSERT_EQUAL_MESSAGE(6, paced.value(3), "First of the pair");
+        pubsub->end();
+    }
+
+    // takes as long as it is told on the virtual clock, and remembers the task it was called on
+    class SlowSubscriber final : public Subscriber {
+    public:
+        explicit SlowSubscriber(pub_sub::VirtualClock& clock) : m_clock(clock) {}
+        void subscriberCallback(const Topic topic, const Payload& payload) override {
+            m_clock.advance(m_micros.load());
+            m_task = xTaskGetCurrentTaskHandle();
+            m_count++;
+        }
+        void take(const int64_t micros) { m_micros.store(micros); }
+        int count() const { return m_count.load(); }
+        TaskHandle_t task() const { return m_task.load(); }
+    private:
+        pub_sub::VirtualClock& m_clock;
+        std::atomic<int64_t> m_micros = 0;
+        std::atomic<TaskHandle_t> m_task = nullptr;
+        std::atomic<int> m_count = 0;
+    };
+
+    DEFINE_TEST_CASE(pubsub_callback_budgets) {
+        auto pubsub = PubSub::create(pub_sub::Transport::Queue, pub_sub::LoopMode::Manual);
+        pub_sub::VirtualClock clock(1000000);
+        pubsub->setClock(clock);
+        // stands in for the FlowDetector: no budget, and every sample whatever the others do
+        RecordingSubscriber steady;
+        SlowSubscriber decimated(clock);
+        SlowSubscriber moved(clock);
+        pubsub->subscribe(&steady, Topic::Sample);
+        pubsub->subscribe(&decimated, Topic::Sample);
+        pubsub->subscribe(&moved, Topic::Pulse);
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->setCallbackBudget(&decimated,
+            pub_sub::CallbackBudget{.budgetMicros = 1000, .strikeLimit = 3, .degrade = pub_sub::Degrade::Decimate, .everyNth = 4}),
+            "Budget set");
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->setCallbackBudget(&moved, pub_sub::CallbackBudget{.budgetMicros = 1000, .strikeLimit = 2}),
+            "Budget set");
+
+        int sample = 0;
+        const auto publishSamples = [&pubsub, &sample](const int count) {
+            for (int i = 0; i < count; i++) {
+                pubsub->publish(Topic::Sample, sample++);
+            }
+            pubsub->pumpUntilIdle();
+        };
+        decimated.take(500);
+        publishSamples(2);
+        auto stats = pubsub->getCallbackStats(&decimated);
+        TEST_ASSERT_EQUAL_MESSAGE(2, stats.calls, "Calls counted");
+        TEST_ASSERT_EQUAL_MESSAGE(0, stats.overruns, "Within budget");
+        // an overrun now and then is forgiven by the calls within budget
+        decimated.take(5000);
+        publishSamples(1);
+        decimated.take(500);
+        publishSamples(1);
+        decimated.take(5000);
+        publishSamples(2);
+        TEST_ASSERT_FALSE_MESSAGE(pubsub->getCallbackStats(&decimated).degraded, "Two strikes");
+        publishSamples(1);
+        stats = pubsub->getCallbackStats(&decimated);
+        TEST_ASSERT_TRUE_MESSAGE(stats.degraded, "Degraded after three strikes");
+        TEST_ASSERT_EQUAL_MESSAGE(4, stats.overruns, "Overruns counted");
+        TEST_ASSERT_EQUAL_MESSAGE(5000, stats.maxMicros, "Longest call measured");
+        TEST_ASSERT_EQUAL_MESSAGE(7, decimated.count(), "Everything delivered before");
+        publishSamples(8);
+        TEST_ASSERT_EQUAL_MESSAGE(9, decimated.count(), "Every fourth sample after");
+        TEST_ASSERT_EQUAL_MESSAGE(sample, steady.count(), "The others get every sample");
+
+        moved.take(2000);
+        pubsub->publish(Topic::Pulse, 1);
+        pubsub->publish(Topic::Pulse, 2);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_TRUE_MESSAGE(pubsub->getCallbackStats(&moved).degraded, "Degraded after two strikes");
+        TEST_ASSERT_TRUE_MESSAGE(moved.task() == xTaskGetCurrentTaskHandle(), "Called by the dispatcher so far");
+        pubsub->publish(Topic::Pulse, 3);
+        pubsub->pumpUntilIdle();
+        TEST_ASSERT_EQUAL_MESSAGE(3, moved.count(), "Still gets everything");
+        TEST_ASSERT_TRUE_MESSAGE(moved.task() != xTaskGetCurrentTaskHandle(), "Called from an inbox now");
+
+        // the budget goes with the last subscription
+        pubsub->unsubscribe(&moved);
+        TEST_ASSERT_EQUAL_MESSAGE(0, pubsub->getCallbackStats(&moved).calls, "Budget freed");
+        pubsub->end();
+    }
 }
@@ -2,7 +2,7 @@
 
 #ifdef ESP_PLATFORM
 #define DEFINE_TEST_CASE(test_name) \
-    TEST_CASE(#test_name, "[magneto_sensor]") 
+    TEST_CASE(#test_name, "[pub_sub]") 
 #else
 #define DEFINE_TEST_CASE(test_name) \
     void test_##test_name()
@@ -10,12 +10,71 @@
     namespace pub_sub_test {
         void test_pubsub_all_payload_types();
         void test_pubsub_multiple_subscribers();
+        void test_pubsub_all_topics_and_presence();
+        void test_pubsub_wakes_on_publish_and_end();
+        void test_pubsub_flush();
+        void test_pubsub_publish_batch();
+        void test_pubsub_priority_lanes();
+        void test_pubsub_inbox();
+        void test_pubsub_typed_topics();
+        void test_pubsub_subscribe_while_dispatching();
+        void test_pubsub_backpressure();
+        void test_pubsub_publish_invalid_topic();
+        void test_pubsub_metrics();
+        void test_pubsub_inline_dispatch();
+        void test_pubsub_string_arena();
+        void test_pubsub_loaned_blocks();
+        void test_pubsub_record_replay();
+        void test_pubsub_manual_pump();
+        void test_pubsub_deferred_publish();
+        void test_pubsub_retained_topics();
+        void test_pubsub_publish_from_isr();
+        void test_pubsub_shared_executor();
+        void test_pubsub_timers();
+        void test_pubsub_rate_limits();
+        void test_pubsub_callback_budgets();
+        void test_mpsc_ring_buffer();
+        void test_static_queue_transport();
+        void test_packed_queue_transport();
+        void test_pubsub_transport_stress();
+        void test_pubsub_batch_benchmark();
+        void test_pubsub_lane_latency();
 
         inline void run_tests() {
             RUN_TEST(test_pubsub_all_payload_types);
 
             // This test crashes in host_test (not in ESP32) and is disabled for now
             RUN_TEST(test_pubsub_multiple_subscribers);
+            RUN_TEST(test_pubsub_all_topics_and_presence);
+            RUN_TEST(test_pubsub_wakes_on_publish_and_end);
+            RUN_TEST(test_pubsub_flush);
+            RUN_TEST(test_pubsub_publish_batch);
+            RUN_TEST(test_pubsub_priority_lanes);
+            RUN_TEST(test_pubsub_inbox);
+            RUN_TEST(test_pubsub_typed_topics);
+            RUN_TEST(test_pubsub_subscribe_while_dispatching);
+            RUN_TEST(test_pubsub_backpressure);
+            RUN_TEST(test_pubsub_publish_invalid_topic);
+            RUN_TEST(test_pubsub_metrics);
+            RUN_TEST(test_pubsub_inline_dispatch);
+            RUN_TEST(test_pubsub_string_arena);
+            RUN_TEST(test_pubsub_loaned_blocks);
+            RUN_TEST(test_pubsub_record_replay);
+            RUN_TEST(test_pubsub_manual_pump);
+            RUN_TEST(test_pubsub_deferred_publish);
+            RUN_TEST(test_pubsub_retained_topics);
+            RUN_TEST(test_pubsub_publish_from_isr);
+            RUN_TEST(test_pubsub_shared_executor);
+            RUN_TEST(test_pubsub_timers);
+            RUN_TEST(test_pubsub_rate_limits);
+            RUN_TEST(test_pubsub_callback_budgets);
+
+            RUN_TEST(test_mpsc_ring_buffer);
+            RUN_TEST(test_static_queue_transport);
+            RUN_TEST(test_packed_queue_transport);
+            RUN_TEST(test_pubsub_transport_stress);
+            RUN_TEST(test_pubsub_batch_benchmark);
+            RUN_TEST(test_pubsub_lane_latency);
         }
     }
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "PubSub.hpp"
+#include <atomic>
 
 namespace pub_sub_test {
     using pub_sub::Subscriber;
@@ -14,7 +15,7 @@ namespace pub_sub_test {
         const char* getBuffer() const { 
             return m_buffer; 
         }
-        uint32_t getCallCount() const { return m_callCount; }
+        uint32_t getCallCount() const { return m_callCount.load(); }
 
         void reset() override;
 
@@ -24,7 +25,8 @@ namespace pub_sub_test {
         static const char* kTag;
         int m_id;
         char m_buffer[100] = {0};
-        uint32_t m_callCount = 0;
+        // tests poll it while the event loop or an inbox task calls back
+        std::atomic<uint32_t> m_callCount = 0;
         MessageVisitor<100> m_messageVisitor;
     };
 }
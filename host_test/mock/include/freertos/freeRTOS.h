@@ -17,5 +17,8 @@ using BaseType_t = int;
 
 typedef uint32_t TickType_t;
 
+// as on the ESP32, stack sizes are in bytes
+using StackType_t = uint8_t;
+
 #define pdMS_TO_TICKS(xTimeInMs) ( ( TickType_t ) ( ( ( TickType_t ) ( xTimeInMs ) * ( TickType_t ) configTICK_RATE_HZ ) / ( TickType_t ) 1000U ) )
 
@@ -1,87 +1,99 @@
 #pragma once
 
 #include <cstdint>
-#include <queue>
+#include <deque>
+#include <vector>
 #include <cstdio>
 #include <memory>
 #include <cstring>
 #include <mutex>
+#include <chrono>
+#include <condition_variable>
 #include "freeRTOS.h"
 #include "../esp_log.h"
 
-// Mock FreeRTOS types and functions
-using QueueHandle_t = std::queue<std::shared_ptr<std::vector<uint8_t>>>*;
-
-static int m_itemSize = 0;
-static std::mutex queueMutex; // Mutex for synchronizing access to the queue
+// Mock FreeRTOS types and functions. Honors the queue length and the timeouts, so senders block when the queue is full.
+
+struct MockQueue {
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<std::vector<uint8_t>> items;
+    size_t length = 0;
+    size_t itemSize = 0;
+};
+
+using QueueHandle_t = MockQueue*;
+
+inline QueueHandle_t xQueueCreate(const int queueLength, const int itemSize) {
+    if (queueLength <= 0 || itemSize <= 0) return nullptr;
+    auto queue = new MockQueue();
+    queue->length = queueLength;
+    queue->itemSize = itemSize;
+    return queue;
+}
 
+// the mock doesn't use the buffers; the queue lives on the heap anyway
+struct StaticQueue_t {};
 
-inline QueueHandle_t xQueueCreate(int queueLength, int itemSize) {
-    m_itemSize = itemSize;
-    return new std::queue<std::shared_ptr<std::vector<uint8_t>>>();
+inline QueueHandle_t xQueueCreateStatic(const int queueLength, const int itemSize, uint8_t*, StaticQueue_t*) {
+    return xQueueCreate(queueLength, itemSize);
 }
 
 inline void vQueueDelete(QueueHandle_t& queue) {
     delete queue;
+    queue = nullptr;
 }
 
-inline bool isAligned(const void* const ptr, const size_t alignment) {
-    return reinterpret_cast<uintptr_t>(ptr) % alignment == 0;
-}
-
-
-// Function to display the contents of copied_item
-inline void displayCopiedItem(const std::shared_ptr<std::vector<uint8_t>>& copiedItem) {
-    ESP_LOGI( "displayCopiedItem", "Contents of copied_item:");
-    for (const auto& byte : *copiedItem) {
-        printf("%02x ", byte);
+// waits on the condition until the predicate holds or the timeout expires. portMAX_DELAY waits forever.
+template <typename Predicate>
+bool waitForQueue(std::condition_variable& condition, std::unique_lock<std::mutex>& lock, const TickType_t ticks, Predicate predicate) {
+    if (ticks == portMAX_DELAY) {
+        condition.wait(lock, predicate);
+        return true;
     }
-    printf("\n");
+    return condition.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), predicate);
 }
 
-inline bool xQueueSend(QueueHandle_t& queue, const void* const item, int) {
-    constexpr auto kTag = "xQueueSend";
-    std::lock_guard<std::mutex> lock(queueMutex);
-
-    if (m_itemSize <= 0) {
-        ESP_LOGE(kTag, "Invalid item size");
-        return false;
+inline BaseType_t xQueueSend(const QueueHandle_t queue, const void* const item, const TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!waitForQueue(queue->notFull, lock, ticks, [queue] { return queue->items.size() < queue->length; })) {
+        return pdFAIL;
     }
+    const auto realItem = static_cast<const uint8_t*>(item);
+    queue->items.emplace_back(realItem, realItem + queue->itemSize);
+    lock.unlock();
+    queue->notEmpty.notify_one();
+    return pdPASS;
+}
 
-        // Check alignment
-    if (!isAligned(item, alignof(uint8_t))) {
-        ESP_LOGE(kTag, "Misaligned item pointer");
-        return false;
+// there are no interrupts on the host, so this is a send that doesn't wait, which always asks for a yield
+inline BaseType_t xQueueSendFromISR(const QueueHandle_t queue, const void* const item, BaseType_t* higherPriorityTaskWoken) {
+    const auto result = xQueueSend(queue, item, 0);
+    if (result == pdPASS && higherPriorityTaskWoken != nullptr) {
+        *higherPriorityTaskWoken = pdTRUE;
     }
+    return result;
+}
 
-    try {
-        auto realItem = static_cast<const uint8_t*>(item);
-        const auto copiedItem = std::make_shared<std::vector<uint8_t>>(realItem, realItem + m_itemSize);
-        // displayCopiedItem(copied_item);
-        queue->push(copiedItem);
-    } catch (const std::bad_alloc& e) {
-        ESP_LOGE(kTag, "Bad allocation Exception in xQueueSend: %s", e.what());
-        return false;
-    } catch (const std::exception& e) {
-        ESP_LOGE(kTag, "Exception in xQueueSend: %s", e.what());
-        return false;
-    } catch (...) {
-        ESP_LOGE(kTag, "Unknown exception in xQueueSend");
-        return false;
+inline BaseType_t xQueueReceive(const QueueHandle_t queue, void* item, const TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!waitForQueue(queue->notEmpty, lock, ticks, [queue] { return !queue->items.empty(); })) {
+        return pdFAIL;
     }
-    return true;
+    std::memcpy(item, queue->items.front().data(), queue->itemSize);
+    queue->items.pop_front();
+    lock.unlock();
+    queue->notFull.notify_one();
+    return pdPASS;
 }
 
-inline bool xQueueReceive(QueueHandle_t& queue, void* item, int) {
-    std::lock_guard<std::mutex> lock(queueMutex);
-
-    if (queue->empty()) return false;
-    const auto copiedItem = queue->front();
-    std::memcpy(item, copiedItem->data(), copiedItem->size());
-    queue->pop();
-    return true;
+inline UBaseType_t uxQueueMessagesWaiting(const QueueHandle_t queue) {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->items.size();
 }
 
-inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
-    return queue->size();
-}
\ No newline at end of file
+inline UBaseType_t uxQueueSpacesAvailable(const QueueHandle_t queue) {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->length - queue->items.size();
+}
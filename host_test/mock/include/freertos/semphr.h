@@ -4,30 +4,65 @@
 #include <memory>
 #include <mutex>
 #include <chrono>
+#include <condition_variable>
 #include "freeRTOS.h"
 
 constexpr auto kStag = "semphr";
+
+// A mutex is a semaphore with a maximum count of one that starts out given.
+// Unlike std::mutex, it may be given by another task than the one that took it, as FreeRTOS allows for semaphores.
+struct MockSemaphore {
+    MockSemaphore(const uint32_t maxCount, const uint32_t initialCount) : maxCount(maxCount), count(initialCount) {}
+    std::mutex mutex;
+    std::condition_variable available;
+    const uint32_t maxCount;
+    uint32_t count;
+};
+
 // Mock FreeRTOS types and functions
-using SemaphoreHandle_t = std::shared_ptr<std::timed_mutex>;
+using SemaphoreHandle_t = std::shared_ptr<MockSemaphore>;
 
 inline SemaphoreHandle_t xSemaphoreCreateMutex() {
-    return std::make_shared<std::timed_mutex>();
+    return std::make_shared<MockSemaphore>(1, 1);
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateCounting(const uint32_t maxCount, const uint32_t initialCount) {
+    return std::make_shared<MockSemaphore>(maxCount, initialCount);
+}
+
+// the mock doesn't use the buffer; the semaphore lives on the heap anyway
+struct StaticSemaphore_t {};
+
+inline SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t*) {
+    return xSemaphoreCreateMutex();
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateCountingStatic(const uint32_t maxCount, const uint32_t initialCount, StaticSemaphore_t*) {
+    return xSemaphoreCreateCounting(maxCount, initialCount);
 }
 
 inline bool xSemaphoreTake(const SemaphoreHandle_t& semaphore, const uint32_t timeout) {
+    std::unique_lock lock(semaphore->mutex);
+    const auto isAvailable = [&semaphore] { return semaphore->count > 0; };
     if (timeout == portMAX_DELAY) {
-        semaphore->lock();
-        return true;
+        semaphore->available.wait(lock, isAvailable);
+    } else if (!semaphore->available.wait_for(lock, std::chrono::milliseconds(timeout * portTICK_PERIOD_MS), isAvailable)) {
+        return false;
     }
-    const auto timeoutDuration = std::chrono::milliseconds(timeout * portTICK_PERIOD_MS);
-    return semaphore->try_lock_for(timeoutDuration);
+    semaphore->count--;
+    return true;
 }
 
 inline bool xSemaphoreGive(const SemaphoreHandle_t& semaphore) {
-    semaphore->unlock();
+    {
+        std::lock_guard lock(semaphore->mutex);
+        if (semaphore->count >= semaphore->maxCount) return false;
+        semaphore->count++;
+    }
+    semaphore->available.notify_one();
     return true;
 }
 
 inline void vSemaphoreDelete(SemaphoreHandle_t& semaphore) {
     semaphore.reset();
-}
\ No newline at end of file
+}
@@ -6,6 +6,10 @@
 #include <memory>
 #include <cstdio>
 #include <ranges>
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
 
 #include "freeRTOS.h"
 #include "esp_log.h"
@@ -18,9 +22,15 @@ constexpr auto kTaskTag = "task";
 
 struct TaskControlBlock {
     std::thread thread;
+    // task notification value, used as a lightweight counting semaphore
+    std::mutex notifyMutex;
+    std::condition_variable notifyCondition;
+    uint32_t notifyValue = 0;
 };
 
-static std::unordered_map<std::thread::id, TaskHandle_t> taskThreads;
+// inline so all translation units share the same task administration; tasks may delete themselves concurrently
+inline std::unordered_map<std::thread::id, TaskHandle_t> taskThreads;
+inline std::recursive_mutex taskThreadsMutex;
 
 
 inline BaseType_t xTaskCreate(const TaskFunction_t& task, const char* name, int, void* param, int, TaskHandle_t* taskHandle) {
@@ -29,6 +39,8 @@ inline BaseType_t xTaskCreate(const TaskFunction_t& task, const char* name, int,
         return pdFAIL;
     }
     auto tcb = std::make_shared<TaskControlBlock>();
+    // hold the lock until the task is registered, so it can find itself if it deletes itself right away
+    std::lock_guard<std::recursive_mutex> lock(taskThreadsMutex);
     tcb->thread = std::thread([task, param] {
         task(param);
         ESP_LOGI(kTaskTag, "Task terminated");
@@ -40,9 +52,75 @@ inline BaseType_t xTaskCreate(const TaskFunction_t& task, const char* name, int,
     return pdPASS;
 }
 
+// there is only one "core" on the host, so the affinity is ignored
+constexpr BaseType_t tskNO_AFFINITY = 0x7FFFFFFF;
+
+inline BaseType_t xTaskCreatePinnedToCore(const TaskFunction_t& task, const char* name, const int stackDepth, void* param, const int priority, TaskHandle_t* taskHandle, BaseType_t) {
+    return xTaskCreate(task, name, stackDepth, param, priority, taskHandle);
+}
+
+// the mock doesn't use the buffers; the task runs on a thread with its own stack
+struct StaticTask_t {};
+
+inline TaskHandle_t xTaskCreateStaticPinnedToCore(const TaskFunction_t& task, const char* name, const uint32_t stackDepth, void* param, const UBaseType_t priority, StackType_t*, StaticTask_t*, BaseType_t) {
+    TaskHandle_t handle;
+    return xTaskCreate(task, name, static_cast<int>(stackDepth), param, static_cast<int>(priority), &handle) == pdPASS ? handle : nullptr;
+}
+
+inline TaskHandle_t xTaskCreateStatic(const TaskFunction_t& task, const char* name, const uint32_t stackDepth, void* param, const UBaseType_t priority, StackType_t* stack, StaticTask_t* buffer) {
+    return xTaskCreateStaticPinnedToCore(task, name, stackDepth, param, priority, stack, buffer, tskNO_AFFINITY);
+}
+
 inline void vTaskDelay(int ticks) {
-    // just sleep for 1 ms to switch context, this is a mock after all
-    //std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    // don't actually sleep, this is a mock after all. But do give other threads a chance, as callers tend to spin on this.
+    std::this_thread::yield();
+}
+
+// ticks since the first call, derived from the steady clock
+inline TickType_t xTaskGetTickCount() {
+    static const auto start = std::chrono::steady_clock::now();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    return static_cast<TickType_t>(elapsed.count() / portTICK_PERIOD_MS);
+}
+
+// Returns the control block of the calling thread. Threads not created via xTaskCreate (e.g. the main thread) get one on first use.
+inline TaskHandle_t xTaskGetCurrentTaskHandle() {
+    std::lock_guard<std::recursive_mutex> lock(taskThreadsMutex);
+    auto& tcb = taskThreads[std::this_thread::get_id()];
+    if (tcb == nullptr) {
+        tcb = std::make_shared<TaskControlBlock>();
+    }
+    return tcb;
+}
+
+inline BaseType_t xTaskNotifyGive(const TaskHandle_t& taskHandle) {
+    {
+        std::lock_guard<std::mutex> lock(taskHandle->notifyMutex);
+        taskHandle->notifyValue++;
+    }
+    taskHandle->notifyCondition.notify_one();
+    return pdPASS;
+}
+
+inline void vTaskNotifyGiveFromISR(const TaskHandle_t& taskHandle, BaseType_t* higherPriorityTaskWoken) {
+    xTaskNotifyGive(taskHandle);
+    if (higherPriorityTaskWoken != nullptr) {
+        *higherPriorityTaskWoken = pdTRUE;
+    }
+}
+
+inline uint32_t ulTaskNotifyTake(const BaseType_t clearCountOnExit, const TickType_t ticksToWait) {
+    const auto tcb = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(tcb->notifyMutex);
+    const auto notified = [&tcb] { return tcb->notifyValue > 0; };
+    if (ticksToWait == portMAX_DELAY) {
+        tcb->notifyCondition.wait(lock, notified);
+    } else if (!tcb->notifyCondition.wait_for(lock, std::chrono::milliseconds(ticksToWait * portTICK_PERIOD_MS), notified)) {
+        return 0;
+    }
+    const auto value = tcb->notifyValue;
+    tcb->notifyValue = clearCountOnExit == pdTRUE ? 0 : value - 1;
+    return value;
 }
 
 // Yield the processor to other threads
@@ -50,9 +128,13 @@ inline void taskYIELD() {
     std::this_thread::yield();
 }
 
+#define portYIELD_FROM_ISR(xHigherPriorityTaskWoken) do { if (xHigherPriorityTaskWoken) taskYIELD(); } while (0)
+
 // delete a task by handle. Expects the handle to be valid. Internal use only.
 inline void deleteTask(const TaskHandle_t& taskHandle) {
     ESP_LOGD(kTaskTag, "Deleting task %p", taskHandle.get());
+    // get the id before detaching or joining, as the thread object loses it after that
+    const auto id = taskHandle->thread.get_id();
     if (taskHandle->thread.joinable()) {
         if (taskHandle->thread.get_id() == std::this_thread::get_id()) {
             ESP_LOGW(kTaskTag, "Detaching the current task to avoid deadlock");
@@ -68,14 +150,22 @@ inline void deleteTask(const TaskHandle_t& taskHandle) {
             }
         }
     }
-    taskThreads.erase(taskHandle->thread.get_id());
+    std::lock_guard<std::recursive_mutex> lock(taskThreadsMutex);
+    taskThreads.erase(id);
 }
 
 inline void vTaskDelete(const TaskHandle_t& taskHandle) {
     if (taskHandle == nullptr) {
         // Delete the current task
-        if (const auto it = taskThreads.find(std::this_thread::get_id()); it != taskThreads.end()) {
-            deleteTask(it->second);
+        TaskHandle_t current;
+        {
+            std::lock_guard<std::recursive_mutex> lock(taskThreadsMutex);
+            if (const auto it = taskThreads.find(std::this_thread::get_id()); it != taskThreads.end()) {
+                current = it->second;
+            }
+        }
+        if (current != nullptr) {
+            deleteTask(current);
         }
     } else {
         // Delete the specified task
@@ -86,8 +176,16 @@ inline void vTaskDelete(const TaskHandle_t& taskHandle) {
 // Function to join all threads (to be called at the end of the test)
 // note: make sure that all tasks are terminated before calling this function
 inline void deleteAllTasks() {
-    for (auto& tcb : taskThreads | std::views::values) {
+    std::vector<TaskHandle_t> tasks;
+    {
+        std::lock_guard<std::recursive_mutex> lock(taskThreadsMutex);
+        for (auto& tcb : taskThreads | std::views::values) {
+            tasks.push_back(tcb);
+        }
+    }
+    for (const auto& tcb : tasks) {
         deleteTask(tcb);
     }
+    std::lock_guard<std::recursive_mutex> lock(taskThreadsMutex);
     taskThreads.clear();
 }
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+
+// the defaults of the Kconfig options the components use. Define CONFIG_PUB_SUB_STATIC_ALLOCATION to test the static mode.
+
+#define CONFIG_PUB_SUB_MAX_SUBSCRIBERS_PER_TOPIC 8
+#define CONFIG_PUB_SUB_HIGH_LANE_DEPTH 16
+#define CONFIG_PUB_SUB_LANE_DEPTH 100
+#define CONFIG_PUB_SUB_MAX_INBOXES 8
+#define CONFIG_PUB_SUB_STRING_SLOTS 16
+#define CONFIG_PUB_SUB_STRING_LENGTH 48
+#define CONFIG_PUB_SUB_BLOCK_COUNT 4
+#define CONFIG_PUB_SUB_BLOCK_SIZE 512
+#define CONFIG_PUB_SUB_DEFERRED_DEPTH 32
+#define CONFIG_PUB_SUB_ISR_QUEUE_DEPTH 16
+#define CONFIG_PUB_SUB_EXECUTOR_TASKS 2
+#define CONFIG_PUB_SUB_MAX_TIMERS 8
+#define CONFIG_PUB_SUB_MAX_RATE_LIMITS 8
+#define CONFIG_PUB_SUB_MAX_CALLBACK_BUDGETS 8
+#define CONFIG_PUB_SUB_EXECUTOR_MAX_BUSES 8
+#define CONFIG_PUB_SUB_EVENT_LOOP_STACK_SIZE 16384
+#define CONFIG_PUB_SUB_EXECUTOR_STACK_SIZE 8192
+
+#ifdef CONFIG_PUB_SUB_STATIC_ALLOCATION
+#define CONFIG_PUB_SUB_MAX_INBOX_DEPTH 32
+#define CONFIG_PUB_SUB_INBOX_STACK_SIZE 4096
+#define CONFIG_PUB_SUB_STATIC_EVENT_LOOP_STACK 1
+#endif